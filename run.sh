@@ -5,10 +5,26 @@ make
 mkdir -p iso/boot/grub
 cp kernel ./iso/boot/kernel
 cp $1 iso/boot/initrd
+
+# anything in $MODULES is loaded as well, each as a filesystem labelled with its file name
+module_lines=""
+for module in $MODULES; do
+    name=$(basename "$module")
+    cp "$module" "iso/boot/$name"
+    module_lines="$module_lines
+    module /boot/$name $name"
+done
+
+# anything in $CDROOT goes on the disc as it is, to be read off it as it's needed (see src/component/cdrom.c), which
+# keeps a large OS from having to be loaded before the kernel starts
+if [ -n "$CDROOT" ]; then
+    cp -r "$CDROOT"/. iso/
+fi
+
 cat > iso/boot/grub/grub.cfg << EOF
 menuentry "openos" {
-    multiboot /boot/kernel
-    module /boot/initrd
+    multiboot /boot/kernel $KERNEL_ARGS
+    module /boot/initrd$module_lines
 }
 EOF
 grub-mkrescue -o kernel.iso iso
@@ -0,0 +1,416 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "buffer.h"
+
+/*
+ * fixed size blocks of bytes for Lua, so binary data can be picked apart without making a new string for every slice
+ * of it. offsets start at 0, since that's how binary formats are described, and everything is bounds checked. numbers
+ * are little endian unless the accessor ends in "be".
+ *
+ * buffer.new and buffer.fromstring make buffers that own their contents, which live in the userdata itself. views
+ * share memory with something else instead: buffer.view makes one of part of another buffer, which it keeps alive
+ * through its user value, and components can make them of memory of their own (see buffer_push_view), like the
+ * initrd does for files in the archive so they can be read without being copied
+ */
+
+#define BUFFER_METATABLE "buffer"
+
+// how many views with something to release haven't been collected yet
+static size_t views_open = 0;
+
+enum accessor_kind {
+    UNSIGNED,
+    SIGNED,
+    FLOAT
+};
+
+struct accessor {
+    const char *read;
+    const char *write;
+    uint8_t size;
+    uint8_t kind;
+    bool big_endian;
+};
+
+static const struct accessor accessors[] = {
+    {"readu8", "writeu8", 1, UNSIGNED, false},
+    {"readi8", "writei8", 1, SIGNED, false},
+    {"readu16", "writeu16", 2, UNSIGNED, false},
+    {"readi16", "writei16", 2, SIGNED, false},
+    {"readu32", "writeu32", 4, UNSIGNED, false},
+    {"readi32", "writei32", 4, SIGNED, false},
+    {"readi64", "writei64", 8, SIGNED, false},
+    {"readu16be", "writeu16be", 2, UNSIGNED, true},
+    {"readi16be", "writei16be", 2, SIGNED, true},
+    {"readu32be", "writeu32be", 4, UNSIGNED, true},
+    {"readi32be", "writei32be", 4, SIGNED, true},
+    {"readi64be", "writei64be", 8, SIGNED, true},
+    {"readf32", "writef32", 4, FLOAT, false},
+    {"readf64", "writef64", 8, FLOAT, false},
+    {NULL, NULL, 0, 0, false}
+};
+
+// pushes a buffer that owns its contents, which start zeroed
+struct buffer *buffer_push_new(lua_State *L, size_t size) {
+    if (size > SIZE_MAX - sizeof(struct buffer))
+        luaL_error(L, "buffer too large");
+
+    struct buffer *buffer = lua_newuserdatauv(L, sizeof(struct buffer) + size, 1);
+
+    buffer->data = (char *) (buffer + 1);
+    buffer->size = size;
+    buffer->read_only = false;
+    buffer->release = NULL;
+    buffer->owner = NULL;
+    buffer->object = NULL;
+    memset(buffer->data, 0, size);
+
+    luaL_setmetatable(L, BUFFER_METATABLE);
+    return buffer;
+}
+
+/*
+ * pushes an empty read-only view for the caller to point at memory it owns. it's made before that memory is set aside
+ * since making it can raise an error, then buffer_set_release says how to let go of it
+ */
+struct buffer *buffer_push_view(lua_State *L) {
+    struct buffer *buffer = lua_newuserdatauv(L, sizeof(struct buffer), 1);
+
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->read_only = true;
+    buffer->release = NULL;
+    buffer->owner = NULL;
+    buffer->object = NULL;
+
+    luaL_setmetatable(L, BUFFER_METATABLE);
+    return buffer;
+}
+
+// has a view release what it points at once it's collected
+void buffer_set_release(struct buffer *buffer, void (*release)(void *owner, void *object), void *owner, void *object) {
+    buffer->release = release;
+    buffer->owner = owner;
+    buffer->object = object;
+    views_open ++;
+}
+
+// how many views of memory outside the Lua heap there are, which couldn't survive being snapshotted
+size_t buffer_views_open(void) {
+    return views_open;
+}
+
+static struct buffer *check_buffer(lua_State *L, int arg) {
+    return luaL_checkudata(L, arg, BUFFER_METATABLE);
+}
+
+static struct buffer *check_writable(lua_State *L, int arg) {
+    struct buffer *buffer = check_buffer(L, arg);
+
+    if (buffer->read_only)
+        luaL_error(L, "buffer is read-only");
+
+    return buffer;
+}
+
+// checks that count bytes from an offset are in a buffer, and returns where they start
+static char *check_range(lua_State *L, struct buffer *buffer, lua_Integer offset, size_t count) {
+    if (offset < 0 || (lua_Unsigned) offset > buffer->size || count > buffer->size - offset)
+        luaL_error(L, "access out of bounds");
+
+    return buffer->data + offset;
+}
+
+static size_t check_count(lua_State *L, int arg) {
+    lua_Integer count = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, count >= 0 && (lua_Unsigned) count <= SIZE_MAX, arg, "count out of range");
+
+    return count;
+}
+
+// an optional count argument, which defaults to everything from the offset to the end
+static size_t opt_count(lua_State *L, struct buffer *buffer, lua_Integer offset, int arg) {
+    if (!lua_isnoneornil(L, arg))
+        return check_count(L, arg);
+
+    return offset >= 0 && (lua_Unsigned) offset <= buffer->size ? buffer->size - offset : 0;
+}
+
+// the bytes of a string or buffer argument
+static const char *check_bytes(lua_State *L, int arg, size_t *size) {
+    if (lua_type(L, arg) == LUA_TSTRING)
+        return lua_tolstring(L, arg, size);
+
+    struct buffer *buffer = check_buffer(L, arg);
+    *size = buffer->size;
+
+    return buffer->data;
+}
+
+static int buffer_read(lua_State *L) {
+    const struct accessor *accessor = lua_touserdata(L, lua_upvalueindex(1));
+    const uint8_t *bytes = (const uint8_t *) check_range(L, check_buffer(L, 1), luaL_checkinteger(L, 2), accessor->size);
+    uint64_t value = 0;
+
+    for (int i = 0; i < accessor->size; i ++)
+        value = (value << 8) | bytes[accessor->big_endian ? i : accessor->size - 1 - i];
+
+    if (accessor->kind == FLOAT && accessor->size == 4) {
+        uint32_t bits = value;
+        float number;
+        memcpy(&number, &bits, sizeof(number));
+        lua_pushnumber(L, number);
+    } else if (accessor->kind == FLOAT) {
+        double number;
+        memcpy(&number, &value, sizeof(number));
+        lua_pushnumber(L, number);
+    } else if (accessor->kind == SIGNED && accessor->size < 8) {
+        int shift = 64 - accessor->size * 8;
+        lua_pushinteger(L, (int64_t) (value << shift) >> shift);
+    } else {
+        lua_pushinteger(L, (lua_Integer) value);
+    }
+
+    return 1;
+}
+
+static int buffer_write(lua_State *L) {
+    const struct accessor *accessor = lua_touserdata(L, lua_upvalueindex(1));
+    uint8_t *bytes = (uint8_t *) check_range(L, check_writable(L, 1), luaL_checkinteger(L, 2), accessor->size);
+    uint64_t value;
+
+    if (accessor->kind == FLOAT && accessor->size == 4) {
+        float number = luaL_checknumber(L, 3);
+        uint32_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        value = bits;
+    } else if (accessor->kind == FLOAT) {
+        double number = luaL_checknumber(L, 3);
+        memcpy(&value, &number, sizeof(value));
+    } else {
+        // anything too big for the size is truncated, like a cast in C
+        value = (uint64_t) luaL_checkinteger(L, 3);
+    }
+
+    for (int i = accessor->size - 1; i >= 0; i --, value >>= 8)
+        bytes[accessor->big_endian ? i : accessor->size - 1 - i] = value & 0xff;
+
+    return 0;
+}
+
+// buffer.new(size[, byte]) makes a buffer filled with zeros, or the given byte
+static int buffer_new(lua_State *L) {
+    size_t size = check_count(L, 1);
+    int byte = luaL_optinteger(L, 2, 0);
+
+    struct buffer *buffer = buffer_push_new(L, size);
+
+    if (byte != 0)
+        memset(buffer->data, byte, size);
+
+    return 1;
+}
+
+static int buffer_from_string(lua_State *L) {
+    size_t size;
+    const char *string = luaL_checklstring(L, 1, &size);
+
+    memcpy(buffer_push_new(L, size)->data, string, size);
+    return 1;
+}
+
+// buffer.tostring(b[, offset[, count]]) copies all of a buffer, or part of it, into a string
+static int buffer_to_string(lua_State *L) {
+    struct buffer *buffer = check_buffer(L, 1);
+    lua_Integer offset = luaL_optinteger(L, 2, 0);
+    size_t count = opt_count(L, buffer, offset, 3);
+
+    lua_pushlstring(L, check_range(L, buffer, offset, count), count);
+    return 1;
+}
+
+static int buffer_len(lua_State *L) {
+    lua_pushinteger(L, check_buffer(L, 1)->size);
+    return 1;
+}
+
+static int buffer_is_read_only(lua_State *L) {
+    lua_pushboolean(L, check_buffer(L, 1)->read_only);
+    return 1;
+}
+
+// buffer.readstring(b, offset, count)
+static int buffer_read_string(lua_State *L) {
+    struct buffer *buffer = check_buffer(L, 1);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    size_t count = check_count(L, 3);
+
+    lua_pushlstring(L, check_range(L, buffer, offset, count), count);
+    return 1;
+}
+
+// buffer.writestring(b, offset, s[, count]) writes all of a string, or the start of it
+static int buffer_write_string(lua_State *L) {
+    struct buffer *buffer = check_writable(L, 1);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    size_t size;
+    const char *string = luaL_checklstring(L, 3, &size);
+    size_t count = lua_isnoneornil(L, 4) ? size : check_count(L, 4);
+
+    luaL_argcheck(L, count <= size, 4, "count is longer than the string");
+    memcpy(check_range(L, buffer, offset, count), string, count);
+
+    return 0;
+}
+
+// buffer.fill(b, offset, byte[, count]) sets bytes from the offset to the end, or just count of them
+static int buffer_fill(lua_State *L) {
+    struct buffer *buffer = check_writable(L, 1);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    int byte = luaL_checkinteger(L, 3);
+    size_t count = opt_count(L, buffer, offset, 4);
+
+    memset(check_range(L, buffer, offset, count), byte, count);
+    return 0;
+}
+
+/*
+ * buffer.copy(target, offset, source[, source_offset[, count]]) copies from a buffer or string, which can be the same
+ * buffer with the ranges overlapping. without a count, everything from the source offset on is copied
+ */
+static int buffer_copy(lua_State *L) {
+    struct buffer *target = check_writable(L, 1);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    size_t source_size;
+    const char *source = check_bytes(L, 3, &source_size);
+    lua_Integer source_offset = luaL_optinteger(L, 4, 0);
+
+    if (source_offset < 0 || (lua_Unsigned) source_offset > source_size)
+        return luaL_error(L, "access out of bounds");
+
+    size_t count = lua_isnoneornil(L, 5) ? source_size - source_offset : check_count(L, 5);
+
+    if (count > source_size - source_offset)
+        return luaL_error(L, "access out of bounds");
+
+    memmove(check_range(L, target, offset, count), source + source_offset, count);
+    return 0;
+}
+
+/*
+ * buffer.find(b, s[, offset]) looks for the bytes of a string or buffer from the offset on, and returns the offset
+ * they're first found at or nil
+ */
+static int buffer_find(lua_State *L) {
+    struct buffer *buffer = check_buffer(L, 1);
+    size_t needle_size;
+    const char *needle = check_bytes(L, 2, &needle_size);
+    lua_Integer offset = luaL_optinteger(L, 3, 0);
+
+    if (offset < 0 || (lua_Unsigned) offset > buffer->size)
+        return luaL_error(L, "access out of bounds");
+
+    if (needle_size == 0) {
+        lua_pushinteger(L, offset);
+        return 1;
+    }
+
+    const char *start = buffer->data + offset;
+    const char *end = buffer->data + buffer->size;
+
+    while (end - start >= (ptrdiff_t) needle_size) {
+        start = memchr(start, needle[0], end - start - needle_size + 1);
+
+        if (start == NULL)
+            break;
+
+        if (!memcmp(start, needle, needle_size)) {
+            lua_pushinteger(L, start - buffer->data);
+            return 1;
+        }
+
+        start ++;
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+// buffer.view(b, offset[, count]) makes a buffer that shares part of another's memory, read-only if that one is
+static int buffer_view(lua_State *L) {
+    struct buffer *buffer = check_buffer(L, 1);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    size_t count = opt_count(L, buffer, offset, 3);
+    char *data = check_range(L, buffer, offset, count);
+
+    struct buffer *view = buffer_push_view(L);
+    view->data = data;
+    view->size = count;
+    view->read_only = buffer->read_only;
+
+    // the view keeps what it's a view of alive
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+
+    return 1;
+}
+
+static int buffer_gc(lua_State *L) {
+    struct buffer *buffer = check_buffer(L, 1);
+
+    if (buffer->release != NULL) {
+        buffer->release(buffer->owner, buffer->object);
+        buffer->release = NULL;
+        views_open --;
+    }
+
+    buffer->data = NULL;
+    buffer->size = 0;
+
+    return 0;
+}
+
+static const luaL_Reg funcs[] = {
+    {"new", buffer_new},
+    {"fromstring", buffer_from_string},
+    {"tostring", buffer_to_string},
+    {"len", buffer_len},
+    {"isreadonly", buffer_is_read_only},
+    {"readstring", buffer_read_string},
+    {"writestring", buffer_write_string},
+    {"fill", buffer_fill},
+    {"copy", buffer_copy},
+    {"find", buffer_find},
+    {"view", buffer_view},
+    {NULL, NULL}
+};
+
+int luaopen_buffer(lua_State *L) {
+    luaL_newlib(L, funcs);
+
+    for (const struct accessor *accessor = accessors; accessor->read != NULL; accessor ++) {
+        lua_pushlightuserdata(L, (void *) accessor);
+        lua_pushcclosure(L, buffer_read, 1);
+        lua_setfield(L, -2, accessor->read);
+
+        lua_pushlightuserdata(L, (void *) accessor);
+        lua_pushcclosure(L, buffer_write, 1);
+        lua_setfield(L, -2, accessor->write);
+    }
+
+    // the library doubles as the buffers' methods, so b:readu32(0) is buffer.readu32(b, 0)
+    luaL_newmetatable(L, BUFFER_METATABLE);
+    lua_pushvalue(L, -2);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, buffer_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    return 1;
+}
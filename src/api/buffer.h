@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <lua.h>
+
+struct buffer {
+    char *data;
+    size_t size;
+    bool read_only;
+
+    // for views of memory Lua doesn't own, called with owner and object once the view is collected
+    void (*release)(void *owner, void *object);
+    void *owner;
+    void *object;
+};
+
+struct buffer *buffer_push_new(lua_State *L, size_t size);
+struct buffer *buffer_push_view(lua_State *L);
+void buffer_set_release(struct buffer *buffer, void (*release)(void *owner, void *object), void *owner, void *object);
+size_t buffer_views_open(void);
+int luaopen_buffer(lua_State *L);
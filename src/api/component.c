@@ -10,6 +10,27 @@
 static struct component *first_component = NULL;
 static struct component *last_component = NULL;
 
+/*
+ * every component and method also gets a number in the order it was added, which is what proxies refer to them by
+ * rather than a pointer. the kernel always adds them in the same order, so the numbers stay meaningful in a Lua heap
+ * restored from a snapshot even though everything they point to has been allocated again
+ */
+static struct component **components = NULL;
+static int component_count = 0;
+static struct method **methods = NULL;
+static int method_count = 0;
+
+// appends to one of the tables above, returns the new entry's number
+static int add_to_table(void ***table, int *count, void *entry) {
+    void **new_table = realloc(*table, (*count + 1) * sizeof(void *));
+    assert(new_table != NULL);
+
+    new_table[*count] = entry;
+    *table = new_table;
+
+    return (*count)++;
+}
+
 static int list_call(lua_State *L) {
     lua_pushnil(L);
     lua_copy(L, lua_upvalueindex(2), -1);
@@ -105,9 +126,13 @@ static int component_doc(lua_State *L) {
 }
 
 static int proxy_call(lua_State *L) {
-    void *data = (void *) ((uintptr_t) lua_tointeger(L, lua_upvalueindex(1)));
-    struct method *method = (struct method *) ((uintptr_t) lua_tointeger(L, lua_upvalueindex(2)));
-    return method->invoke(L, data, 1);
+    lua_Integer component = lua_tointeger(L, lua_upvalueindex(1));
+    lua_Integer method = lua_tointeger(L, lua_upvalueindex(2));
+
+    if (component < 0 || component >= component_count || method < 0 || method >= method_count)
+        return luaL_error(L, "no such component");
+
+    return methods[method]->invoke(L, components[component]->data, 1);
 }
 
 static int component_proxy(lua_State *L) {
@@ -123,8 +148,8 @@ static int component_proxy(lua_State *L) {
             lua_setfield(L, -2, "type");
 
             for (struct method *method = component->first_method; method != NULL; method = method->next) {
-                lua_pushinteger(L, (uintptr_t) component->data);
-                lua_pushinteger(L, (uintptr_t) method); // only slightly cursed :3
+                lua_pushinteger(L, component->index);
+                lua_pushinteger(L, method->index);
                 lua_pushcclosure(L, proxy_call, 2);
                 lua_setfield(L, -2, method->name);
             }
@@ -155,6 +180,7 @@ void add_component(struct component *component) {
     assert(component != NULL);
 
     component->next = NULL;
+    component->index = add_to_table((void ***) &components, &component_count, component);
 
     if (last_component == NULL)
         first_component = last_component = component;
@@ -166,6 +192,11 @@ void add_component(struct component *component) {
     printf("added \"%s\" component at %s\n", component->name, component->address);
 }
 
+// returns the first component that was added, the rest follow in order through next
+struct component *get_components(void) {
+    return first_component;
+}
+
 struct component *new_component(const char *name, const char *address, void *data) {
     struct component *component = malloc(sizeof(struct component));
     assert(component != NULL);
@@ -190,6 +221,7 @@ void add_method(struct component *component, const char *name, int (*invoke)(lua
     method->name = name;
     method->invoke = invoke;
     method->next = NULL;
+    method->index = add_to_table((void ***) &methods, &method_count, method);
 
     if (component->last_method == NULL)
         component->first_method = component->last_method = method;
@@ -13,6 +13,8 @@ struct component {
     struct method *first_method;
     struct method *last_method;
 
+    // how many components were added before this one
+    int index;
     struct component *next;
 };
 
@@ -22,6 +24,8 @@ struct method {
     // invokes this method on its component. arguments are passed in a table in index 3 of the stack
     int (*invoke)(lua_State *L, void *data, int arguments_start);
 
+    // how many methods (of any component) were added before this one
+    int index;
     struct method *next;
 };
 
@@ -31,5 +35,6 @@ struct method {
 
 int luaopen_component(lua_State *L);
 void add_component(struct component *component);
+struct component *get_components(void);
 struct component *new_component(const char *name, const char *address, void *data);
 void add_method(struct component *component, const char *name, int (*invoke)(lua_State *L, void *data, int arguments_start));
@@ -5,19 +5,29 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include "rtc.h"
+#include "clock.h"
+#include "cpustat.h"
+#include "timer.h"
+#include "luaheap.h"
+#include "luaprof.h"
+#include "snapshot.h"
+#include "api/buffer.h"
+#include "tlsf.h"
+#include "cmdline.h"
 #include "uuid.h"
 #include "io.h"
 #include "api/computer.h"
 
 static const char *address;
+static const char *tmp_address = NULL;
 
 static int get_real_time(lua_State *L) {
-    lua_pushnumber(L, epoch_time);
+    lua_pushnumber(L, get_time());
     return 1;
 }
 
 static int get_uptime(lua_State *L) {
-    lua_pushnumber(L, uptime);
+    lua_pushnumber(L, (lua_Number) clock_ns() / NS_PER_SEC);
     return 1;
 }
 
@@ -32,21 +42,38 @@ static volatile struct signal signal_buffer[MAX_SIGNALS];
 static volatile int in_buffer = 0;
 static volatile int buffer_pos = 0;
 
+// how much work each idle garbage collection step does, as the KiB argument to LUA_GCSTEP
+#define IDLE_GC_STEP 16
+
+static int idle_gc_step = IDLE_GC_STEP;
+
+// another idle cycle is only started once Lua has allocated this much since the last one finished, or this percentage
+// of what was still live then if that's more, so a few allocations between signals don't set off a whole cycle
+#define IDLE_GC_MIN (64 * 1024)
+#define IDLE_GC_PERCENT 10
+
+static size_t idle_gc_min = IDLE_GC_MIN;
+
+// what the heap's allocated_bytes was when the last idle collection cycle finished, and how much more has to be
+// allocated before the next one
+static size_t idle_gc_allocated = 0;
+static size_t idle_gc_threshold = IDLE_GC_MIN;
+
 // adds a signal to the queue
 bool queue_signal(struct signal *signal) {
     assert(signal != NULL);
 
-    __asm__ __volatile__ ("cli");
+    uint32_t flags = irq_save();
 
     if (in_buffer >= MAX_SIGNALS) {
-        __asm__ __volatile__ ("sti");
+        irq_restore(flags);
         return false;
     }
 
     memcpy(&signal_buffer[(buffer_pos + in_buffer) % MAX_SIGNALS], signal, sizeof(struct signal));
     in_buffer ++;
 
-    __asm__ __volatile__ ("sti");
+    irq_restore(flags);
     return true;
 }
 
@@ -57,30 +84,191 @@ static bool dequeue_signal(struct signal *signal) {
     if (in_buffer == 0)
         return false;
 
-    __asm__ __volatile__ ("cli");
+    uint32_t flags = irq_save();
 
     memcpy(signal, &signal_buffer[buffer_pos], sizeof(struct signal));
 
     in_buffer --;
     buffer_pos = (buffer_pos + 1) % MAX_SIGNALS;
 
-    __asm__ __volatile__ ("sti");
+    irq_restore(flags);
     return true;
 }
 
-// frees memory allocated for a signal
-static void free_signal(struct lua_State *L, struct signal *signal) {
-    if (signal->kind == SIG_LUA) {
-        free(signal->name);
+// stores a range of values on the stack in a table in the global C registry, returns the name it was stored under
+static const char *store_arguments(lua_State *L, int first, int count) {
+    const char *registry_name = new_uuid(); // this should be good enough to prevent collisions
+
+    lua_pushstring(L, registry_name);
+    lua_newtable(L);
+
+    for (int i = 0; i < count; i ++) {
+        lua_pushinteger(L, i);
+        lua_pushnil(L);
+        lua_copy(L, i + first, lua_gettop(L));
+        lua_rawset(L, -3);
+    }
+
+    lua_settable(L, LUA_REGISTRYINDEX);
 
-        if (signal->data.registry.name != NULL) {
-            // delete arguments from registry
-            lua_pushstring(L, signal->data.registry.name);
-            lua_pushnil(L);
-            lua_settable(L, LUA_REGISTRYINDEX);
+    return registry_name;
+}
+
+// pushes the values stored by store_arguments back onto the stack
+static void push_arguments(lua_State *L, const char *registry_name, int count) {
+    lua_pushstring(L, registry_name);
+    lua_gettable(L, LUA_REGISTRYINDEX);
+    int table_index = lua_gettop(L);
 
-            free(signal->data.registry.name);
+    // extract all the arguments from the table
+    for (int i = 0; i < count; i ++) {
+        lua_pushinteger(L, i);
+        lua_rawget(L, table_index);
+    }
+
+    // remove the table from the stack since it's not needed
+    lua_remove(L, table_index);
+}
+
+// deletes the values stored by store_arguments from the registry
+static void free_arguments(lua_State *L, const char *registry_name) {
+    if (registry_name == NULL)
+        return;
+
+    lua_pushstring(L, registry_name);
+    lua_pushnil(L);
+    lua_settable(L, LUA_REGISTRYINDEX);
+
+    free(registry_name);
+}
+
+/* === timers === */
+
+struct lua_timer {
+    struct timer timer;
+    lua_Integer id;
+    // the name of the signal to queue
+    const char *name;
+    // where the signal's arguments are stored in the registry, or NULL if there aren't any
+    const char *registry_name;
+    size_t arguments;
+};
+
+// registry table mapping timer ids to their struct lua_timer, so that they can be cancelled
+#define TIMERS_KEY "timers"
+
+static lua_Integer next_timer_id = 1;
+
+// converts a duration in seconds to a number of jiffies, rounding up
+static uint32_t to_jiffies(lua_Number seconds) {
+    lua_Number ticks = seconds * TIMER_HZ;
+
+    if (!(ticks > 0))
+        return 0;
+    if (ticks >= INT32_MAX)
+        return INT32_MAX;
+
+    uint32_t whole = (uint32_t) ticks;
+    return whole < ticks ? whole + 1 : whole;
+}
+
+// called from interrupt context, so the signal can only be freed once it's pulled
+static void lua_timer_expired(struct timer *timer) {
+    struct lua_timer *lua_timer = timer->data;
+
+    struct signal signal = {
+        .name = lua_timer->name,
+        .kind = SIG_TIMER,
+        .data = {
+            .timer = {
+                .timer = lua_timer
+            }
         }
+    };
+
+    // try again on the next tick if the queue is full
+    if (!queue_signal(&signal)) {
+        timer->expires = get_jiffies() + 1;
+        timer_add(timer);
+    }
+}
+
+static void free_lua_timer(lua_State *L, struct lua_timer *lua_timer) {
+    lua_getfield(L, LUA_REGISTRYINDEX, TIMERS_KEY);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, lua_timer->id);
+    lua_pop(L, 1);
+
+    free_arguments(L, lua_timer->registry_name);
+    free(lua_timer->name);
+    free(lua_timer);
+}
+
+static int set_timer(lua_State *L) {
+    lua_Number seconds = luaL_checknumber(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+    int arguments = lua_gettop(L) - 2;
+
+    struct lua_timer *lua_timer = malloc(sizeof(struct lua_timer));
+
+    if (lua_timer == NULL)
+        return luaL_error(L, "out of memory");
+
+    if ((lua_timer->name = strdup(name)) == NULL) {
+        free(lua_timer);
+        return luaL_error(L, "out of memory");
+    }
+
+    lua_timer->id = next_timer_id ++;
+    lua_timer->arguments = arguments;
+    lua_timer->registry_name = arguments > 0 ? store_arguments(L, 3, arguments) : NULL;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, TIMERS_KEY);
+    lua_pushlightuserdata(L, lua_timer);
+    lua_rawseti(L, -2, lua_timer->id);
+    lua_pop(L, 1);
+
+    lua_timer->timer = (struct timer) {
+        .expires = get_jiffies() + to_jiffies(seconds),
+        .callback = lua_timer_expired,
+        .data = lua_timer
+    };
+    timer_add(&lua_timer->timer);
+
+    lua_pushinteger(L, lua_timer->id);
+    return 1;
+}
+
+static int cancel_timer(lua_State *L) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, TIMERS_KEY);
+    lua_rawgeti(L, -1, id);
+    struct lua_timer *lua_timer = lua_touserdata(L, -1);
+    lua_pop(L, 2);
+
+    // timers that have already expired are freed once their signal is pulled
+    if (lua_timer == NULL || !timer_cancel(&lua_timer->timer)) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    free_lua_timer(L, lua_timer);
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// frees memory allocated for a signal
+static void free_signal(struct lua_State *L, struct signal *signal) {
+    switch (signal->kind) {
+        case SIG_LUA:
+            free(signal->name);
+            free_arguments(L, signal->data.registry.name);
+            break;
+        case SIG_TIMER:
+            free_lua_timer(L, signal->data.timer.timer);
+            break;
     }
 }
 
@@ -89,17 +277,12 @@ static int push_signal(lua_State *L) {
     const char *name = luaL_checklstring(L, 1, &len);
     int arguments = lua_gettop(L) - 1;
 
-    const char *registry_name = NULL;
-
-    if (arguments > 0)
-        registry_name = new_uuid(); // this should be good enough to prevent collisions
-
     struct signal signal = {
         .name = strdup(name),
         .kind = SIG_LUA,
         .data = {
             .registry = {
-                .name = registry_name,
+                .name = NULL,
                 .size = arguments
             }
         }
@@ -108,20 +291,9 @@ static int push_signal(lua_State *L) {
     if (signal.name == NULL)
         return luaL_error(L, "out of memory");
 
-    if (arguments > 0) {
-        // store all the arguments in a table in the global C registry
-        lua_pushstring(L, registry_name);
-        lua_newtable(L);
-
-        for (int i = 0; i < arguments; i ++) {
-            lua_pushinteger(L, i);
-            lua_pushnil(L);
-            lua_copy(L, i + 2, lua_gettop(L));
-            lua_rawset(L, -3);
-        }
-
-        lua_settable(L, LUA_REGISTRYINDEX);
-    }
+    // store all the arguments in a table in the global C registry
+    if (arguments > 0)
+        signal.data.registry.name = store_arguments(L, 2, arguments);
 
     if (!queue_signal(&signal)) {
         free_signal(L, &signal);
@@ -131,11 +303,82 @@ static int push_signal(lua_State *L) {
     return 0;
 }
 
+static struct lua_heap *get_heap(lua_State *L) {
+    void *heap;
+    lua_getallocf(L, &heap);
+    return heap;
+}
+
+static bool deadline_passed(bool has_deadline, uint32_t deadline) {
+    return has_deadline && (int32_t) (deadline - get_jiffies()) <= 0;
+}
+
+/*
+ * does incremental garbage collection in small steps while there's nothing else to do, so less of it is left to
+ * happen during allocations while handling a signal. stops as soon as a signal is queued or the deadline passes,
+ * or once a cycle has finished. another cycle is only started once enough has been allocated since for there to be
+ * garbage worth collecting
+ */
+static void collect_while_idle(lua_State *L, bool has_deadline, uint32_t deadline) {
+    struct lua_heap *heap = get_heap(L);
+
+    // allocated_bytes wraps around, but the difference is still right
+    if (idle_gc_step == 0 || heap->allocated_bytes - idle_gc_allocated < idle_gc_threshold || !lua_gc(L, LUA_GCISRUNNING))
+        return;
+
+    while (in_buffer == 0 && !deadline_passed(has_deadline, deadline))
+        if (lua_gc(L, LUA_GCSTEP, idle_gc_step)) {
+            size_t proportional = heap->live_bytes / 100 * IDLE_GC_PERCENT;
+
+            idle_gc_allocated = heap->allocated_bytes;
+            idle_gc_threshold = proportional > idle_gc_min ? proportional : idle_gc_min;
+            break;
+        }
+}
+
+// the interrupt that runs this is what ends the hlt, so it doesn't need to do anything
+static void wake_up(struct timer *timer) {
+}
+
+/*
+ * halts until a signal is queued or the deadline (if there is one) passes. expired timers queue their own signals,
+ * so the nearest pending timer cuts the wait short as well. the deadline is itself a timer, so the clock event
+ * device is only ever programmed for whichever of the two comes first
+ */
+static void wait_for_signal(lua_State *L, bool has_deadline, uint32_t deadline) {
+    collect_while_idle(L, has_deadline, deadline);
+
+    int previous_state = cpustat_enter(CPU_IDLE);
+
+    struct timer wake_timer = {
+        .expires = deadline,
+        .callback = wake_up
+    };
+
+    if (has_deadline)
+        timer_add(&wake_timer);
+
+    __asm__ __volatile__ ("cli");
+
+    // sti only takes effect after the next instruction, so an interrupt can't slip in between the check and the hlt
+    while (in_buffer == 0 && !deadline_passed(has_deadline, deadline))
+        __asm__ __volatile__ ("sti; hlt; cli");
+
+    __asm__ __volatile__ ("sti");
+
+    if (has_deadline)
+        timer_cancel(&wake_timer);
+
+    cpustat_enter(previous_state);
+}
+
 static int pull_signal(lua_State *L) {
-    // ignored for now
-    uint32_t timeout = lua_isinteger(L, 1) ? lua_tointeger(L, 1) : -1;
+    bool has_deadline = lua_isnumber(L, 1);
+    uint32_t deadline = has_deadline ? get_jiffies() + to_jiffies(lua_tonumber(L, 1)) : 0;
     struct signal signal;
 
+    wait_for_signal(L, has_deadline, deadline);
+
     if (!dequeue_signal(&signal))
         return 0;
 
@@ -145,21 +388,8 @@ static int pull_signal(lua_State *L) {
 
     switch (signal.kind) {
         case SIG_LUA:
-            if ((arguments = signal.data.registry.size) > 0) {
-                // get the arguments from the registry
-                lua_pushstring(L, signal.data.registry.name);
-                lua_gettable(L, LUA_REGISTRYINDEX);
-                int table_index = lua_gettop(L);
-
-                // extract all the arguments from the table
-                for (int i = 0; i < arguments; i ++) {
-                    lua_pushinteger(L, i);
-                    lua_rawget(L, table_index);
-                }
-
-                // remove the table from the stack since it's not needed
-                lua_remove(L, table_index);
-            }
+            if ((arguments = signal.data.registry.size) > 0)
+                push_arguments(L, signal.data.registry.name, arguments);
             break;
         case SIG_KEYBOARD:
             arguments = 4;
@@ -168,6 +398,10 @@ static int pull_signal(lua_State *L) {
             lua_pushinteger(L, signal.data.keyboard.code);
             lua_pushliteral(L, "");
             break;
+        case SIG_TIMER:
+            if ((arguments = signal.data.timer.timer->arguments) > 0)
+                push_arguments(L, signal.data.timer.timer->registry_name, arguments);
+            break;
     }
 
     free_signal(L, &signal);
@@ -176,20 +410,21 @@ static int pull_signal(lua_State *L) {
 }
 
 static int get_tmp_address(lua_State *L) {
-    lua_pushnil(L);
+    if (tmp_address != NULL)
+        lua_pushstring(L, tmp_address);
+    else
+        lua_pushnil(L);
+
     return 1;
 }
 
 static void delay(lua_Number duration) {
-    uint64_t seconds = (int) duration;
-    uint16_t jiffies = (int) (duration * 1024.0) % 1024;
+    if (!(duration > 0))
+        return;
 
-    uint64_t deadline_seconds = uptime + seconds;
-    uint16_t deadline_jiffies = jiffies_frac + jiffies;
-    deadline_seconds += deadline_jiffies / 1024;
-    deadline_jiffies %= 1024;
+    uint64_t deadline = clock_ns() + (int64_t) (duration * NS_PER_SEC);
 
-    while (uptime < deadline_seconds || jiffies_frac < deadline_jiffies);
+    while (clock_ns() < deadline);
 }
 
 static void beep(int frequency, lua_Number duration) {
@@ -230,31 +465,147 @@ static int computer_beep(lua_State *L) {
     return 0;
 }
 
-extern uintptr_t memory_size;
+// returns the 1, 5 and 15 minute averages of the fraction of time the CPU wasn't idle
+static int get_load(lua_State *L) {
+    uint32_t loads[3];
+    cpustat_load(loads);
+
+    for (int i = 0; i < 3; i++)
+        lua_pushnumber(L, (lua_Number) loads[i] / LOAD_ONE);
+
+    return 3;
+}
+
+// returns the seconds spent busy, idle and handling interrupts since boot
+static int get_cpu_time(lua_State *L) {
+    lua_pushnumber(L, (lua_Number) cpustat_time(CPU_BUSY) / NS_PER_SEC);
+    lua_pushnumber(L, (lua_Number) cpustat_time(CPU_IDLE) / NS_PER_SEC);
+    lua_pushnumber(L, (lua_Number) cpustat_time(CPU_IRQ) / NS_PER_SEC);
+    return 3;
+}
 
 static int total_memory(lua_State *L) {
-    lua_pushinteger(L, memory_size);
+    lua_pushinteger(L, lua_heap_total(get_heap(L)));
+    return 1;
+}
+
+static int free_memory(lua_State *L) {
+    lua_pushinteger(L, lua_heap_free(get_heap(L)));
+    return 1;
+}
+
+// returns the heap profile (see luaprof_push), or nil if the profiler isn't enabled
+static int get_heap_profile(lua_State *L) {
+    if (luaprof_enabled())
+        luaprof_push(L);
+    else
+        lua_pushnil(L);
+
+    return 1;
+}
+
+// prints the heap profile to the serial port, returns whether the profiler is enabled
+static int dump_heap_profile(lua_State *L) {
+    if (luaprof_enabled())
+        luaprof_dump();
+
+    lua_pushboolean(L, luaprof_enabled());
     return 1;
 }
 
+// prints the kernel's live heap allocations by call site to the serial port, in builds with allocation tracking
+static int dump_allocations(lua_State *L) {
+    malloc_report();
+    return 0;
+}
+
+static int snapshot_failed(lua_State *L, const char *reason) {
+    lua_pushnil(L);
+    lua_pushstring(L, reason);
+    return 2;
+}
+
+/*
+ * saves a snapshot of the Lua heap that later boots carry on from (see snapshot.c). returns false once the snapshot
+ * has been written, true in a machine that booted from it, or nil and a reason if one can't be made right now.
+ * queued signals are thrown away, since they'd refer to memory that won't be there after a restore
+ */
+static int computer_snapshot(lua_State *L) {
+    if (!snapshot_available(get_heap(L)))
+        return snapshot_failed(L, "boot with snapshot=dump to make snapshots");
+
+    bool is_main = lua_pushthread(L);
+    lua_pop(L, 1);
+
+    if (!is_main || !lua_isyieldable(L))
+        return snapshot_failed(L, "snapshots can only be made from the main thread");
+
+    lua_getfield(L, LUA_REGISTRYINDEX, TIMERS_KEY);
+    lua_pushnil(L);
+    bool has_timers = lua_next(L, -2);
+    lua_pop(L, has_timers ? 3 : 1);
+
+    if (has_timers)
+        return snapshot_failed(L, "timers are pending");
+
+    // views point outside the Lua heap, at memory that won't be there after a restore
+    if (buffer_views_open() > 0)
+        return snapshot_failed(L, "buffer views of files are open");
+
+    struct signal signal;
+
+    while (dequeue_signal(&signal))
+        free_signal(L, &signal);
+
+    snapshot_request();
+    return lua_yield(L, 0);
+}
+
 static const luaL_Reg funcs[] = {
     {"realTime", get_real_time},
     {"uptime", get_uptime},
     {"address", get_address},
     {"pushSignal", push_signal},
     {"pullSignal", pull_signal},
+    {"setTimer", set_timer},
+    {"cancelTimer", cancel_timer},
     {"tmpAddress", get_tmp_address},
     {"beep", computer_beep},
     {"totalMemory", total_memory},
-    {"freeMemory", total_memory},
+    {"freeMemory", free_memory},
+    {"getLoad", get_load},
+    {"getCpuTime", get_cpu_time},
+    {"getHeapProfile", get_heap_profile},
+    {"dumpHeapProfile", dump_heap_profile},
+    {"dumpAllocations", dump_allocations},
+    {"snapshot", computer_snapshot},
     {NULL, NULL}
 };
 
-int luaopen_computer(lua_State *L) {
+// adds the computer component. this is separate from luaopen_computer since a state restored from a snapshot still
+// needs it, without the library being opened again
+void computer_init(void) {
     address = new_uuid();
     struct component *computer = new_component("computer", address, NULL);
     add_component(computer);
 
+    // idlegc=<KiB> sets how much collection each idle step does, 0 turns idle collection off
+    idle_gc_step = cmdline_get_number("idlegc", IDLE_GC_STEP);
+
+    // idlegcmin=<size> sets the least that has to be allocated before idle collection starts another cycle
+    idle_gc_min = cmdline_get_number("idlegcmin", IDLE_GC_MIN);
+    idle_gc_threshold = idle_gc_min;
+}
+
+// sets the address of the filesystem computer.tmpAddress() returns
+void computer_set_tmp_address(const char *address) {
+    tmp_address = address;
+}
+
+int luaopen_computer(lua_State *L) {
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, TIMERS_KEY);
+
     luaL_newlib(L, funcs);
 
     return 1;
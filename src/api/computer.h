@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <lua.h>
 
+struct lua_timer;
+
 struct signal {
     const char *name;
     uint8_t kind;
@@ -17,11 +19,17 @@ struct signal {
             uint32_t character;
             uint32_t code;
         } keyboard;
+        struct {
+            struct lua_timer *timer;
+        } timer;
     } data;
 };
 
 #define SIG_LUA 0
 #define SIG_KEYBOARD 1
+#define SIG_TIMER 2
 
 bool queue_signal(struct signal *signal);
+void computer_init(void);
+void computer_set_tmp_address(const char *address);
 int luaopen_computer(lua_State *L);
@@ -1,10 +1,12 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include "os.h"
-#include "rtc.h"
+#include "clock.h"
+#include "cpustat.h"
 
+// CPU time used by Lua and the kernel on its behalf, excluding time spent idle or handling interrupts
 static int os_clock(lua_State *L) {
-    lua_pushnumber(L, uptime);
+    lua_pushnumber(L, (lua_Number) cpustat_time(CPU_BUSY) / NS_PER_SEC);
     return 1;
 }
 
@@ -0,0 +1,247 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "atapi.h"
+#include "io.h"
+#include "clock.h"
+
+/*
+ * a driver for CD drives on the legacy IDE ports, which is where the boot CD is on a PC (and in QEMU with -cdrom).
+ * commands are sent as SCSI packets and everything is polled with the drive's interrupt turned off, so reads only
+ * happen when something asks for them and nothing else has to know about the drive. it's PIO only: bus mastering
+ * DMA needs the controller's registers from PCI configuration space, which nothing else here looks at yet
+ */
+
+// command block registers, from the channel's I/O base
+#define ATA_DATA 0
+#define ATA_FEATURES 1
+#define ATA_SECTOR_COUNT 2
+#define ATA_LBA_LOW 3
+#define ATA_LBA_MID 4
+#define ATA_LBA_HIGH 5
+#define ATA_DRIVE 6
+#define ATA_COMMAND 7
+#define ATA_STATUS 7
+
+#define ATA_STATUS_ERR (1 << 0)
+#define ATA_STATUS_DRQ (1 << 3)
+#define ATA_STATUS_DF (1 << 5)
+#define ATA_STATUS_BSY (1 << 7)
+
+// written to the device control register (which reads back as the alternate status) to turn the interrupt off
+#define ATA_CONTROL_NIEN (1 << 1)
+
+#define ATA_PACKET 0xa0
+#define ATA_IDENTIFY_PACKET 0xa1
+
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_READ_CAPACITY 0x25
+#define SCSI_READ_10 0x28
+
+// the most the drive is asked to send per data block, a whole number of sectors that fits in 16 bits
+#define ATAPI_BYTE_LIMIT (31 * ATAPI_SECTOR_SIZE)
+
+// how many sectors are read with one command
+#define ATAPI_MAX_SECTORS 32
+
+// a drive can take a few seconds to spin up, but a missing one should be given up on quickly
+#define ATAPI_TIMEOUT_NS (10 * NS_PER_SEC)
+#define ATAPI_PROBE_TIMEOUT_NS (NS_PER_SEC / 2)
+
+// the first command after a disc goes in fails to say so, so commands are tried a few times
+#define ATAPI_RETRIES 3
+
+static const struct {
+    uint16_t io_base;
+    uint16_t control_base;
+} channels[] = {
+    {0x1f0, 0x3f6},
+    {0x170, 0x376}
+};
+
+#define CHANNEL_COUNT (sizeof(channels) / sizeof(channels[0]))
+
+// the drive needs 400 ns after being selected or sent a command before its status means anything
+static void delay(struct atapi_drive *drive) {
+    for (int i = 0; i < 4; i ++)
+        inb(drive->control_base);
+}
+
+static void select_drive(struct atapi_drive *drive) {
+    outb(drive->io_base + ATA_DRIVE, 0xa0 | (drive->slave ? 0x10 : 0));
+    delay(drive);
+}
+
+// waits for the drive to stop being busy and gets its status, returns false if it takes too long
+static bool wait_idle(struct atapi_drive *drive, uint64_t timeout_ns, uint8_t *status) {
+    uint64_t start = clock_ns();
+
+    while (inb(drive->control_base) & ATA_STATUS_BSY)
+        if (clock_ns() - start > timeout_ns)
+            return false;
+
+    *status = inb(drive->io_base + ATA_STATUS);
+    return true;
+}
+
+// whether there's a CD drive where a drive is pointing
+static bool identify(struct atapi_drive *drive) {
+    uint16_t io_base = drive->io_base;
+
+    select_drive(drive);
+    outb(drive->control_base, ATA_CONTROL_NIEN);
+
+    // nothing drives the bus on a channel with nothing on it, so it reads as all ones
+    if (inb(io_base + ATA_STATUS) == 0xff)
+        return false;
+
+    outb(io_base + ATA_SECTOR_COUNT, 0);
+    outb(io_base + ATA_LBA_LOW, 0);
+    outb(io_base + ATA_LBA_MID, 0);
+    outb(io_base + ATA_LBA_HIGH, 0);
+    outb(io_base + ATA_COMMAND, ATA_IDENTIFY_PACKET);
+    delay(drive);
+
+    uint8_t status = inb(io_base + ATA_STATUS);
+
+    // hard drives refuse the command, and nothing there at all leaves the status at 0
+    if (status == 0 || !wait_idle(drive, ATAPI_PROBE_TIMEOUT_NS, &status) || (status & ATA_STATUS_ERR) || !(status & ATA_STATUS_DRQ))
+        return false;
+
+    uint16_t identity[256];
+    insw(io_base + ATA_DATA, identity, 256);
+
+    // the first word says what sort of device it is: ATAPI in the top two bits, then 5 for a CD or DVD drive
+    return (identity[0] >> 14) == 2 && ((identity[0] >> 8) & 0x1f) == 5;
+}
+
+/*
+ * sends a packet command, and reads exactly size bytes of whatever it returns into out. the drive decides how much
+ * it sends at a time, and anything past what was asked for is read and thrown away so the command can finish
+ */
+static bool packet_command(struct atapi_drive *drive, const uint8_t packet[12], void *out, uint32_t size) {
+    uint16_t io_base = drive->io_base;
+    uint8_t status;
+
+    select_drive(drive);
+
+    if (!wait_idle(drive, ATAPI_TIMEOUT_NS, &status))
+        return false;
+
+    outb(io_base + ATA_FEATURES, 0);
+    outb(io_base + ATA_LBA_MID, ATAPI_BYTE_LIMIT & 0xff);
+    outb(io_base + ATA_LBA_HIGH, ATAPI_BYTE_LIMIT >> 8);
+    outb(io_base + ATA_COMMAND, ATA_PACKET);
+    delay(drive);
+
+    if (!wait_idle(drive, ATAPI_TIMEOUT_NS, &status) || (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) || !(status & ATA_STATUS_DRQ))
+        return false;
+
+    outsw(io_base + ATA_DATA, packet, 6);
+
+    char *buffer = out;
+    uint32_t received = 0;
+
+    for (;;) {
+        delay(drive);
+
+        if (!wait_idle(drive, ATAPI_TIMEOUT_NS, &status) || (status & (ATA_STATUS_ERR | ATA_STATUS_DF)))
+            return false;
+
+        if (!(status & ATA_STATUS_DRQ))
+            break;
+
+        uint32_t count = inb(io_base + ATA_LBA_MID) | (inb(io_base + ATA_LBA_HIGH) << 8);
+
+        if (count == 0)
+            return false;
+
+        uint32_t wanted = count < size - received ? count : size - received;
+        insw(io_base + ATA_DATA, buffer + received, wanted / 2);
+
+        for (uint32_t i = wanted / 2 * 2; i < count; i += 2)
+            inw(io_base + ATA_DATA);
+
+        received += wanted / 2 * 2;
+    }
+
+    return received == size;
+}
+
+static bool read_capacity(struct atapi_drive *drive) {
+    const uint8_t packet[12] = {SCSI_READ_CAPACITY};
+    uint8_t capacity[8];
+
+    if (!packet_command(drive, packet, capacity, sizeof(capacity)))
+        return false;
+
+    // the address of the last sector and the size of a sector, both big endian
+    uint32_t last = (uint32_t) capacity[0] << 24 | capacity[1] << 16 | capacity[2] << 8 | capacity[3];
+    uint32_t sector_size = (uint32_t) capacity[4] << 24 | capacity[5] << 16 | capacity[6] << 8 | capacity[7];
+
+    if (sector_size != ATAPI_SECTOR_SIZE) {
+        printf("atapi: sectors are %d bytes, not %d\n", sector_size, ATAPI_SECTOR_SIZE);
+        return false;
+    }
+
+    drive->sector_count = last + 1;
+    return true;
+}
+
+// finds the first CD drive with a disc in it, returns false if there isn't one
+bool atapi_find(struct atapi_drive *drive) {
+    for (int i = 0; i < CHANNEL_COUNT; i ++) {
+        for (int slave = 0; slave < 2; slave ++) {
+            drive->io_base = channels[i].io_base;
+            drive->control_base = channels[i].control_base;
+            drive->slave = slave;
+            drive->sector_count = 0;
+
+            if (!identify(drive))
+                continue;
+
+            for (int attempt = 0; attempt < ATAPI_RETRIES; attempt ++) {
+                if (read_capacity(drive)) {
+                    printf("atapi: drive at %03x %s has %d sectors\n", drive->io_base, slave ? "slave" : "master", drive->sector_count);
+                    return true;
+                }
+            }
+
+            printf("atapi: drive at %03x %s has no disc\n", drive->io_base, slave ? "slave" : "master");
+        }
+    }
+
+    return false;
+}
+
+// reads count whole sectors starting at lba into out
+bool atapi_read(struct atapi_drive *drive, uint32_t lba, uint32_t count, void *out) {
+    if (lba > drive->sector_count || count > drive->sector_count - lba)
+        return false;
+
+    char *buffer = out;
+
+    while (count > 0) {
+        uint32_t sectors = count < ATAPI_MAX_SECTORS ? count : ATAPI_MAX_SECTORS;
+        const uint8_t packet[12] = {
+            SCSI_READ_10, 0,
+            lba >> 24, lba >> 16, lba >> 8, lba,
+            0,
+            sectors >> 8, sectors
+        };
+
+        int attempt = 0;
+
+        while (!packet_command(drive, packet, buffer, sectors * ATAPI_SECTOR_SIZE))
+            if (++ attempt == ATAPI_RETRIES) {
+                printf("atapi: can't read %d sectors at %d\n", sectors, lba);
+                return false;
+            }
+
+        lba += sectors;
+        count -= sectors;
+        buffer += sectors * ATAPI_SECTOR_SIZE;
+    }
+
+    return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* discs are always read in whole sectors of this size */
+#define ATAPI_SECTOR_SIZE 2048
+
+struct atapi_drive {
+    // the command and control registers of the channel the drive is on, and whether it's the slave on it
+    uint16_t io_base;
+    uint16_t control_base;
+    bool slave;
+
+    // how many sectors there are on the disc in it
+    uint32_t sector_count;
+};
+
+bool atapi_find(struct atapi_drive *drive);
+bool atapi_read(struct atapi_drive *drive, uint32_t lba, uint32_t count, void *out);
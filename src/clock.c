@@ -0,0 +1,190 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "clock.h"
+#include "cpu.h"
+#include "io.h"
+#include "timer.h"
+
+/*
+ * monotonic clock with nanosecond units. the PIT is always available and is used as a free-running counter,
+ * counting the wraps of channel 0 in its interrupt and interpolating with the latched count. if the CPU has a TSC
+ * it's calibrated against the PIT at boot and used instead, since it's far cheaper to read.
+ *
+ * on machines without a local APIC the PIT also has to act as the clock event device, in which case channel 0 is
+ * switched to one-shot mode and the elapsed count is folded into the clock every time it's reprogrammed
+ */
+
+// channel 0 counts down from this value before wrapping (a reload value of 0 means 65536)
+#define PIT_RELOAD 65536
+
+// fixed point factors for converting PIT and TSC ticks to nanoseconds
+#define PIT_SHIFT 22
+#define PIT_MULT ((uint32_t) ((NS_PER_SEC << PIT_SHIFT) / PIT_HZ))
+#define TSC_SHIFT 24
+
+// how many PIT ticks to calibrate the TSC over, about 50 ms
+#define CALIBRATION_TICKS (PIT_HZ / 20)
+
+// PIT ticks accounted for by wraps of channel 0, or by previous one-shot periods
+static volatile uint64_t pit_base = 0;
+
+// whether channel 0 is in one-shot mode, and the count it was last loaded with if so
+static bool pit_oneshot = false;
+static uint32_t pit_loaded = 0;
+
+// if nonzero, the TSC is used and this converts TSC ticks to nanoseconds
+static uint32_t tsc_mult = 0;
+static uint64_t tsc_base = 0;
+static uint64_t tsc_base_ns = 0;
+
+static uint64_t last_ns = 0;
+
+// computes (value * mult) >> shift without needing a 96-bit intermediate. shift must be at most 32
+static uint64_t scale(uint64_t value, uint32_t mult, int shift) {
+    uint64_t low = (value & 0xffffffff) * mult;
+    uint64_t high = (value >> 32) * mult;
+
+    return (high << (32 - shift)) + (low >> shift);
+}
+
+void pit_interrupt(void) {
+    if (pit_oneshot)
+        timer_interrupt();
+    else
+        pit_base += PIT_RELOAD;
+}
+
+static uint32_t read_pit_count(void) {
+    outb(0x43, 0x00); // latch the count of channel 0
+    uint32_t count = inb(0x40);
+    count |= inb(0x40) << 8;
+
+    return count;
+}
+
+// in one-shot mode the counter keeps counting down past 0, so this is right until it's gone all the way around
+static uint32_t oneshot_elapsed(void) {
+    return (pit_loaded - read_pit_count()) & 0xffff;
+}
+
+// returns the number of PIT ticks since the PIT was set up
+static uint64_t pit_ticks(void) {
+    uint32_t flags = irq_save();
+
+    if (pit_oneshot) {
+        uint64_t ticks = pit_base + oneshot_elapsed();
+        irq_restore(flags);
+        return ticks;
+    }
+
+    uint32_t count = read_pit_count();
+
+    if (count == 0)
+        count = PIT_RELOAD;
+
+    uint64_t ticks = pit_base;
+
+    // the counter may have wrapped without its interrupt having been handled yet, in which case the count is
+    // still high from being reloaded
+    outb(0x20, 0x0a); // read the primary PIC's interrupt request register
+    if ((inb(0x20) & 1) && count > PIT_RELOAD / 2)
+        ticks += PIT_RELOAD;
+
+    irq_restore(flags);
+
+    return ticks + (PIT_RELOAD - count);
+}
+
+static void calibrate_tsc(void) {
+    uint64_t pit_start = pit_ticks();
+    uint64_t tsc_start = rdtsc();
+
+    uint64_t pit_end;
+    while ((pit_end = pit_ticks()) - pit_start < CALIBRATION_TICKS);
+
+    uint64_t tsc_end = rdtsc();
+    uint64_t hz = (tsc_end - tsc_start) * PIT_HZ / (pit_end - pit_start);
+
+    // below this the multiplier wouldn't fit in 32 bits, and the PIT is about as precise anyway
+    if (hz < (NS_PER_SEC << TSC_SHIFT) >> 32) {
+        printf("TSC is too slow (%d Hz), using PIT\n", (uint32_t) hz);
+        return;
+    }
+
+    printf("TSC runs at %d.%02d MHz\n", (uint32_t) (hz / 1000000), (uint32_t) (hz / 10000) % 100);
+
+    uint32_t flags = irq_save();
+    tsc_base_ns = scale(pit_ticks(), PIT_MULT, PIT_SHIFT);
+    tsc_base = rdtsc();
+    tsc_mult = (NS_PER_SEC << TSC_SHIFT) / hz;
+    irq_restore(flags);
+}
+
+// switches channel 0 to one-shot mode if it isn't already, and has it interrupt after the given number of ticks
+void pit_arm(uint32_t count) {
+    if (count < 1)
+        count = 1;
+    if (count > PIT_ONESHOT_MAX)
+        count = PIT_ONESHOT_MAX;
+
+    uint32_t flags = irq_save();
+
+    // fold the time since the last reload into the base so the clock keeps running across the switch
+    pit_base = pit_ticks();
+
+    // channel 0, low byte then high byte, mode 0 (interrupt on terminal count), binary
+    outb(0x43, 0x30);
+    outb(0x40, count & 0xff);
+    outb(0x40, (count >> 8) & 0xff);
+
+    pit_loaded = count;
+    pit_oneshot = true;
+
+    // the counter only picks up the new count on its next input clock, until then reading it would return the
+    // old count. the read-back command's status byte has a "null count" bit for exactly this
+    do
+        outb(0x43, 0xe2);
+    while (inb(0x40) & (1 << 6));
+
+    irq_restore(flags);
+}
+
+// whether the clock is based on the TSC rather than the PIT
+bool clock_uses_tsc(void) {
+    return tsc_mult != 0;
+}
+
+void clock_init(void) {
+    // channel 0, low byte then high byte, mode 2 (rate generator), binary
+    outb(0x43, 0x34);
+    outb(0x40, PIT_RELOAD & 0xff);
+    outb(0x40, (PIT_RELOAD >> 8) & 0xff);
+
+    if (cpu_features() & CPUID_FEAT_EDX_TSC)
+        calibrate_tsc();
+    else
+        printf("no TSC, using PIT\n");
+}
+
+// returns the number of nanoseconds since the clock was set up
+uint64_t clock_ns(void) {
+    uint64_t ns;
+
+    if (tsc_mult != 0)
+        ns = tsc_base_ns + scale(rdtsc() - tsc_base, tsc_mult, TSC_SHIFT);
+    else
+        ns = scale(pit_ticks(), PIT_MULT, PIT_SHIFT);
+
+    // never go backwards, even if the hardware is a bit inconsistent around a wrap
+    uint32_t flags = irq_save();
+
+    if (ns < last_ns)
+        ns = last_ns;
+    else
+        last_ns = ns;
+
+    irq_restore(flags);
+
+    return ns;
+}
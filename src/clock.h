@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NS_PER_SEC 1000000000ull
+
+/* the frequency of the PIT's input clock */
+#define PIT_HZ 1193182
+
+/* the longest period the PIT can be armed for in one-shot mode, about 55 ms */
+#define PIT_ONESHOT_MAX 0xffff
+
+void clock_init(void);
+uint64_t clock_ns(void);
+void pit_interrupt(void);
+void pit_arm(uint32_t count);
+bool clock_uses_tsc(void);
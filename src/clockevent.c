@@ -0,0 +1,135 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "clockevent.h"
+#include "clock.h"
+#include "timer.h"
+#include "cpu.h"
+#include "io.h"
+
+/*
+ * one-shot clock event device. the local APIC timer is used where there is one, otherwise channel 0 of the PIT is
+ * put in one-shot mode (which can only be armed up to 55 ms ahead, so an idle 486 still wakes ~18 times a second)
+ */
+
+#define LAPIC_TIMER_VECTOR 48
+#define LAPIC_SPURIOUS_VECTOR 63
+
+#define IA32_APIC_BASE 0x1b
+#define APIC_BASE_ENABLE (1 << 11)
+
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3e0
+
+#define LVT_MASKED (1 << 16)
+#define LVT_EXTINT (7 << 8)
+#define LVT_NMI (4 << 8)
+#define SVR_ENABLE (1 << 8)
+
+// how long to calibrate the local APIC timer over, and the longest it'll be armed for at once
+#define CALIBRATION_NS (NS_PER_SEC / 100)
+#define MAX_EVENT_NS (10 * NS_PER_SEC)
+
+static volatile uint32_t *lapic = NULL;
+static uint64_t lapic_hz = 0;
+
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static bool lapic_init(void) {
+    uint32_t features = cpu_features();
+
+    if (!(features & CPUID_FEAT_EDX_APIC) || !(features & CPUID_FEAT_EDX_MSR))
+        return false;
+
+    uint64_t base = rdmsr(IA32_APIC_BASE);
+    wrmsr(IA32_APIC_BASE, base | APIC_BASE_ENABLE);
+    lapic = (volatile uint32_t *) (uintptr_t) (base & 0xfffff000);
+
+    // virtual wire mode, so the PICs' interrupts keep coming through LINT0
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_LINT0, LVT_EXTINT);
+    lapic_write(LAPIC_LVT_LINT1, LVT_NMI);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    // count down from the maximum for a bit to find out how fast the timer runs
+    lapic_write(LAPIC_TIMER_DIVIDE, 0x3); // divide by 16
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xffffffff);
+
+    uint64_t start = clock_ns(), now;
+    while ((now = clock_ns()) - start < CALIBRATION_NS);
+
+    uint32_t elapsed = 0xffffffff - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_hz = (uint64_t) elapsed * NS_PER_SEC / (now - start);
+
+    // stop it and switch to one-shot mode
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+
+    printf("local APIC at %08x, timer runs at %d.%02d MHz\n", (uint32_t) (uintptr_t) lapic,
+        (uint32_t) (lapic_hz / 1000000), (uint32_t) (lapic_hz / 10000) % 100);
+
+    return true;
+}
+
+void clockevent_init(void) {
+    if (lapic_init()) {
+        // the PIT's wraps only need counting if the clock is based on it
+        if (clock_uses_tsc())
+            outb(0x21, inb(0x21) | 1);
+    } else {
+        printf("no local APIC, using PIT for clock events\n");
+        clockevent_program(CLOCKEVENT_NEVER);
+    }
+}
+
+// arms the clock event device to interrupt at (or as soon as possible after) the given clock time
+void clockevent_program(uint64_t deadline) {
+    uint64_t delta = MAX_EVENT_NS;
+
+    if (deadline != CLOCKEVENT_NEVER) {
+        uint64_t now = clock_ns();
+        delta = deadline > now ? deadline - now : 0;
+
+        if (delta > MAX_EVENT_NS)
+            delta = MAX_EVENT_NS;
+    }
+
+    if (lapic == NULL) {
+        // the PIT also keeps the clock going in this case, so it has to be armed even if nothing is due
+        pit_arm(delta * PIT_HZ / NS_PER_SEC);
+        return;
+    }
+
+    if (deadline == CLOCKEVENT_NEVER) {
+        lapic_write(LAPIC_TIMER_INITIAL, 0);
+        return;
+    }
+
+    uint64_t count = delta * lapic_hz / NS_PER_SEC;
+
+    if (count == 0)
+        count = 1;
+    if (count > 0xffffffff)
+        count = 0xffffffff;
+
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+void lapic_timer_interrupt(void) {
+    timer_interrupt();
+    lapic_write(LAPIC_EOI, 0);
+}
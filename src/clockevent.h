@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+/* passed to clockevent_program when nothing needs to happen */
+#define CLOCKEVENT_NEVER UINT64_MAX
+
+void clockevent_init(void);
+void clockevent_program(uint64_t deadline);
+void lapic_timer_interrupt(void);
@@ -0,0 +1,86 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "cmdline.h"
+
+/*
+ * options passed on the kernel command line by the bootloader, as space separated name=value pairs. the bootloader
+ * puts the kernel's path first, which is just a word without a value and gets ignored like any other
+ */
+
+static const char *kernel_cmdline = NULL;
+
+void cmdline_init(const char *cmdline) {
+    kernel_cmdline = cmdline;
+}
+
+// finds the value of an option. returns NULL if it isn't there, otherwise the value (which isn't NUL terminated)
+const char *cmdline_get(const char *name, size_t *length) {
+    if (kernel_cmdline == NULL)
+        return NULL;
+
+    size_t name_length = strlen(name);
+    const char *word = kernel_cmdline;
+
+    while (*word != 0) {
+        size_t word_length = strcspn(word, " ");
+
+        if (word_length > name_length && !strncmp(word, name, name_length) && word[name_length] == '=') {
+            *length = word_length - name_length - 1;
+            return word + name_length + 1;
+        }
+
+        word += word_length;
+        word += strspn(word, " ");
+    }
+
+    return NULL;
+}
+
+/*
+ * reads a number option, which may have a K, M or G suffix. returns the default if it's missing or malformed, and
+ * anything too big to fit (like luamem=4G) is as big as it can be rather than wrapping around to something small
+ */
+uint32_t cmdline_get_number(const char *name, uint32_t default_value) {
+    size_t length;
+    const char *value = cmdline_get(name, &length);
+
+    if (value == NULL || length == 0)
+        return default_value;
+
+    uint64_t number = 0;
+    size_t i;
+
+    for (i = 0; i < length && value[i] >= '0' && value[i] <= '9'; i ++) {
+        number = number * 10 + (value[i] - '0');
+
+        if (number > UINT32_MAX)
+            number = (uint64_t) UINT32_MAX + 1;
+    }
+
+    if (i == 0)
+        return default_value;
+
+    if (i + 1 == length) {
+        switch (value[i]) {
+            case 'K':
+            case 'k':
+                number <<= 10;
+                break;
+            case 'M':
+            case 'm':
+                number <<= 20;
+                break;
+            case 'G':
+            case 'g':
+                number <<= 30;
+                break;
+            default:
+                return default_value;
+        }
+    } else if (i != length)
+        return default_value;
+
+    return number > UINT32_MAX ? UINT32_MAX : number;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+void cmdline_init(const char *cmdline);
+const char *cmdline_get(const char *name, size_t *length);
+uint32_t cmdline_get_number(const char *name, uint32_t default_value);
@@ -0,0 +1,401 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "cdrom.h"
+#include "api/component.h"
+#include "api/buffer.h"
+#include "uuid.h"
+#include "atapi.h"
+#include "iso9660.h"
+#include "luaload.h"
+#include "handles.h"
+#include "cmdline.h"
+
+/*
+ * the disc in the machine's CD drive as a read-only filesystem, so an OS can be booted off the CD without all of it
+ * having to be loaded as a module first. nothing is read until it's used (see iso9660.c). booting with cdrom=0
+ * leaves the drive alone
+ */
+
+struct open_file {
+    struct iso9660_entry *entry;
+    size_t position;
+};
+
+struct cdrom_data {
+    struct atapi_drive drive;
+    struct iso9660_volume *volume;
+    struct handle_table open_files;
+};
+
+static struct iso9660_entry *check_entry(lua_State *L, struct cdrom_data *data, int index) {
+    struct iso9660_entry *entry = iso9660_lookup(data->volume, luaL_checkstring(L, index));
+
+    if (entry == NULL)
+        luaL_error(L, "file not found");
+
+    return entry;
+}
+
+static struct iso9660_entry *check_file(lua_State *L, struct cdrom_data *data, int index) {
+    struct iso9660_entry *entry = check_entry(L, data, index);
+
+    if (entry->directory)
+        luaL_error(L, "file not found");
+
+    return entry;
+}
+
+static struct open_file *check_open_file(lua_State *L, struct cdrom_data *data, int index) {
+    struct open_file *open_file = handle_find(&data->open_files, luaL_checkinteger(L, index));
+
+    if (open_file == NULL)
+        luaL_error(L, "invalid handle");
+
+    return open_file;
+}
+
+// reads part of a file into a new string
+static void push_data(lua_State *L, struct cdrom_data *data, struct iso9660_entry *entry, size_t position, size_t count) {
+    luaL_Buffer buffer;
+    char *out = luaL_buffinitsize(L, &buffer, count);
+
+    if (!iso9660_read(data->volume, entry, position, out, count))
+        luaL_error(L, "can't read disc");
+
+    luaL_pushresultsize(&buffer, count);
+}
+
+static int cdrom_space_used(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    lua_pushnumber(L, (lua_Number) data->volume->sector_count * ATAPI_SECTOR_SIZE);
+    return 1;
+}
+
+static int cdrom_open(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+    const char *mode = lua_isstring(L, arguments_start + 1) ? lua_tostring(L, arguments_start + 1) : "r";
+
+    if (!*path || !*mode)
+        return luaL_error(L, "bad argument");
+
+    if (strchr(mode, 'w') != NULL || strchr(mode, 'a') != NULL)
+        return luaL_error(L, "read-only filesystem");
+
+    struct iso9660_entry *entry = check_file(L, data, arguments_start);
+    struct open_file *open_file = malloc(sizeof(struct open_file));
+
+    if (open_file == NULL)
+        return luaL_error(L, "not enough memory");
+
+    lua_Integer handle = handle_new(&data->open_files, open_file);
+
+    if (handle < 0) {
+        free(open_file);
+        return luaL_error(L, "too many open files");
+    }
+
+    open_file->entry = entry;
+    open_file->position = 0;
+
+    lua_pushinteger(L, handle);
+    return 1;
+}
+
+static int cdrom_seek(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
+    const char *whence = luaL_checkstring(L, arguments_start + 1);
+    lua_Integer offset = luaL_checkinteger(L, arguments_start + 2);
+
+    lua_Integer position = open_file->position;
+
+    if (!strcmp(whence, "cur")) {
+        position += offset;
+    } else if (!strcmp(whence, "set")) {
+        position = offset;
+    } else if (!strcmp(whence, "end")) {
+        position = open_file->entry->size + offset;
+    }
+
+    open_file->position = position < 0 ? 0 : position;
+
+    lua_pushnumber(L, open_file->position);
+    return 1;
+}
+
+static int cdrom_read_only(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    return luaL_error(L, "read-only filesystem");
+}
+
+static int cdrom_exists(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+
+    lua_pushboolean(L, *path && iso9660_lookup(data->volume, path) != NULL);
+    return 1;
+}
+
+static int cdrom_is_read_only(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int cdrom_write(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    check_open_file(L, data, arguments_start);
+    return luaL_error(L, "file not open for writing");
+}
+
+static int cdrom_is_directory(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    lua_pushboolean(L, check_entry(L, data, arguments_start)->directory);
+    return 1;
+}
+
+static int cdrom_list(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    struct iso9660_entry *directory = iso9660_lookup(data->volume, luaL_checkstring(L, arguments_start));
+
+    if (directory == NULL || !directory->directory)
+        return luaL_error(L, "directory not found");
+
+    if (!iso9660_load_directory(data->volume, directory))
+        return luaL_error(L, "can't read disc");
+
+    lua_createtable(L, directory->child_count, 0);
+
+    int i = 1;
+
+    for (struct iso9660_entry *entry = directory->first_child; entry != NULL; entry = entry->next_sibling, i ++) {
+        // directories are listed with a slash on the end
+        if (entry->directory)
+            lua_pushfstring(L, "%s/", entry->name);
+        else
+            lua_pushlstring(L, entry->name, entry->name_length);
+
+        lua_rawseti(L, -2, i);
+    }
+
+    return 1;
+}
+
+static int cdrom_last_modified(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    lua_pushnumber(L, check_entry(L, data, arguments_start)->mtime);
+    return 1;
+}
+
+static int cdrom_get_label(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    lua_pushstring(L, data->volume->label);
+    return 1;
+}
+
+static int cdrom_close(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    lua_Integer handle = luaL_checkinteger(L, arguments_start);
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
+
+    handle_free(&data->open_files, handle);
+    free(open_file);
+
+    return 0;
+}
+
+static int cdrom_size(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    struct iso9660_entry *entry = check_entry(L, data, arguments_start);
+
+    lua_pushnumber(L, entry->directory ? 0 : entry->size);
+    return 1;
+}
+
+// reads up to the requested amount, or the rest of the file for math.huge
+static int cdrom_read(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
+    lua_Number requested = luaL_checknumber(L, arguments_start + 1);
+    size_t size = open_file->entry->size;
+
+    if (open_file->position >= size) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size_t remaining = size - open_file->position;
+    size_t count = requested >= remaining ? remaining : requested > 0 ? (size_t) requested : 0;
+
+    push_data(L, data, open_file->entry, open_file->position, count);
+    open_file->position += count;
+
+    return 1;
+}
+
+// returns the whole of a file as one string, without needing a handle
+static int cdrom_read_all(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    struct iso9660_entry *entry = check_file(L, data, arguments_start);
+
+    push_data(L, data, entry, 0, entry->size);
+    return 1;
+}
+
+// returns a read-only buffer of a file's contents (see buffer.c). sectors only stay put while they're cached, so it's a copy
+static int cdrom_view(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    struct iso9660_entry *entry = check_file(L, data, arguments_start);
+    struct buffer *buffer = buffer_push_new(L, entry->size);
+
+    if (!iso9660_read(data->volume, entry, 0, buffer->data, buffer->size))
+        return luaL_error(L, "can't read disc");
+
+    buffer->read_only = true;
+    return 1;
+}
+
+struct file_reader {
+    struct iso9660_volume *volume;
+    struct iso9660_entry *entry;
+    size_t position;
+    bool failed;
+};
+
+// hands a file to lua_load a sector at a time, straight out of the cache
+static const char *read_file(lua_State *L, void *ud, size_t *size) {
+    struct file_reader *reader = ud;
+    const char *span = iso9660_span(reader->volume, reader->entry, reader->position, size);
+
+    if (span != NULL)
+        reader->position += *size;
+    else if (reader->position < reader->entry->size)
+        reader->failed = true;
+
+    return span;
+}
+
+// finds the precompiled version of a .lua file, if it has one that can be used (see luaload.c)
+static struct iso9660_entry *find_bytecode(lua_State *L, struct cdrom_data *data, const char *path) {
+    size_t length = strlen(path);
+    char luac_path[256];
+
+    if (length < 4 || strcmp(path + length - 4, ".lua") || length + 2 > sizeof(luac_path))
+        return NULL;
+
+    memcpy(luac_path, path, length);
+    luac_path[length] = 'c';
+    luac_path[length + 1] = 0;
+
+    struct iso9660_entry *entry = iso9660_lookup(data->volume, luac_path);
+
+    if (entry == NULL || entry->directory)
+        return NULL;
+
+    // only the header has to be read to tell
+    char header[64];
+    size_t header_size = entry->size < sizeof(header) ? entry->size : sizeof(header);
+
+    if (!iso9660_read(data->volume, entry, 0, header, header_size) || !bytecode_compatible(L, header, header_size)) {
+        printf("ignoring %s, it was compiled for a different Lua\n", luac_path);
+        return NULL;
+    }
+
+    return entry;
+}
+
+/*
+ * compiles a file off the disc, like loadfile but without it having to be read into a string first. takes the same
+ * chunk name, mode and environment arguments as load, and returns nil and the error on failure. a precompiled .luac
+ * next to a .lua file is used instead of it if there is one and the mode allows it
+ */
+static int cdrom_loadfile(lua_State *L, struct cdrom_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+    const char *chunkname = luaL_optstring(L, arguments_start + 1, NULL);
+    const char *mode = luaL_optstring(L, arguments_start + 2, "bt");
+    bool has_env = !lua_isnone(L, arguments_start + 3);
+
+    struct iso9660_entry *source = check_file(L, data, arguments_start);
+    struct iso9660_entry *bytecode = strchr(mode, 'b') != NULL ? find_bytecode(L, data, path) : NULL;
+
+    struct file_reader reader = {
+        .volume = data->volume,
+        .entry = bytecode != NULL ? bytecode : source,
+        .position = 0,
+        .failed = false
+    };
+
+    if (chunkname == NULL)
+        chunkname = lua_pushfstring(L, "@%s", path);
+    else
+        lua_pushstring(L, chunkname);
+
+    int status = lua_load(L, read_file, &reader, chunkname, bytecode != NULL ? "b" : mode);
+    lua_remove(L, -2);
+
+    // a chunk that was cut short by a read error would otherwise just look like bad syntax
+    if (reader.failed) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_pushfstring(L, "can't read %s", path);
+        return 2;
+    }
+
+    if (status != LUA_OK) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    // the environment becomes the chunk's first upvalue, which is _ENV
+    if (has_env) {
+        lua_pushvalue(L, arguments_start + 3);
+        if (!lua_setupvalue(L, -2, 1))
+            lua_pop(L, 1);
+    }
+
+    return 1;
+}
+
+// adds a filesystem component for the disc in the first CD drive there is, if there's one with a disc in it
+void cdrom_init(void) {
+    if (cmdline_get_number("cdrom", 1) == 0)
+        return;
+
+    struct cdrom_data *data = malloc(sizeof(struct cdrom_data));
+    assert(data != NULL);
+
+    if (!atapi_find(&data->drive)) {
+        free(data);
+        return;
+    }
+
+    // cdcache=<size> sets how much of the disc is kept in memory
+    data->volume = iso9660_mount(&data->drive, cmdline_get_number("cdcache", ISO9660_CACHE_DEFAULT));
+
+    if (data->volume == NULL) {
+        printf("no ISO9660 filesystem on the disc\n");
+        free(data);
+        return;
+    }
+
+    data->open_files = HANDLE_TABLE_INIT;
+
+    printf("mounted disc \"%s\"%s\n", data->volume->label, data->volume->rock_ridge ? " with Rock Ridge" : "");
+
+    struct component *filesystem = new_component("filesystem", new_uuid(), data);
+    add_method(filesystem, "spaceUsed", cdrom_space_used);
+    add_method(filesystem, "open", cdrom_open);
+    add_method(filesystem, "seek", cdrom_seek);
+    add_method(filesystem, "makeDirectory", cdrom_read_only);
+    add_method(filesystem, "exists", cdrom_exists);
+    add_method(filesystem, "isReadOnly", cdrom_is_read_only);
+    add_method(filesystem, "write", cdrom_write);
+    add_method(filesystem, "spaceTotal", cdrom_space_used);
+    add_method(filesystem, "isDirectory", cdrom_is_directory);
+    add_method(filesystem, "rename", cdrom_read_only);
+    add_method(filesystem, "list", cdrom_list);
+    add_method(filesystem, "lastModified", cdrom_last_modified);
+    add_method(filesystem, "getLabel", cdrom_get_label);
+    add_method(filesystem, "remove", cdrom_read_only);
+    add_method(filesystem, "close", cdrom_close);
+    add_method(filesystem, "size", cdrom_size);
+    add_method(filesystem, "read", cdrom_read);
+    add_method(filesystem, "readAll", cdrom_read_all);
+    add_method(filesystem, "view", cdrom_view);
+    add_method(filesystem, "loadfile", cdrom_loadfile);
+    add_method(filesystem, "setLabel", cdrom_get_label);
+    add_component(filesystem);
+}
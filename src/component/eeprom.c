@@ -10,7 +10,7 @@ static int eeprom_get(lua_State *L, struct eeprom_data *data, int arguments_star
     if (data->contents == NULL)
         lua_pushnil(L);
     else
-        lua_pushstring(L, data->contents);
+        lua_pushlstring(L, data->contents, data->contents_size);
     return 1;
 }
 
@@ -43,6 +43,7 @@ struct eeprom_data *eeprom_init(void) {
     assert(data != NULL);
 
     data->contents = NULL;
+    data->contents_size = 0;
     data->data = NULL;
     
     struct component *eeprom = new_component("eeprom", new_uuid(), data);
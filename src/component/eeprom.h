@@ -1,7 +1,11 @@
 #pragma once
 
+#include <stddef.h>
+
 struct eeprom_data {
+    // bios.lua, which isn't NUL terminated
     const char *contents;
+    size_t contents_size;
     const char *data;
 };
 
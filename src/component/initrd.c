@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <lua.h>
@@ -10,25 +11,250 @@
 #include "api/component.h"
 #include "uuid.h"
 #include "tar.h"
+#include "ramfs.h"
+#include "luaload.h"
+#include "cmdline.h"
+#include "handles.h"
+#include "api/buffer.h"
+
+/*
+ * the initrd is the lower layer of an overlay, with changes to it kept in memory in an upper layer (see ramfs.c).
+ * a file is copied up the first time it's opened for appending, or moved; opening one for writing only makes an empty
+ * one in the upper layer, since it would be truncated anyway. anything that's still only in the archive is read
+ * straight out of it as before. removing something from the archive leaves a whiteout in its place, and a directory
+ * that's made where one was removed is opaque, so what was in the old one stays hidden. directories that are only in
+ * the archive can't be renamed, since that would mean copying up everything in them.
+ *
+ * overlaysize=<size> on the command line sets how much the upper layer can hold, and 0 makes the initrd read-only.
+ * nothing written to it survives a reboot
+ */
+
+struct open_file {
+    // files that are only in the archive are read straight out of it
+    struct tar_entry *entry;
+    const char *start;
+    size_t size;
+
+    // and ones in the upper layer through a cursor
+    struct ramfs_node *node;
+    struct ramfs_cursor cursor;
+
+    size_t position;
+    bool writing;
+    bool appending;
+};
 
 struct initrd_data {
     const char *name;
     const char *start;
     const char *end;
-    struct open_file *open_files;
-};
+    struct tar_index *index;
 
-struct open_file {
-    int handle_num;
-    const char *start;
-    size_t size;
-    size_t read_pos;
+    // NULL if the initrd is read-only
+    struct ramfs *upper;
 
-    struct open_file *next;
+    struct handle_table open_files;
 };
 
+// what there is at a path in each layer that can be seen through the overlay. both are NULL if there's nothing there
+struct layers {
+    struct ramfs_node *upper;
+    struct tar_entry *lower;
+};
+
+static struct layers lookup(struct initrd_data *data, const char *path) {
+    struct layers layers = {NULL, NULL};
+    struct ramfs_node *upper = data->upper != NULL ? &data->upper->root : NULL;
+    bool lower_hidden = false;
+
+    const char *rest = path;
+    const char *name;
+    size_t length;
+
+    while (upper != NULL && (name = ramfs_next_component(&rest, &length)) != NULL) {
+        // files and whiteouts in the upper layer hide everything below them
+        if (!upper->directory)
+            return layers;
+
+        if (upper->opaque)
+            lower_hidden = true;
+
+        upper = ramfs_find_child(data->upper, upper, name, length);
+
+        if (upper != NULL && upper->whiteout)
+            return layers;
+    }
+
+    layers.upper = upper;
+
+    if (lower_hidden || (upper != NULL && (!upper->directory || upper->opaque)))
+        return layers;
+
+    layers.lower = tar_lookup(data->index, path);
+
+    // a directory in the upper layer only merges with a directory in the archive
+    if (upper != NULL && layers.lower != NULL && layers.lower->kind != TAR_DIRECTORY)
+        layers.lower = NULL;
+
+    return layers;
+}
+
+static bool layers_exist(struct layers layers) {
+    return layers.upper != NULL || layers.lower != NULL;
+}
+
+static bool layers_directory(struct layers layers) {
+    return layers.upper != NULL ? layers.upper->directory : layers.lower != NULL && layers.lower->kind == TAR_DIRECTORY;
+}
+
+/*
+ * makes sure every directory above a path is in the upper layer, copying up any that are only in the archive. returns
+ * the one the path is directly in and where its last component is, or NULL if they can't all be there
+ */
+static struct ramfs_node *copy_up_parents(struct initrd_data *data, const char *path, const char **name, size_t *length) {
+    char prefix[TAR_PATH_MAX];
+    size_t prefix_length = 0;
+    struct ramfs_node *upper = &data->upper->root;
+    bool lower_hidden = false;
+
+    const char *rest = path;
+    const char *component = ramfs_next_component(&rest, length);
+
+    if (component == NULL)
+        return NULL;
+
+    const char *next;
+    size_t next_length;
+
+    while ((next = ramfs_next_component(&rest, &next_length)) != NULL) {
+        if (prefix_length + 1 + *length >= sizeof(prefix))
+            return NULL;
+
+        prefix[prefix_length ++] = '/';
+        memcpy(prefix + prefix_length, component, *length);
+        prefix_length += *length;
+        prefix[prefix_length] = 0;
+
+        if (upper->opaque)
+            lower_hidden = true;
+
+        struct ramfs_node *child = ramfs_find_child(data->upper, upper, component, *length);
+
+        if (child == NULL) {
+            struct tar_entry *entry = lower_hidden ? NULL : tar_lookup(data->index, prefix);
+
+            if (entry == NULL || entry->kind != TAR_DIRECTORY)
+                return NULL;
+
+            child = ramfs_add(data->upper, upper, component, *length, true);
+
+            if (child == NULL)
+                return NULL;
+
+            child->mtime = entry->mtime;
+        }
+
+        if (!child->directory)
+            return NULL;
+
+        upper = child;
+        component = next;
+        *length = next_length;
+    }
+
+    if (*length == 2 && !memcmp(component, "..", 2))
+        return NULL;
+
+    *name = component;
+    return upper;
+}
+
+// adds an empty file or directory to the upper layer, where there's either nothing or a whiteout
+static struct ramfs_node *add_upper(struct initrd_data *data, struct ramfs_node *parent, const char *name, size_t length, bool directory) {
+    struct ramfs_node *node = ramfs_find_child(data->upper, parent, name, length);
+
+    if (node == NULL)
+        return ramfs_add(data->upper, parent, name, length, directory);
+
+    // a whiteout is turned into the new node rather than replaced, so there's no point where what it hid comes back.
+    // a directory made like this mustn't show what was in the one in the archive
+    node->whiteout = false;
+    node->directory = directory;
+    node->opaque = directory;
+
+    return node;
+}
+
+static bool add_whiteout(struct initrd_data *data, const char *path) {
+    const char *name;
+    size_t length;
+    struct ramfs_node *parent = copy_up_parents(data, path, &name, &length);
+
+    if (parent == NULL)
+        return false;
+
+    struct ramfs_node *node = ramfs_add(data->upper, parent, name, length, false);
+
+    if (node == NULL)
+        return false;
+
+    node->whiteout = true;
+    return true;
+}
+
+// copies a file's contents from the archive to the upper layer
+static bool copy_up_data(struct initrd_data *data, struct tar_entry *entry, struct ramfs_node *node) {
+    const char *file_data = tar_open_data(data->index, entry);
+
+    if (file_data == NULL)
+        return false;
+
+    struct ramfs_cursor cursor = RAMFS_CURSOR_INIT;
+    bool copied = ramfs_write(data->upper, node, &cursor, 0, file_data, entry->size);
+    tar_close_data(data->index, entry);
+
+    node->mtime = entry->mtime;
+    return copied;
+}
+
+// pushes the contents of a file in the upper layer, in one piece if they're all in one extent
+static void push_upper_data(lua_State *L, struct ramfs_node *node, struct ramfs_cursor *cursor, size_t position, size_t count) {
+    size_t length;
+    const char *span = ramfs_span(node, cursor, position, &length);
+
+    if (span != NULL && length >= count) {
+        lua_pushlstring(L, span, count);
+        return;
+    }
+
+    luaL_Buffer buffer;
+    char *out = luaL_buffinitsize(L, &buffer, count);
+
+    // the buffer can raise an error, so the file is only read from once it's been made
+    ramfs_read(node, cursor, position, out, count);
+    luaL_pushresultsize(&buffer, count);
+}
+
+static struct open_file *check_open_file(lua_State *L, struct initrd_data *data, int index) {
+    struct open_file *open_file = handle_find(&data->open_files, luaL_checkinteger(L, index));
+
+    if (open_file == NULL)
+        luaL_error(L, "invalid handle");
+
+    return open_file;
+}
+
+static size_t open_file_size(struct open_file *open_file) {
+    return open_file->node != NULL ? open_file->node->size : open_file->size;
+}
+
 static int initrd_space_used(lua_State *L, struct initrd_data *data, int arguments_start) {
-    lua_pushnumber(L, data->end - data->start);
+    lua_pushnumber(L, (data->end - data->start) + (data->upper != NULL ? data->upper->used : 0));
+    return 1;
+}
+
+static int initrd_space_total(lua_State *L, struct initrd_data *data, int arguments_start) {
+    lua_pushnumber(L, (data->end - data->start) + (data->upper != NULL ? data->upper->capacity : 0));
     return 1;
 }
 
@@ -39,66 +265,159 @@ static int initrd_open(lua_State *L, struct initrd_data *data, int arguments_sta
     if (!*path || !*mode)
         return luaL_error(L, "bad argument");
 
-    if (strstr(mode, "r") == NULL || strstr(mode, "w") != NULL)
+    bool writing = strchr(mode, 'w') != NULL;
+    bool appending = strchr(mode, 'a') != NULL;
+
+    if ((writing || appending) && data->upper == NULL)
         return luaL_error(L, "read-only filesystem");
 
-    struct tar_iterator *iter = open_tar(data->start, data->end);
-    const char *file_data;
-    size_t file_size;
-    if (!tar_find(iter, path, TAR_NORMAL_FILE, &file_data, &file_size))
+    struct layers layers = lookup(data, path);
+
+    if (layers_directory(layers) || (!layers_exist(layers) && !writing && !appending))
         return luaL_error(L, "file not found");
 
+    struct ramfs_node *node = layers.upper;
+
+    if ((writing || appending) && node == NULL) {
+        const char *name;
+        size_t length;
+        struct ramfs_node *parent = copy_up_parents(data, path, &name, &length);
+
+        if (parent == NULL)
+            return luaL_error(L, "file not found");
+
+        node = add_upper(data, parent, name, length, false);
+
+        if (node == NULL)
+            return luaL_error(L, "not enough space");
+
+        if (appending && layers.lower != NULL && !copy_up_data(data, layers.lower, node)) {
+            ramfs_remove(data->upper, node);
+            return luaL_error(L, "not enough space");
+        }
+    }
+
     struct open_file *open_file = malloc(sizeof(struct open_file));
-    assert(open_file != NULL);
-    open_file->start = file_data;
-    open_file->size = file_size;
-    open_file->read_pos = 0;
-
-    if (data->open_files == NULL) {
-        open_file->handle_num = 0;
-        open_file->next = NULL;
-    } else {
-        open_file->handle_num = data->open_files->handle_num + 1;
-        open_file->next = data->open_files;
+
+    if (open_file == NULL)
+        return luaL_error(L, "not enough memory");
+
+    lua_Integer handle = handle_new(&data->open_files, open_file);
+
+    if (handle < 0) {
+        free(open_file);
+        return luaL_error(L, "too many open files");
     }
 
-    data->open_files = open_file;
+    open_file->entry = NULL;
+    open_file->start = NULL;
+    open_file->size = 0;
+    open_file->node = node;
+    open_file->cursor = RAMFS_CURSOR_INIT;
+    open_file->position = 0;
+    open_file->writing = writing || appending;
+    open_file->appending = appending;
 
-    lua_pushnumber(L, open_file->handle_num);
-    return 1;
-}
+    if (node != NULL) {
+        if (writing)
+            ramfs_truncate(data->upper, node);
 
-static int initrd_readonly(lua_State *L, struct initrd_data *data, int arguments_start) {
-    return luaL_error(L, "read-only filesystem");
-}
+        ramfs_open(node);
 
-static struct open_file *find_open_file(struct initrd_data *data, int handle) {
-    for (struct open_file *open_file = data->open_files; open_file != NULL; open_file = open_file->next)
-        if (open_file->handle_num == handle)
-            return open_file;
+        if (appending)
+            open_file->position = node->size;
+    } else {
+        // compressed files are decompressed here, and stay that way until they're closed
+        const char *file_data = tar_open_data(data->index, layers.lower);
 
-    return NULL;
+        if (file_data == NULL) {
+            handle_free(&data->open_files, handle);
+            free(open_file);
+            return luaL_error(L, "not enough memory");
+        }
+
+        open_file->entry = layers.lower;
+        open_file->start = file_data;
+        open_file->size = layers.lower->size;
+    }
+
+    lua_pushinteger(L, handle);
+    return 1;
 }
 
 static int initrd_seek(lua_State *L, struct initrd_data *data, int arguments_start) {
-    int handle = luaL_checkinteger(L, arguments_start);
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
     const char *whence = luaL_checkstring(L, arguments_start + 1);
-    int offset = luaL_checkinteger(L, arguments_start + 2);
+    lua_Integer offset = luaL_checkinteger(L, arguments_start + 2);
 
-    struct open_file *open_file = find_open_file(data, handle);
-
-    if (open_file == NULL)
-        return luaL_error(L, "invalid handle");
+    lua_Integer position = open_file->position;
 
     if (!strcmp(whence, "cur")) {
-        open_file->read_pos += offset;
+        position += offset;
     } else if (!strcmp(whence, "set")) {
-        open_file->read_pos = offset;
+        position = offset;
     } else if (!strcmp(whence, "end")) {
-        open_file->read_pos = open_file->size + offset;
+        position = open_file_size(open_file) + offset;
     }
 
-    lua_pushnumber(L, open_file->read_pos);
+    open_file->position = position < 0 ? 0 : position;
+
+    lua_pushnumber(L, open_file->position);
+    return 1;
+}
+
+// makes a directory and any of the ones above it that are missing
+static int initrd_make_directory(lua_State *L, struct initrd_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+
+    if (data->upper == NULL)
+        return luaL_error(L, "read-only filesystem");
+
+    if (layers_exist(lookup(data, path))) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    char prefix[TAR_PATH_MAX];
+    size_t prefix_length = 0;
+
+    const char *rest = path;
+    const char *component;
+    size_t length;
+
+    while ((component = ramfs_next_component(&rest, &length)) != NULL) {
+        if (prefix_length + 1 + length >= sizeof(prefix)) {
+            lua_pushboolean(L, false);
+            return 1;
+        }
+
+        prefix[prefix_length ++] = '/';
+        memcpy(prefix + prefix_length, component, length);
+        prefix_length += length;
+        prefix[prefix_length] = 0;
+
+        struct layers layers = lookup(data, prefix);
+
+        if (layers_exist(layers)) {
+            if (!layers_directory(layers)) {
+                lua_pushboolean(L, false);
+                return 1;
+            }
+
+            continue;
+        }
+
+        const char *name;
+        size_t name_length;
+        struct ramfs_node *parent = copy_up_parents(data, prefix, &name, &name_length);
+
+        if (parent == NULL || add_upper(data, parent, name, name_length, true) == NULL) {
+            lua_pushboolean(L, false);
+            return 1;
+        }
+    }
+
+    lua_pushboolean(L, true);
     return 1;
 }
 
@@ -110,19 +429,113 @@ static int initrd_exists(lua_State *L, struct initrd_data *data, int arguments_s
         return 1;
     }
 
-    struct tar_iterator *iter = open_tar(data->start, data->end);
-    const char *file_data;
-    size_t file_size;
+    lua_pushboolean(L, layers_exist(lookup(data, path)));
+    return 1;
+}
 
-    lua_pushboolean(L, tar_find(iter, path, 0, &file_data, &file_size));
+static int initrd_is_read_only(lua_State *L, struct initrd_data *data, int arguments_start) {
+    lua_pushboolean(L, data->upper == NULL);
     return 1;
 }
 
-static int initrd_is_read_only(lua_State *L, void *data, int arguments_start) {
+static int initrd_write(lua_State *L, struct initrd_data *data, int arguments_start) {
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
+    size_t length;
+    const char *value = luaL_checklstring(L, arguments_start + 1, &length);
+
+    if (!open_file->writing)
+        return luaL_error(L, "file not open for writing");
+
+    if (open_file->appending)
+        open_file->position = open_file->node->size;
+
+    if (!ramfs_write(data->upper, open_file->node, &open_file->cursor, open_file->position, value, length))
+        return luaL_error(L, "not enough space");
+
+    open_file->position += length;
+
     lua_pushboolean(L, true);
     return 1;
 }
 
+static int initrd_rename(lua_State *L, struct initrd_data *data, int arguments_start) {
+    const char *from = luaL_checkstring(L, arguments_start);
+    const char *to = luaL_checkstring(L, arguments_start + 1);
+
+    if (data->upper == NULL)
+        return luaL_error(L, "read-only filesystem");
+
+    struct layers source = lookup(data, from);
+    const char *name;
+    size_t length;
+    struct ramfs_node *parent;
+
+    if (!layers_exist(source) || layers_exist(lookup(data, to)) || (source.lower != NULL && source.lower->kind == TAR_DIRECTORY)
+            || (parent = copy_up_parents(data, to, &name, &length)) == NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    bool moved;
+    struct ramfs_node *whiteout = ramfs_find_child(data->upper, parent, name, length);
+
+    if (source.lower == NULL) {
+        // a whiteout where it's going is put back if the move doesn't work out
+        if (whiteout != NULL)
+            ramfs_remove(data->upper, whiteout);
+
+        moved = ramfs_move(data->upper, source.upper, parent, name, length);
+
+        if (moved && whiteout != NULL && source.upper->directory)
+            source.upper->opaque = true;
+        else if (!moved && whiteout != NULL)
+            add_whiteout(data, to);
+
+        // and one is left behind if it was hiding something in the archive
+        if (moved && layers_exist(lookup(data, from)))
+            add_whiteout(data, from);
+    } else {
+        // a file that's only in the archive is copied up under its new name, and a whiteout left under the old one
+        struct ramfs_node *node = add_upper(data, parent, name, length, false);
+
+        moved = node != NULL && copy_up_data(data, source.lower, node) && add_whiteout(data, from);
+
+        if (!moved && node != NULL) {
+            ramfs_remove(data->upper, node);
+
+            if (whiteout != NULL)
+                add_whiteout(data, to);
+        }
+    }
+
+    lua_pushboolean(L, moved);
+    return 1;
+}
+
+static int initrd_remove(lua_State *L, struct initrd_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+
+    if (data->upper == NULL)
+        return luaL_error(L, "read-only filesystem");
+
+    const char *rest = path;
+    size_t length;
+    struct layers layers = lookup(data, path);
+
+    // the root can't be removed
+    if (!layers_exist(layers) || ramfs_next_component(&rest, &length) == NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    if (layers.upper != NULL)
+        ramfs_remove(data->upper, layers.upper);
+
+    // anything the upper layer was hiding in the archive has to stay hidden
+    lua_pushboolean(L, !layers_exist(lookup(data, path)) || add_whiteout(data, path));
+    return 1;
+}
+
 static int initrd_get_label(lua_State *L, struct initrd_data *data, int arguments_start) {
     lua_pushstring(L, data->name);
     return 1;
@@ -136,101 +549,229 @@ static int initrd_size(lua_State *L, struct initrd_data *data, int arguments_sta
         return 1;
     }
 
-    struct tar_iterator *iter = open_tar(data->start, data->end);
-    const char *file_data;
-    size_t file_size;
-    if (!tar_find(iter, path, TAR_NORMAL_FILE, &file_data, &file_size))
+    struct layers layers = lookup(data, path);
+
+    if (!layers_exist(layers) || layers_directory(layers))
         return luaL_error(L, "file not found");
 
-    lua_pushnumber(L, file_size);
+    lua_pushnumber(L, layers.upper != NULL ? layers.upper->size : layers.lower->size);
     return 1;
 }
 
 static int initrd_close(lua_State *L, struct initrd_data *data, int arguments_start) {
-    int handle = luaL_checkinteger(L, arguments_start);
-
-    struct open_file *open_file = data->open_files, *last = NULL;
+    lua_Integer handle = luaL_checkinteger(L, arguments_start);
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
 
-    for (; open_file != NULL; last = open_file, open_file = open_file->next)
-        if (open_file->handle_num == handle) {
-            if (last == NULL)
-                data->open_files = open_file->next;
-            else
-                last->next = open_file->next;
-
-            free(open_file);
+    if (open_file->node != NULL)
+        ramfs_close(data->upper, open_file->node);
+    else
+        tar_close_data(data->index, open_file->entry);
 
-            return 0;
-        }
+    handle_free(&data->open_files, handle);
+    free(open_file);
 
-    return luaL_error(L, "invalid handle");
+    return 0;
 }
 
+/*
+ * reads as much of the requested amount as there is in one go, straight out of the archive for files that haven't
+ * been changed. a count of math.huge (which is what OpenOS asks for when it wants everything) reads the rest of the
+ * file
+ */
 static int initrd_read(lua_State *L, struct initrd_data *data, int arguments_start) {
-    int handle = luaL_checkinteger(L, arguments_start);
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
+    lua_Number requested = luaL_checknumber(L, arguments_start + 1);
+    size_t size = open_file_size(open_file);
 
-    // lua is on crack
-    uint64_t count2 = luaL_checkinteger(L, arguments_start);
-    size_t count = count2 >= UINTPTR_MAX ? UINTPTR_MAX : count;
+    if (open_file->writing)
+        return luaL_error(L, "file not open for reading");
 
-    struct open_file *open_file = find_open_file(data, handle);
+    if (open_file->position >= size) {
+        lua_pushnil(L);
+        return 1;
+    }
 
-    if (open_file == NULL)
-        return luaL_error(L, "invalid handle");
+    size_t remaining = size - open_file->position;
+    size_t count = requested >= remaining ? remaining : requested > 0 ? (size_t) requested : 0;
 
-    if (open_file->read_pos >= open_file->size) {
-        lua_pushnil(L);
+    if (open_file->node != NULL)
+        push_upper_data(L, open_file->node, &open_file->cursor, open_file->position, count);
+    else
+        lua_pushlstring(L, open_file->start + open_file->position, count);
+
+    open_file->position += count;
+
+    return 1;
+}
+
+// returns the whole of a file as one string, without needing a handle
+static int initrd_read_all(lua_State *L, struct initrd_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+    struct layers layers = lookup(data, path);
+
+    if (!layers_exist(layers) || layers_directory(layers))
+        return luaL_error(L, "file not found");
+
+    if (layers.upper != NULL) {
+        struct ramfs_cursor cursor = RAMFS_CURSOR_INIT;
+        push_upper_data(L, layers.upper, &cursor, 0, layers.upper->size);
         return 1;
     }
 
-    if (count > open_file->size)
-        count = open_file->size;
+    const char *file_data = tar_open_data(data->index, layers.lower);
+
+    if (file_data == NULL)
+        return luaL_error(L, "not enough memory");
+
+    lua_pushlstring(L, file_data, layers.lower->size);
+    tar_close_data(data->index, layers.lower);
+
+    return 1;
+}
+
+static void release_view(void *index, void *entry) {
+    tar_close_data(index, entry);
+}
+
+/*
+ * returns a read-only buffer of a file's contents (see buffer.c). for files that are only in the archive it's a view
+ * straight into it rather than a copy, which keeps the file open until it's collected
+ */
+static int initrd_view(lua_State *L, struct initrd_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+    struct layers layers = lookup(data, path);
+
+    if (!layers_exist(layers) || layers_directory(layers))
+        return luaL_error(L, "file not found");
+
+    if (layers.upper != NULL) {
+        struct buffer *buffer = buffer_push_new(L, layers.upper->size);
+        struct ramfs_cursor cursor = RAMFS_CURSOR_INIT;
+
+        ramfs_read(layers.upper, &cursor, 0, buffer->data, buffer->size);
+        buffer->read_only = true;
 
-    if (open_file->read_pos + count >= open_file->size)
-        count -= open_file->size - (open_file->read_pos + count);
-    
-    if (count == 0) {
-        lua_pushnil(L);
         return 1;
     }
 
-    lua_pushlstring(L, open_file->start + open_file->read_pos, count);
+    struct buffer *view = buffer_push_view(L);
+    const char *file_data = tar_open_data(data->index, layers.lower);
 
-    open_file->read_pos += count;
+    if (file_data == NULL)
+        return luaL_error(L, "not enough memory");
+
+    view->data = (char *) file_data;
+    view->size = layers.lower->size;
+    buffer_set_release(view, release_view, data->index, layers.lower);
 
     return 1;
 }
 
-static int initrd_is_directory(lua_State *L, struct initrd_data *data, int arguments_start) {
-    size_t len;
-    const char *path = luaL_checklstring(L, arguments_start, &len);
-
-    struct tar_iterator *iter = open_tar(data->start, data->end);
-    const char *file_data;
-    size_t file_size;
-    if (!tar_find(iter, path, 0, &file_data, &file_size)) {
-        if (path[len - 1] == '/')
-            return luaL_error(L, "file not found");
+struct upper_reader {
+    struct ramfs_node *node;
+    struct ramfs_cursor cursor;
+    size_t position;
+};
 
-        const char *old_path = path;
-        path = malloc(++len);
-        assert(path != NULL);
-        sprintf(path, "%s/", old_path);
+// hands a file in the upper layer to lua_load an extent at a time
+static const char *read_upper(lua_State *L, void *ud, size_t *size) {
+    struct upper_reader *reader = ud;
+    const char *span = ramfs_span(reader->node, &reader->cursor, reader->position, size);
 
-        iter = open_tar(data->start, data->end);
-        if (!tar_find(iter, path, TAR_DIRECTORY, &file_data, &file_size)) {
-            free(path);
-            return luaL_error(L, "file not found");
+    if (span != NULL)
+        reader->position += *size;
+
+    return span;
+}
+
+/*
+ * compiles a file straight from the archive, like loadfile but without it having to be read into a string first.
+ * takes the same chunk name, mode and environment arguments as load, and returns nil and the error on failure.
+ * a precompiled .luac next to a .lua file is used instead of it if there is one (see luaload.c), unless either of
+ * them has been changed
+ */
+static int initrd_loadfile(lua_State *L, struct initrd_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+    const char *chunkname = luaL_optstring(L, arguments_start + 1, NULL);
+    const char *mode = luaL_optstring(L, arguments_start + 2, "bt");
+    bool has_env = !lua_isnone(L, arguments_start + 3);
+
+    struct layers layers = lookup(data, path);
+
+    if (!layers_exist(layers) || layers_directory(layers))
+        return luaL_error(L, "file not found");
+
+    int status;
+
+    if (layers.upper != NULL) {
+        struct upper_reader reader = {
+            .node = layers.upper,
+            .cursor = RAMFS_CURSOR_INIT,
+            .position = 0
+        };
+
+        if (chunkname == NULL)
+            chunkname = lua_pushfstring(L, "@%s", path);
+        else
+            lua_pushstring(L, chunkname);
+
+        status = lua_load(L, read_upper, &reader, chunkname, mode);
+        lua_remove(L, -2);
+    } else {
+        // anything in the upper layer where the .luac would be means the one in the archive is out of date
+        size_t length = strlen(path);
+        char luac_path[TAR_PATH_MAX];
+        bool bytecode_changed = length + 2 <= sizeof(luac_path) && data->upper != NULL;
+
+        if (bytecode_changed) {
+            memcpy(luac_path, path, length);
+            luac_path[length] = 'c';
+            luac_path[length + 1] = 0;
+            bytecode_changed = ramfs_lookup(data->upper, luac_path) != NULL;
         }
 
-        free(path);
-        lua_pushboolean(L, true);
-        return 1;
+        // which means binary chunks are off the table, so the mode is narrowed to just text, if it allowed that
+        if (bytecode_changed) {
+            if (strchr(mode, 't') == NULL) {
+                lua_pushnil(L);
+                lua_pushfstring(L, "attempt to load a text chunk (mode is '%s')", mode);
+                return 2;
+            }
+
+            mode = "t";
+        }
+
+        status = luaload_file(L, data->index, path, chunkname, mode);
+
+        // anything else that went wrong opening it is passed on like a load error
+        if (status == LUA_ERRFILE)
+            return luaL_error(L, "file not found");
     }
 
-    struct tar_header *header = file_data - 512; // hehe
+    if (status != LUA_OK) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    // the environment becomes the chunk's first upvalue, which is _ENV
+    if (has_env) {
+        lua_pushvalue(L, arguments_start + 3);
+        if (!lua_setupvalue(L, -2, 1))
+            lua_pop(L, 1);
+    }
 
-    lua_pushboolean(L, header->kind == TAR_DIRECTORY);
+    return 1;
+}
+
+static int initrd_is_directory(lua_State *L, struct initrd_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+    struct layers layers = lookup(data, path);
+
+    if (!layers_exist(layers))
+        return luaL_error(L, "file not found");
+
+    lua_pushboolean(L, layers_directory(layers));
     return 1;
 }
 
@@ -242,110 +783,105 @@ static int initrd_last_modified(lua_State *L, struct initrd_data *data, int argu
         return 1;
     }
 
-    struct tar_iterator *iter = open_tar(data->start, data->end);
-    const char *file_data;
-    size_t file_size;
-    if (!tar_find(iter, path, 0, &file_data, &file_size))
-        return luaL_error(L, "file not found");
+    struct layers layers = lookup(data, path);
 
-    struct tar_header *header = file_data - 512; // hehe
+    if (!layers_exist(layers))
+        return luaL_error(L, "file not found");
 
-    lua_pushnumber(L, oct2bin(&header->mod_time, 11));
+    lua_pushnumber(L, layers.upper != NULL ? layers.upper->mtime : layers.lower->mtime);
     return 1;
 }
 
+// lists what's in a directory in the upper layer, then whatever's in the archive's version that isn't hidden by it
 static int initrd_list(lua_State *L, struct initrd_data *data, int arguments_start) {
-    const char name[256];
-    size_t len;
-    const char *path = luaL_checklstring(L, arguments_start, &len);
-
-    if (*path == '/') {
-        path++;
-        len--;
-    }
-
-    bool should_free = false;
-    if (path[len - 1] != '/') {
-        const char *old_path = path;
-        path = malloc(++len);
-        assert(path != NULL);
-        sprintf(path, "%s/", old_path);
-        should_free = true;
-    }
-
-    lua_newtable(L);
-
-    struct tar_iterator *iter = open_tar(data->start, data->end);
-    const char *file_data;
-    size_t file_size;
+    const char *path = luaL_checkstring(L, arguments_start);
+    struct layers layers = lookup(data, path);
 
-    if (!tar_find(iter, path, TAR_DIRECTORY, &file_data, &file_size)) {
-        if (should_free)
-            free(path);
+    if (!layers_directory(layers))
         return luaL_error(L, "directory not found");
-    }
 
-    for (int i = 1;; i++) {
-        struct tar_header *header;
-        const char *name_ptr = &name;
+    size_t count = (layers.upper != NULL ? layers.upper->child_count : 0) + (layers.lower != NULL ? layers.lower->child_count : 0);
+    lua_createtable(L, count, 0);
 
-        if (!next_file(iter, &header, &file_data, &file_size))
-            break;
+    int i = 1;
 
-        header->name[99] = 0;
-        header->filename_prefix[154] = 0;
-        sprintf(name, "%s%s", header->name, header->filename_prefix);
+    if (layers.upper != NULL) {
+        for (struct ramfs_node *node = layers.upper->first_child; node != NULL; node = node->next_sibling) {
+            if (node->whiteout)
+                continue;
 
-        if (*name_ptr == '/')
-            name_ptr++;
+            // directories are listed with a slash on the end
+            if (node->directory)
+                lua_pushfstring(L, "%s/", node->name);
+            else
+                lua_pushlstring(L, node->name, node->name_length);
 
-        if (strstr(name_ptr, path) != name_ptr)
-            continue;
+            lua_rawseti(L, -2, i ++);
+        }
+    }
 
-        name_ptr += len;
-        size_t name_len = strlen(name_ptr);
+    if (layers.lower != NULL) {
+        for (struct tar_entry *entry = layers.lower->first_child; entry != NULL; entry = entry->next_sibling) {
+            size_t length = entry->path + entry->path_length - entry->name;
 
-        const char *slash_pos = strchr(name_ptr, '/');
-        if (slash_pos != name_ptr + name_len - 1 && slash_pos != NULL)
-            continue; /* ignore anything in subdirectories */
+            if (layers.upper != NULL && ramfs_find_child(data->upper, layers.upper, entry->name, length) != NULL)
+                continue;
 
-        lua_pushnumber(L, i);
-        lua_pushstring(L, name_ptr);
-        lua_rawset(L, -3);
-    }
+            if (entry->kind == TAR_DIRECTORY)
+                lua_pushfstring(L, "%s/", entry->name);
+            else
+                lua_pushstring(L, entry->name);
 
-    if (should_free)
-        free(path);
+            lua_rawseti(L, -2, i ++);
+        }
+    }
 
     return 1;
 }
 
-void initrd_init(const char *name, const char *start, const char *end) {
+// adds a filesystem component for a tar archive, returns the archive's index so the kernel can find files in it too
+struct tar_index *initrd_init(const char *name, const char *start, const char *end) {
     struct initrd_data *data = malloc(sizeof(struct initrd_data));
     assert(data != NULL);
 
     data->name = name;
     data->start = start;
     data->end = end;
+    data->index = tar_index_build(start, end);
+    assert(data->index != NULL);
+
+    // initrdcache=<size> sets how much decompressed data from a packed initrd is kept around
+    data->index->cache_limit = cmdline_get_number("initrdcache", TAR_CACHE_DEFAULT);
+    data->open_files = HANDLE_TABLE_INIT;
+
+    size_t overlay_size = cmdline_get_number("overlaysize", INITRD_OVERLAY_DEFAULT);
+    data->upper = overlay_size != 0 ? ramfs_create(overlay_size) : NULL;
+
+    printf("indexed %d files and directories in %s\n", data->index->count, name);
 
     struct component *filesystem = new_component("filesystem", new_uuid(), data);
     add_method(filesystem, "spaceUsed", initrd_space_used);
     add_method(filesystem, "open", initrd_open);
     add_method(filesystem, "seek", initrd_seek);
-    add_method(filesystem, "makeDirectory", initrd_readonly);
+    add_method(filesystem, "makeDirectory", initrd_make_directory);
     add_method(filesystem, "exists", initrd_exists);
     add_method(filesystem, "isReadOnly", initrd_is_read_only);
-    add_method(filesystem, "write", initrd_readonly);
-    add_method(filesystem, "spaceTotal", initrd_space_used);
+    add_method(filesystem, "write", initrd_write);
+    add_method(filesystem, "spaceTotal", initrd_space_total);
     add_method(filesystem, "isDirectory", initrd_is_directory);
-    add_method(filesystem, "rename", initrd_readonly);
+    add_method(filesystem, "rename", initrd_rename);
     add_method(filesystem, "list", initrd_list);
     add_method(filesystem, "lastModified", initrd_last_modified);
     add_method(filesystem, "getLabel", initrd_get_label);
-    add_method(filesystem, "remove", initrd_readonly);
+    add_method(filesystem, "remove", initrd_remove);
     add_method(filesystem, "close", initrd_close);
     add_method(filesystem, "size", initrd_size);
     add_method(filesystem, "read", initrd_read);
+    add_method(filesystem, "readAll", initrd_read_all);
+    add_method(filesystem, "view", initrd_view);
+    add_method(filesystem, "loadfile", initrd_loadfile);
     add_method(filesystem, "setLabel", initrd_get_label);
     add_component(filesystem);
+
+    return data->index;
 }
@@ -1,3 +1,8 @@
 #pragma once
 
-void initrd_init(const char *name, const char *start, const char *end);
+#include "tar.h"
+
+/* how much can be written over the initrd if overlaysize isn't set */
+#define INITRD_OVERLAY_DEFAULT (4 * 1024 * 1024)
+
+struct tar_index *initrd_init(const char *name, const char *start, const char *end);
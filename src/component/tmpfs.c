@@ -0,0 +1,338 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "tmpfs.h"
+#include "api/component.h"
+#include "uuid.h"
+#include "ramfs.h"
+#include "handles.h"
+#include "cmdline.h"
+
+/*
+ * a writable filesystem in memory, which is what computer.tmpAddress() points at. everything in it is gone on reboot.
+ * how much it can hold is set with tmpsize=<size> on the command line, and counts what the files and directories
+ * themselves take up as well as their contents
+ */
+
+struct open_file {
+    struct ramfs_node *node;
+    struct ramfs_cursor cursor;
+    size_t position;
+    bool reading;
+    bool writing;
+    bool appending;
+};
+
+struct tmpfs_data {
+    struct ramfs *fs;
+    struct handle_table open_files;
+};
+
+static struct ramfs_node *check_node(lua_State *L, struct tmpfs_data *data, int index) {
+    struct ramfs_node *node = ramfs_lookup(data->fs, luaL_checkstring(L, index));
+
+    if (node == NULL)
+        luaL_error(L, "file not found");
+
+    return node;
+}
+
+static struct open_file *check_open_file(lua_State *L, struct tmpfs_data *data, int index) {
+    struct open_file *open_file = handle_find(&data->open_files, luaL_checkinteger(L, index));
+
+    if (open_file == NULL)
+        luaL_error(L, "invalid handle");
+
+    return open_file;
+}
+
+static int tmpfs_space_used(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    lua_pushnumber(L, data->fs->used);
+    return 1;
+}
+
+static int tmpfs_space_total(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    lua_pushnumber(L, data->fs->capacity);
+    return 1;
+}
+
+static int tmpfs_open(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+    const char *mode = lua_isstring(L, arguments_start + 1) ? lua_tostring(L, arguments_start + 1) : "r";
+
+    if (!*path || !*mode)
+        return luaL_error(L, "bad argument");
+
+    bool writing = strchr(mode, 'w') != NULL;
+    bool appending = strchr(mode, 'a') != NULL;
+    struct ramfs_node *node = ramfs_lookup(data->fs, path);
+
+    // opening for writing makes the file if it isn't there, but not the directory it's in
+    if (node == NULL && (writing || appending)) {
+        const char *name;
+        size_t length;
+        struct ramfs_node *parent = ramfs_lookup_parent(data->fs, path, &name, &length);
+
+        if (parent == NULL)
+            return luaL_error(L, "file not found");
+
+        node = ramfs_add(data->fs, parent, name, length, false);
+
+        if (node == NULL)
+            return luaL_error(L, "not enough space");
+    }
+
+    if (node == NULL || node->directory)
+        return luaL_error(L, "file not found");
+
+    struct open_file *open_file = malloc(sizeof(struct open_file));
+
+    if (open_file == NULL)
+        return luaL_error(L, "not enough memory");
+
+    lua_Integer handle = handle_new(&data->open_files, open_file);
+
+    if (handle < 0) {
+        free(open_file);
+        return luaL_error(L, "too many open files");
+    }
+
+    if (writing)
+        ramfs_truncate(data->fs, node);
+
+    ramfs_open(node);
+
+    open_file->node = node;
+    open_file->cursor = RAMFS_CURSOR_INIT;
+    open_file->position = appending ? node->size : 0;
+    open_file->reading = !writing && !appending;
+    open_file->writing = writing || appending;
+    open_file->appending = appending;
+
+    lua_pushinteger(L, handle);
+    return 1;
+}
+
+static int tmpfs_seek(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
+    const char *whence = luaL_checkstring(L, arguments_start + 1);
+    lua_Integer offset = luaL_checkinteger(L, arguments_start + 2);
+
+    lua_Integer position = open_file->position;
+
+    if (!strcmp(whence, "cur")) {
+        position += offset;
+    } else if (!strcmp(whence, "set")) {
+        position = offset;
+    } else if (!strcmp(whence, "end")) {
+        position = open_file->node->size + offset;
+    }
+
+    open_file->position = position < 0 ? 0 : position;
+
+    lua_pushnumber(L, open_file->position);
+    return 1;
+}
+
+static int tmpfs_make_directory(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+
+    if (ramfs_lookup(data->fs, path) != NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    lua_pushboolean(L, ramfs_make_directory(data->fs, path));
+    return 1;
+}
+
+static int tmpfs_exists(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    const char *path = luaL_checkstring(L, arguments_start);
+
+    lua_pushboolean(L, *path && ramfs_lookup(data->fs, path) != NULL);
+    return 1;
+}
+
+static int tmpfs_is_read_only(lua_State *L, void *data, int arguments_start) {
+    lua_pushboolean(L, false);
+    return 1;
+}
+
+static int tmpfs_write(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
+    size_t length;
+    const char *value = luaL_checklstring(L, arguments_start + 1, &length);
+
+    if (!open_file->writing)
+        return luaL_error(L, "file not open for writing");
+
+    if (open_file->appending)
+        open_file->position = open_file->node->size;
+
+    if (!ramfs_write(data->fs, open_file->node, &open_file->cursor, open_file->position, value, length))
+        return luaL_error(L, "not enough space");
+
+    open_file->position += length;
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int tmpfs_is_directory(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    lua_pushboolean(L, check_node(L, data, arguments_start)->directory);
+    return 1;
+}
+
+static int tmpfs_rename(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    struct ramfs_node *node = ramfs_lookup(data->fs, luaL_checkstring(L, arguments_start));
+    const char *to = luaL_checkstring(L, arguments_start + 1);
+
+    const char *name;
+    size_t length;
+    struct ramfs_node *parent = ramfs_lookup_parent(data->fs, to, &name, &length);
+
+    lua_pushboolean(L, node != NULL && parent != NULL && ramfs_move(data->fs, node, parent, name, length));
+    return 1;
+}
+
+static int tmpfs_list(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    struct ramfs_node *directory = ramfs_lookup(data->fs, luaL_checkstring(L, arguments_start));
+
+    if (directory == NULL || !directory->directory)
+        return luaL_error(L, "directory not found");
+
+    lua_createtable(L, directory->child_count, 0);
+
+    int i = 1;
+
+    for (struct ramfs_node *node = directory->first_child; node != NULL; node = node->next_sibling, i ++) {
+        // directories are listed with a slash on the end
+        if (node->directory)
+            lua_pushfstring(L, "%s/", node->name);
+        else
+            lua_pushlstring(L, node->name, node->name_length);
+
+        lua_rawseti(L, -2, i);
+    }
+
+    return 1;
+}
+
+static int tmpfs_last_modified(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    lua_pushnumber(L, check_node(L, data, arguments_start)->mtime);
+    return 1;
+}
+
+static int tmpfs_get_label(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    lua_pushstring(L, "tmpfs");
+    return 1;
+}
+
+static int tmpfs_remove(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    struct ramfs_node *node = ramfs_lookup(data->fs, luaL_checkstring(L, arguments_start));
+
+    if (node == NULL || node == &data->fs->root) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    ramfs_remove(data->fs, node);
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int tmpfs_close(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    lua_Integer handle = luaL_checkinteger(L, arguments_start);
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
+
+    ramfs_close(data->fs, open_file->node);
+    handle_free(&data->open_files, handle);
+    free(open_file);
+
+    return 0;
+}
+
+static int tmpfs_size(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    struct ramfs_node *node = check_node(L, data, arguments_start);
+
+    lua_pushnumber(L, node->directory ? 0 : node->size);
+    return 1;
+}
+
+/*
+ * reads up to the requested amount, or the rest of the file for math.huge. what's in a single extent is pushed
+ * straight from it, and anything spanning several is gathered into one buffer
+ */
+static int tmpfs_read(lua_State *L, struct tmpfs_data *data, int arguments_start) {
+    struct open_file *open_file = check_open_file(L, data, arguments_start);
+    lua_Number requested = luaL_checknumber(L, arguments_start + 1);
+    struct ramfs_node *node = open_file->node;
+
+    if (!open_file->reading)
+        return luaL_error(L, "file not open for reading");
+
+    if (open_file->position >= node->size) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size_t remaining = node->size - open_file->position;
+    size_t count = requested >= remaining ? remaining : requested > 0 ? (size_t) requested : 0;
+
+    size_t length;
+    const char *span = ramfs_span(node, &open_file->cursor, open_file->position, &length);
+
+    if (length >= count) {
+        lua_pushlstring(L, span, count);
+    } else {
+        luaL_Buffer buffer;
+        char *out = luaL_buffinitsize(L, &buffer, count);
+
+        // the buffer can raise an error, so the file is only read from once it's been made
+        ramfs_read(node, &open_file->cursor, open_file->position, out, count);
+        luaL_pushresultsize(&buffer, count);
+    }
+
+    open_file->position += count;
+    return 1;
+}
+
+// adds the tmpfs component, returns its address
+const char *tmpfs_init(void) {
+    struct tmpfs_data *data = malloc(sizeof(struct tmpfs_data));
+    assert(data != NULL);
+
+    data->fs = ramfs_create(cmdline_get_number("tmpsize", TMPFS_DEFAULT_SIZE));
+    assert(data->fs != NULL);
+    data->open_files = HANDLE_TABLE_INIT;
+
+    struct component *filesystem = new_component("filesystem", new_uuid(), data);
+    add_method(filesystem, "spaceUsed", tmpfs_space_used);
+    add_method(filesystem, "open", tmpfs_open);
+    add_method(filesystem, "seek", tmpfs_seek);
+    add_method(filesystem, "makeDirectory", tmpfs_make_directory);
+    add_method(filesystem, "exists", tmpfs_exists);
+    add_method(filesystem, "isReadOnly", tmpfs_is_read_only);
+    add_method(filesystem, "write", tmpfs_write);
+    add_method(filesystem, "spaceTotal", tmpfs_space_total);
+    add_method(filesystem, "isDirectory", tmpfs_is_directory);
+    add_method(filesystem, "rename", tmpfs_rename);
+    add_method(filesystem, "list", tmpfs_list);
+    add_method(filesystem, "lastModified", tmpfs_last_modified);
+    add_method(filesystem, "getLabel", tmpfs_get_label);
+    add_method(filesystem, "remove", tmpfs_remove);
+    add_method(filesystem, "close", tmpfs_close);
+    add_method(filesystem, "size", tmpfs_size);
+    add_method(filesystem, "read", tmpfs_read);
+    add_method(filesystem, "setLabel", tmpfs_get_label);
+    add_component(filesystem);
+
+    return filesystem->address;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+/* how much the tmpfs can hold if tmpsize isn't set */
+#define TMPFS_DEFAULT_SIZE (16 * 1024 * 1024)
+
+const char *tmpfs_init(void);
@@ -2,8 +2,9 @@
 #include "vgatext.h"
 #include "gpu.h"
 #include "io.h"
-#include <malloc.h>
+#include <stdlib.h>
 #include "multiboot.h"
+#include "paging.h"
 
 struct vga_character {
     // bool wide;
@@ -176,6 +177,7 @@ struct gpu *vgagraphics_init(void) {
     vga_char_height = mboot_ptr->framebuffer_height >> 4;
     vga_depth = mboot_ptr->framebuffer_bpp;
     vga_framebuffer = mboot_ptr->framebuffer_addr;
+    map_write_combining(vga_framebuffer, mboot_ptr->framebuffer_pitch * vga_height);
     *vgagraphics_gpu = (struct gpu){
         .width = vga_char_width,
         .height = vga_char_height,
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* CPU feature detection and model specific instructions */
+
+#define CPUID_FEAT_EDX_PSE (1 << 3)
+#define CPUID_FEAT_EDX_TSC (1 << 4)
+#define CPUID_FEAT_EDX_MSR (1 << 5)
+#define CPUID_FEAT_EDX_APIC (1 << 9)
+#define CPUID_FEAT_EDX_MTRR (1 << 12)
+#define CPUID_FEAT_EDX_PGE (1 << 13)
+#define CPUID_FEAT_EDX_PAT (1 << 16)
+
+// the cpuid instruction exists if the ID bit in eflags can be toggled, which isn't the case on most 486s
+static inline bool has_cpuid(void) {
+    uint32_t before, after;
+
+    __asm__ __volatile__ (
+        "pushf\n"
+        "pop %0\n"
+        "mov %0, %1\n"
+        "xor $0x200000, %1\n"
+        "push %1\n"
+        "popf\n"
+        "pushf\n"
+        "pop %1\n"
+        "push %0\n"
+        "popf"
+        : "=&r" (before), "=&r" (after)
+    );
+
+    return (before ^ after) & 0x200000;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ __volatile__ (
+        "cpuid"
+        : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+        : "a" (leaf), "c" (0)
+    );
+}
+
+// returns the feature flags in edx of cpuid leaf 1, or 0 if cpuid isn't supported
+static inline uint32_t cpu_features(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    if (!has_cpuid())
+        return 0;
+
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1)
+        return 0;
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return edx;
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+
+    __asm__ __volatile__ (
+        "rdtsc"
+        : "=a" (low), "=d" (high)
+    );
+
+    return ((uint64_t) high << 32) | low;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+
+    __asm__ __volatile__ (
+        "rdmsr"
+        : "=a" (low), "=d" (high)
+        : "c" (msr)
+    );
+
+    return ((uint64_t) high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ __volatile__ (
+        "wrmsr"
+        :
+        : "c" (msr), "a" ((uint32_t) value), "d" ((uint32_t) (value >> 32))
+    );
+}
@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include "cpustat.h"
+#include "clock.h"
+#include "timer.h"
+#include "io.h"
+
+/*
+ * accounts for the time spent running Lua and the kernel on its behalf (busy), halted waiting for a signal (idle)
+ * and handling interrupts. load averages are exponentially decaying averages of the fraction of time that wasn't
+ * idle, sampled every 5 seconds in the same way unix samples its run queue
+ */
+
+#define LOAD_INTERVAL (5 * TIMER_HZ)
+
+// exp(-5 / 60), exp(-5 / 300) and exp(-5 / 900) in fixed point
+static const uint32_t load_decay[3] = { 1884, 2014, 2037 };
+
+static int current_state = CPU_BUSY;
+static uint64_t state_since = 0;
+static uint64_t state_totals[CPU_STATES];
+
+static uint32_t loads[3];
+static uint64_t last_sample_busy = 0;
+static uint64_t last_sample_time = 0;
+static struct timer load_timer;
+
+// must be called with interrupts disabled
+static uint64_t time_in(int state, uint64_t now) {
+    uint64_t total = state_totals[state];
+
+    if (state == current_state)
+        total += now - state_since;
+
+    return total;
+}
+
+// switches which state time is accounted to, returns the previous state so it can be restored
+int cpustat_enter(int state) {
+    uint32_t flags = irq_save();
+    uint64_t now = clock_ns();
+
+    state_totals[current_state] += now - state_since;
+    state_since = now;
+
+    int previous = current_state;
+    current_state = state;
+
+    irq_restore(flags);
+    return previous;
+}
+
+// returns the total number of nanoseconds spent in the given state
+uint64_t cpustat_time(int state) {
+    uint32_t flags = irq_save();
+    uint64_t total = time_in(state, clock_ns());
+    irq_restore(flags);
+
+    return total;
+}
+
+// gets the 1, 5 and 15 minute load averages
+void cpustat_load(uint32_t out[3]) {
+    uint32_t flags = irq_save();
+
+    for (int i = 0; i < 3; i++)
+        out[i] = loads[i];
+
+    irq_restore(flags);
+}
+
+static void sample_load(struct timer *timer) {
+    uint64_t now = clock_ns();
+    uint64_t busy = time_in(CPU_BUSY, now) + time_in(CPU_IRQ, now);
+
+    uint64_t elapsed = now - last_sample_time;
+    uint32_t load = elapsed == 0 ? 0 : (uint32_t) (((busy - last_sample_busy) << LOAD_SHIFT) / elapsed);
+    if (load > LOAD_ONE)
+        load = LOAD_ONE;
+
+    for (int i = 0; i < 3; i++)
+        loads[i] = (loads[i] * load_decay[i] + load * (LOAD_ONE - load_decay[i])) >> LOAD_SHIFT;
+
+    last_sample_busy = busy;
+    last_sample_time = now;
+
+    timer->expires += LOAD_INTERVAL;
+    timer_add(timer);
+}
+
+void cpustat_init(void) {
+    uint32_t flags = irq_save();
+
+    last_sample_time = clock_ns();
+    last_sample_busy = time_in(CPU_BUSY, last_sample_time) + time_in(CPU_IRQ, last_sample_time);
+
+    load_timer = (struct timer) {
+        .expires = get_jiffies() + LOAD_INTERVAL,
+        .callback = sample_load
+    };
+    timer_add(&load_timer);
+
+    irq_restore(flags);
+}
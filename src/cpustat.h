@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+/* what the CPU is currently spending its time on */
+#define CPU_BUSY 0
+#define CPU_IDLE 1
+#define CPU_IRQ 2
+#define CPU_STATES 3
+
+/* load averages are fixed point numbers with this many fractional bits */
+#define LOAD_SHIFT 11
+#define LOAD_ONE (1 << LOAD_SHIFT)
+
+void cpustat_init(void);
+int cpustat_enter(int state);
+uint64_t cpustat_time(int state);
+void cpustat_load(uint32_t loads[3]);
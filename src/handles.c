@@ -0,0 +1,69 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <lua.h>
+#include "handles.h"
+
+/*
+ * tables of handles for components to give out to Lua, like open files. the slots are an array that grows as needed
+ * with the free ones threaded into a list, so making, finding and freeing a handle are all constant time
+ */
+
+// gives out a handle for something that isn't NULL, returns -1 if there are too many or there's no memory for more
+lua_Integer handle_new(struct handle_table *table, void *value) {
+    if (table->first_free < 0) {
+        int new_count = table->slot_count == 0 ? 16 : table->slot_count * 2;
+
+        if (new_count > MAX_HANDLES)
+            return -1;
+
+        struct handle_slot *slots = realloc(table->slots, new_count * sizeof(struct handle_slot));
+
+        if (slots == NULL)
+            return -1;
+
+        for (int i = table->slot_count; i < new_count; i ++)
+            slots[i] = (struct handle_slot) {
+                .value = NULL,
+                .generation = 0,
+                .next_free = i + 1 < new_count ? i + 1 : -1
+            };
+
+        table->slots = slots;
+        table->first_free = table->slot_count;
+        table->slot_count = new_count;
+    }
+
+    int slot = table->first_free;
+    struct handle_slot *handle_slot = &table->slots[slot];
+
+    table->first_free = handle_slot->next_free;
+    handle_slot->value = value;
+
+    return ((lua_Integer) handle_slot->generation << HANDLE_SLOT_BITS) | slot;
+}
+
+// returns what a handle refers to, or NULL if it isn't valid (any more)
+void *handle_find(struct handle_table *table, lua_Integer handle) {
+    lua_Integer slot = handle & HANDLE_SLOT_MASK;
+
+    if (handle < 0 || slot >= table->slot_count)
+        return NULL;
+
+    struct handle_slot *handle_slot = &table->slots[slot];
+
+    if (handle_slot->value == NULL || handle_slot->generation != handle >> HANDLE_SLOT_BITS)
+        return NULL;
+
+    return handle_slot->value;
+}
+
+// puts a valid handle's slot back on the free list, which invalidates the handle
+void handle_free(struct handle_table *table, lua_Integer handle) {
+    int slot = handle & HANDLE_SLOT_MASK;
+    struct handle_slot *handle_slot = &table->slots[slot];
+
+    handle_slot->value = NULL;
+    handle_slot->generation = (handle_slot->generation + 1) & HANDLE_GENERATION_MASK;
+    handle_slot->next_free = table->first_free;
+    table->first_free = slot;
+}
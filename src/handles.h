@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <lua.h>
+
+/*
+ * a handle is a slot number in its low bits and that slot's generation above them, and the generation goes up every
+ * time the slot is freed, so a stale handle stays invalid even once its slot has been reused. handles are kept below
+ * 2^31 so they're happy as plain ints in Lua
+ */
+#define HANDLE_SLOT_BITS 16
+#define HANDLE_SLOT_MASK ((1 << HANDLE_SLOT_BITS) - 1)
+#define HANDLE_GENERATION_MASK 0x7fff
+#define MAX_HANDLES (1 << HANDLE_SLOT_BITS)
+
+struct handle_slot {
+    // what the handle refers to, NULL while the slot is free
+    void *value;
+    uint32_t generation;
+
+    // the next free slot, while this one is free
+    int next_free;
+};
+
+struct handle_table {
+    struct handle_slot *slots;
+    int slot_count;
+    int first_free;
+};
+
+#define HANDLE_TABLE_INIT ((struct handle_table) {.slots = NULL, .slot_count = 0, .first_free = -1})
+
+lua_Integer handle_new(struct handle_table *table, void *value);
+void *handle_find(struct handle_table *table, lua_Integer handle);
+void handle_free(struct handle_table *table, lua_Integer handle);
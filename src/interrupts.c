@@ -5,6 +5,9 @@
 #include "interrupts.h"
 #include "io.h"
 #include "rtc.h"
+#include "clock.h"
+#include "cpustat.h"
+#include "clockevent.h"
 #include "ps2.h"
 
 /* http://www.jamesmolloy.co.uk/tutorial_html/4.-The%20GDT%20and%20IDT.html */
@@ -76,9 +79,16 @@ extern void isr44();
 extern void isr45();
 extern void isr46();
 extern void isr47();
+extern void isr48();
+extern void isr63();
 
 #define IDT_ENTRIES 256
 
+static struct idt_entry *idt = NULL;
+
+// how many interrupt handlers are currently running
+volatile int interrupt_depth = 0;
+
 /* http://www.jamesmolloy.co.uk/tutorial_html/4.-The%20GDT%20and%20IDT.html */
 static void make_idt_entry(struct idt_entry *entry, uint32_t base, uint16_t sel, uint8_t flags) {
     entry->base_lo = base & 0xFFFF;
@@ -110,7 +120,7 @@ void init_idt() {
     outb(0x21, 0x0);
     outb(0xa1, 0x0);
 
-    struct idt_entry *idt = malloc(sizeof(struct idt_entry) * IDT_ENTRIES);
+    idt = malloc(sizeof(struct idt_entry) * IDT_ENTRIES);
 
     if (idt == NULL) {
         printf("couldn't allocate memory!");
@@ -169,6 +179,8 @@ void init_idt() {
     make_idt_entry(&idt[45], (uint32_t) isr45, 0x08, 0x8e);
     make_idt_entry(&idt[46], (uint32_t) isr46, 0x08, 0x8e);
     make_idt_entry(&idt[47], (uint32_t) isr47, 0x08, 0x8e);
+    make_idt_entry(&idt[48], (uint32_t) isr48, 0x08, 0x8e); // local APIC timer
+    make_idt_entry(&idt[63], (uint32_t) isr63, 0x08, 0x8e); // local APIC spurious interrupt
 
     struct idt_ptr idt_ptr = {
         .limit = sizeof(struct idt_entry) * IDT_ENTRIES - 1,
@@ -182,6 +194,11 @@ void init_idt() {
     );
 }
 
+// has an interrupt switch to the task with the given TSS selector instead of running a handler on the current stack
+void set_task_gate(int vector, uint16_t selector) {
+    make_idt_entry(&idt[vector], 0, selector, 0x85);
+}
+
 /* https://wiki.osdev.org/Exceptions */
 const char *interrupt_names[32] = {
     "division error",
@@ -226,13 +243,19 @@ const char *get_exception_name(uint32_t exception) {
 }
 
 void isr_handler(struct int_registers registers) {
+    int previous_state = cpustat_enter(CPU_IRQ);
+    interrupt_depth ++;
+
     switch (registers.int_no) {
         case 3:
             printf("caught breakpoint interrupt!\n");
             break;
+        case 32:
+            pit_interrupt();
+            outb(0x20, 0x20);
+            break;
         case 33:
             ps2_interrupt();
-        case 32:
         case 34:
         case 35:
         case 36:
@@ -253,6 +276,11 @@ void isr_handler(struct int_registers registers) {
             outb(0xa0, 0x20); // reset secondary interrupt controller
             outb(0x20, 0x20);
             break;
+        case 48:
+            lapic_timer_interrupt();
+            break;
+        case 63:
+            break; // spurious interrupts from the local APIC mustn't be acknowledged
         default:
             printf("fatal exception %d (%s) at %08x, error code %08x\n", registers.int_no, get_exception_name(registers.int_no), registers.eip, registers.err_code);
             printf("eax = %08x, ebx = %08x, ecx = %08x, edx = %08x\n", registers.eax, registers.ebx, registers.ecx, registers.edx);
@@ -263,4 +291,7 @@ void isr_handler(struct int_registers registers) {
             while (1)
                 __asm__ __volatile__ ("cli; hlt");
     }
+
+    interrupt_depth --;
+    cpustat_enter(previous_state);
 }
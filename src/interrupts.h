@@ -1,3 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+
 void init_idt();
+void set_task_gate(int vector, uint16_t selector);
+
+extern volatile int interrupt_depth;
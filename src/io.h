@@ -21,3 +21,63 @@ static inline void outb(uint16_t addr, uint8_t value) {
         : "dN" (addr), "a" (value)
     );
 }
+
+static inline uint16_t inw(uint16_t addr) {
+    uint16_t result;
+
+    __asm__ __volatile__ (
+        "inw %1, %0"
+        : "=a" (result)
+        : "dN" (addr)
+    );
+
+    return result;
+}
+
+static inline void outw(uint16_t addr, uint16_t value) {
+    __asm__ __volatile__ (
+        "outw %1, %0"
+        :
+        : "dN" (addr), "a" (value)
+    );
+}
+
+/* reads or writes a run of 16-bit words through the same port, for data registers */
+
+static inline void insw(uint16_t addr, void *buffer, uint32_t count) {
+    __asm__ __volatile__ (
+        "rep insw"
+        : "+D" (buffer), "+c" (count)
+        : "d" (addr)
+        : "memory"
+    );
+}
+
+static inline void outsw(uint16_t addr, const void *buffer, uint32_t count) {
+    __asm__ __volatile__ (
+        "rep outsw"
+        : "+S" (buffer), "+c" (count)
+        : "d" (addr)
+        : "memory"
+    );
+}
+
+/* interrupt flag helpers, for code that can be called both with and without interrupts enabled */
+
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+
+    __asm__ __volatile__ (
+        "pushf; pop %0; cli"
+        : "=r" (flags)
+        :
+        : "memory"
+    );
+
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & (1 << 9))
+        __asm__ __volatile__ ("sti" : : : "memory");
+}
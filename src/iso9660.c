@@ -0,0 +1,625 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "iso9660.h"
+#include "atapi.h"
+#include "ramfs.h"
+
+/*
+ * a read-only ISO9660 filesystem, read off the disc as it's used rather than all at once. directories are read the
+ * first time something in them is looked up, and stay in memory after that. sectors go through a cache that holds
+ * cdcache=<size> bytes of the disc, and a miss reads ahead through the rest of the file it's in, since files are
+ * nearly always read from start to end.
+ *
+ * names come from Rock Ridge entries when the disc has them (grub-mkrescue makes discs that do), which keeps them
+ * exactly as they were. otherwise the ISO9660 names are used, without their version numbers and in lower case, which
+ * is as close as they get to what they were
+ */
+
+// where things are in a directory record
+#define RECORD_LENGTH 0
+#define RECORD_ATTRIBUTES_LENGTH 1
+#define RECORD_EXTENT 2
+#define RECORD_SIZE 10
+#define RECORD_DATE 18
+#define RECORD_FLAGS 25
+#define RECORD_NAME_LENGTH 32
+#define RECORD_NAME 33
+
+#define RECORD_FLAG_DIRECTORY (1 << 1)
+#define RECORD_FLAG_ASSOCIATED (1 << 2)
+
+// and in the primary volume descriptor
+#define DESCRIPTOR_FIRST 16
+#define DESCRIPTOR_PRIMARY 1
+#define DESCRIPTOR_TERMINATOR 255
+#define DESCRIPTOR_LABEL 40
+#define DESCRIPTOR_SECTOR_SIZE 128
+#define DESCRIPTOR_ROOT 156
+
+// flags on a Rock Ridge NM entry, for parts of names that carry on in the next one and names for . and ..
+#define NM_CONTINUE (1 << 0)
+#define NM_CURRENT (1 << 1)
+#define NM_PARENT (1 << 2)
+
+// the longest name that's kept, which is as long as names get anywhere else
+#define NAME_LENGTH_MAX 255
+
+// how many continuation areas a record's system use entries are followed through
+#define CONTINUATIONS_MAX 8
+
+#define NO_SECTOR UINT32_MAX
+
+static uint16_t le16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return (uint32_t) p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint32_t sectors_in(uint32_t size) {
+    return (size + ATAPI_SECTOR_SIZE - 1) / ATAPI_SECTOR_SIZE;
+}
+
+static size_t sector_bucket(struct iso9660_volume *volume, uint32_t lba) {
+    return (lba * 2654435761u) % volume->cache_count;
+}
+
+static struct iso9660_sector *find_sector(struct iso9660_volume *volume, uint32_t lba) {
+    for (struct iso9660_sector *sector = volume->sector_buckets[sector_bucket(volume, lba)]; sector != NULL; sector = sector->hash_next)
+        if (sector->lba == lba)
+            return sector;
+
+    return NULL;
+}
+
+static void lru_remove(struct iso9660_volume *volume, struct iso9660_sector *sector) {
+    if (sector->lru_prev != NULL)
+        sector->lru_prev->lru_next = sector->lru_next;
+    else
+        volume->lru_first = sector->lru_next;
+
+    if (sector->lru_next != NULL)
+        sector->lru_next->lru_prev = sector->lru_prev;
+    else
+        volume->lru_last = sector->lru_prev;
+}
+
+static void lru_append(struct iso9660_volume *volume, struct iso9660_sector *sector) {
+    sector->lru_prev = volume->lru_last;
+    sector->lru_next = NULL;
+
+    if (volume->lru_last != NULL)
+        volume->lru_last->lru_next = sector;
+    else
+        volume->lru_first = sector;
+
+    volume->lru_last = sector;
+}
+
+// takes the least recently used sector out of the cache so it can be used for another one
+static struct iso9660_sector *evict_sector(struct iso9660_volume *volume) {
+    struct iso9660_sector *sector = volume->lru_first;
+
+    if (sector->lba != NO_SECTOR) {
+        struct iso9660_sector **link = &volume->sector_buckets[sector_bucket(volume, sector->lba)];
+
+        while (*link != sector)
+            link = &(*link)->hash_next;
+
+        *link = sector->hash_next;
+        sector->lba = NO_SECTOR;
+    }
+
+    return sector;
+}
+
+/*
+ * returns a sector of the disc out of the cache, reading it in first if it isn't there. anything after it up to
+ * limit that isn't cached either is read along with it. the data is only good until the cache is next used
+ */
+static const char *get_sector(struct iso9660_volume *volume, uint32_t lba, uint32_t limit) {
+    struct iso9660_sector *sector = find_sector(volume, lba);
+
+    if (sector != NULL) {
+        lru_remove(volume, sector);
+        lru_append(volume, sector);
+        return sector->data;
+    }
+
+    if (limit > volume->sector_count)
+        limit = volume->sector_count;
+
+    uint32_t count = 1;
+
+    while (count < ISO9660_READAHEAD && lba + count < limit && find_sector(volume, lba + count) == NULL)
+        count ++;
+
+    if (!atapi_read(volume->drive, lba, count, volume->readahead))
+        return NULL;
+
+    const char *wanted = NULL;
+
+    for (uint32_t i = 0; i < count; i ++) {
+        sector = evict_sector(volume);
+        lru_remove(volume, sector);
+
+        sector->lba = lba + i;
+        memcpy(sector->data, volume->readahead + i * ATAPI_SECTOR_SIZE, ATAPI_SECTOR_SIZE);
+
+        size_t bucket = sector_bucket(volume, sector->lba);
+        sector->hash_next = volume->sector_buckets[bucket];
+        volume->sector_buckets[bucket] = sector;
+        lru_append(volume, sector);
+
+        if (i == 0)
+            wanted = sector->data;
+    }
+
+    return wanted;
+}
+
+static uint32_t hash_name(struct iso9660_entry *parent, const char *name, size_t length) {
+    uint32_t hash = 2166136261u ^ (uint32_t) (uintptr_t) parent;
+
+    for (size_t i = 0; i < length; i ++)
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+
+    return hash;
+}
+
+static struct iso9660_entry *find_child(struct iso9660_volume *volume, struct iso9660_entry *parent, const char *name, size_t length) {
+    uint32_t hash = hash_name(parent, name, length);
+
+    for (struct iso9660_entry *entry = volume->buckets[hash & (volume->bucket_count - 1)]; entry != NULL; entry = entry->hash_next)
+        if (entry->hash == hash && entry->parent == parent && entry->name_length == length && !memcmp(entry->name, name, length))
+            return entry;
+
+    return NULL;
+}
+
+// doubles the number of hash buckets once there are more entries than buckets
+static void grow_buckets(struct iso9660_volume *volume) {
+    size_t bucket_count = volume->bucket_count * 2;
+    struct iso9660_entry **buckets = calloc(bucket_count, sizeof(struct iso9660_entry *));
+
+    // a full table is only slower, not wrong
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < volume->bucket_count; i ++) {
+        struct iso9660_entry *entry = volume->buckets[i];
+
+        while (entry != NULL) {
+            struct iso9660_entry *next = entry->hash_next;
+            entry->hash_next = buckets[entry->hash & (bucket_count - 1)];
+            buckets[entry->hash & (bucket_count - 1)] = entry;
+            entry = next;
+        }
+    }
+
+    free(volume->buckets);
+    volume->buckets = buckets;
+    volume->bucket_count = bucket_count;
+}
+
+static struct iso9660_entry *add_entry(struct iso9660_volume *volume, struct iso9660_entry *parent, const char *name, size_t length) {
+    struct iso9660_entry *entry = malloc(sizeof(struct iso9660_entry) + length + 1);
+
+    if (entry == NULL)
+        return NULL;
+
+    if (volume->entry_count >= volume->bucket_count)
+        grow_buckets(volume);
+
+    entry->name = (char *) (entry + 1);
+    memcpy(entry->name, name, length);
+    entry->name[length] = 0;
+    entry->name_length = length;
+
+    entry->parent = parent;
+    entry->first_child = NULL;
+    entry->last_child = NULL;
+    entry->next_sibling = NULL;
+    entry->child_count = 0;
+    entry->loaded = false;
+
+    if (parent->last_child != NULL)
+        parent->last_child->next_sibling = entry;
+    else
+        parent->first_child = entry;
+
+    parent->last_child = entry;
+    parent->child_count ++;
+
+    entry->hash = hash_name(parent, name, length);
+    entry->hash_next = volume->buckets[entry->hash & (volume->bucket_count - 1)];
+    volume->buckets[entry->hash & (volume->bucket_count - 1)] = entry;
+    volume->entry_count ++;
+
+    return entry;
+}
+
+// recording dates are years since 1900 to seconds, then the time zone in quarter hours east of GMT
+static uint32_t record_mtime(const uint8_t *date) {
+    if (date[1] < 1 || date[1] > 12)
+        return 0;
+
+    struct tm time = {
+        .tm_year = date[0],
+        .tm_mon = date[1] - 1,
+        .tm_mday = date[2],
+        .tm_hour = date[3],
+        .tm_min = date[4],
+        .tm_sec = date[5]
+    };
+
+    return mktime(&time) - (int8_t) date[6] * 15 * 60;
+}
+
+// what a record's Rock Ridge entries say about it
+struct rock_ridge {
+    char name[NAME_LENGTH_MAX];
+    size_t name_length;
+    bool has_name;
+    bool name_too_long;
+
+    // a directory that's been moved to keep the directory tree shallow is a placeholder file where it really is,
+    // and the directory itself is marked as relocated where it was moved to
+    bool relocated;
+    bool has_child_link;
+    uint32_t child_link;
+};
+
+// reads the system use entries in a record, following them on into continuation areas
+static void read_rock_ridge(struct iso9660_volume *volume, const uint8_t *area, size_t length, struct rock_ridge *info) {
+    for (int i = 0; i < CONTINUATIONS_MAX && area != NULL; i ++) {
+        bool has_continuation = false;
+        uint32_t continuation_lba = 0, continuation_offset = 0, continuation_length = 0;
+
+        while (length >= 4) {
+            const uint8_t *entry = area;
+            size_t entry_length = entry[2];
+
+            if (entry_length < 4 || entry_length > length)
+                break;
+
+            area += entry_length;
+            length -= entry_length;
+
+            if (entry[0] == 'N' && entry[1] == 'M' && entry_length >= 5 && !(entry[4] & (NM_CURRENT | NM_PARENT))) {
+                size_t part = entry_length - 5;
+
+                if (info->name_length + part > NAME_LENGTH_MAX) {
+                    info->name_too_long = true;
+                } else {
+                    memcpy(info->name + info->name_length, entry + 5, part);
+                    info->name_length += part;
+                }
+
+                info->has_name = true;
+            } else if (entry[0] == 'C' && entry[1] == 'E' && entry_length >= 28) {
+                has_continuation = true;
+                continuation_lba = le32(entry + 4);
+                continuation_offset = le32(entry + 12);
+                continuation_length = le32(entry + 20);
+            } else if (entry[0] == 'R' && entry[1] == 'E') {
+                info->relocated = true;
+            } else if (entry[0] == 'C' && entry[1] == 'L' && entry_length >= 12) {
+                info->has_child_link = true;
+                info->child_link = le32(entry + 4);
+            } else if (entry[0] == 'S' && entry[1] == 'T') {
+                break;
+            }
+        }
+
+        area = NULL;
+
+        if (has_continuation && continuation_offset < ATAPI_SECTOR_SIZE && continuation_length <= ATAPI_SECTOR_SIZE - continuation_offset) {
+            const char *sector = get_sector(volume, continuation_lba, continuation_lba + 1);
+
+            if (sector != NULL) {
+                area = (const uint8_t *) sector + continuation_offset;
+                length = continuation_length;
+            }
+        }
+    }
+}
+
+// where the system use area starts in a record, past the name and the byte that pads it to an even length
+static size_t system_use_start(struct iso9660_volume *volume, const uint8_t *record) {
+    size_t name_length = record[RECORD_NAME_LENGTH];
+    return RECORD_NAME + name_length + (name_length % 2 == 0 ? 1 : 0) + volume->susp_skip;
+}
+
+// the name of a record on a disc without Rock Ridge: "FOO.TXT;1" is foo.txt, and "BAR.;1" is bar
+static size_t plain_name(const uint8_t *record, char *name) {
+    size_t length = 0;
+
+    for (size_t i = 0; i < record[RECORD_NAME_LENGTH] && record[RECORD_NAME + i] != ';'; i ++) {
+        char c = record[RECORD_NAME + i];
+        name[length ++] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    if (length > 0 && name[length - 1] == '.')
+        length --;
+
+    return length;
+}
+
+// adds what a directory record describes to a directory, unless it's something that shouldn't be seen
+static bool add_record(struct iso9660_volume *volume, struct iso9660_entry *directory, const uint8_t *record) {
+    size_t record_length = record[RECORD_LENGTH];
+    size_t name_length = record[RECORD_NAME_LENGTH];
+
+    // every directory starts with records for itself and its parent, named 0 and 1
+    if (name_length == 1 && record[RECORD_NAME] <= 1)
+        return true;
+
+    if (record[RECORD_FLAGS] & RECORD_FLAG_ASSOCIATED)
+        return true;
+
+    struct rock_ridge info = {.name_length = 0, .has_name = false, .name_too_long = false, .relocated = false, .has_child_link = false};
+
+    if (volume->rock_ridge) {
+        size_t start = system_use_start(volume, record);
+
+        if (start < record_length)
+            read_rock_ridge(volume, record + start, record_length - start, &info);
+    }
+
+    if (info.relocated || info.name_too_long)
+        return true;
+
+    char *name = info.name;
+    size_t length = info.has_name ? info.name_length : plain_name(record, info.name);
+
+    // files bigger than 4 GiB are in several records with the same name, only the first part of them can be read
+    if (length == 0 || find_child(volume, directory, name, length) != NULL)
+        return true;
+
+    struct iso9660_entry *entry = add_entry(volume, directory, name, length);
+
+    if (entry == NULL)
+        return false;
+
+    entry->directory = (record[RECORD_FLAGS] & RECORD_FLAG_DIRECTORY) || info.has_child_link;
+    entry->mtime = record_mtime(record + RECORD_DATE);
+
+    if (info.has_child_link) {
+        entry->extent = info.child_link;
+        entry->size = 0;
+    } else {
+        entry->extent = le32(record + RECORD_EXTENT) + record[RECORD_ATTRIBUTES_LENGTH];
+        entry->size = le32(record + RECORD_SIZE);
+    }
+
+    return true;
+}
+
+// reads in what's in a directory, if it hasn't been already. returns false if the disc can't be read
+bool iso9660_load_directory(struct iso9660_volume *volume, struct iso9660_entry *directory) {
+    if (directory->loaded)
+        return true;
+
+    // a relocated directory's size is in its own record for itself, which comes first
+    if (directory->size == 0) {
+        const char *sector = get_sector(volume, directory->extent, directory->extent + 1);
+
+        if (sector == NULL)
+            return false;
+
+        directory->size = le32((const uint8_t *) sector + RECORD_SIZE);
+    }
+
+    uint32_t end = directory->extent + sectors_in(directory->size);
+
+    for (uint32_t lba = directory->extent; lba < end; lba ++) {
+        const char *sector = get_sector(volume, lba, end);
+
+        if (sector == NULL)
+            return false;
+
+        // following continuation areas can push this sector out of the cache, so the records are read from a copy
+        memcpy(volume->scratch, sector, ATAPI_SECTOR_SIZE);
+
+        const uint8_t *records = (const uint8_t *) volume->scratch;
+        size_t offset = 0;
+
+        // records never cross into the next sector, what's left at the end of one is zeros
+        while (offset + RECORD_NAME <= ATAPI_SECTOR_SIZE && records[offset + RECORD_LENGTH] != 0) {
+            const uint8_t *record = records + offset;
+            size_t record_length = record[RECORD_LENGTH];
+
+            if (offset + record_length > ATAPI_SECTOR_SIZE || record_length < RECORD_NAME + record[RECORD_NAME_LENGTH])
+                break;
+
+            if (!add_record(volume, directory, record))
+                return false;
+
+            offset += record_length;
+        }
+    }
+
+    directory->loaded = true;
+    return true;
+}
+
+/*
+ * finds the file or directory at a path, reading in the directories on the way to it as needed. returns NULL if
+ * there isn't one, or if it can't be found without reading the disc and the disc can't be read
+ */
+struct iso9660_entry *iso9660_lookup(struct iso9660_volume *volume, const char *path) {
+    struct iso9660_entry *entry = &volume->root;
+    const char *name;
+    size_t length;
+
+    while (entry != NULL && (name = ramfs_next_component(&path, &length)) != NULL) {
+        if (length == 2 && name[0] == '.' && name[1] == '.') {
+            if (entry->parent != NULL)
+                entry = entry->parent;
+        } else if (!entry->directory || !iso9660_load_directory(volume, entry))
+            entry = NULL;
+        else
+            entry = find_child(volume, entry, name, length);
+    }
+
+    return entry;
+}
+
+/*
+ * returns as much of a file as there is in one sector from a position in it, without copying it out of the cache.
+ * it's only good until the cache is next used. returns NULL at the end of the file, or if the disc can't be read
+ */
+const char *iso9660_span(struct iso9660_volume *volume, struct iso9660_entry *entry, size_t position, size_t *length) {
+    *length = 0;
+
+    if (position >= entry->size)
+        return NULL;
+
+    const char *sector = get_sector(volume, entry->extent + position / ATAPI_SECTOR_SIZE, entry->extent + sectors_in(entry->size));
+
+    if (sector == NULL)
+        return NULL;
+
+    size_t offset = position % ATAPI_SECTOR_SIZE;
+    *length = ATAPI_SECTOR_SIZE - offset;
+
+    if (*length > entry->size - position)
+        *length = entry->size - position;
+
+    return sector + offset;
+}
+
+// copies count bytes of a file from a position in it, which the caller makes sure are all there
+bool iso9660_read(struct iso9660_volume *volume, struct iso9660_entry *entry, size_t position, char *out, size_t count) {
+    while (count > 0) {
+        size_t length;
+        const char *span = iso9660_span(volume, entry, position, &length);
+
+        if (span == NULL)
+            return false;
+
+        if (length > count)
+            length = count;
+
+        memcpy(out, span, length);
+        out += length;
+        position += length;
+        count -= length;
+    }
+
+    return true;
+}
+
+static void unmount(struct iso9660_volume *volume) {
+    if (volume->sectors != NULL)
+        free(volume->sectors[0].data);
+
+    free(volume->sectors);
+    free(volume->sector_buckets);
+    free(volume->buckets);
+    free(volume->readahead);
+    free(volume->scratch);
+    free(volume);
+}
+
+// sets up the sector cache and reads the volume descriptor and root directory, returns NULL if there's no ISO9660 on the disc
+struct iso9660_volume *iso9660_mount(struct atapi_drive *drive, size_t cache_size) {
+    struct iso9660_volume *volume = calloc(1, sizeof(struct iso9660_volume));
+
+    if (volume == NULL)
+        return NULL;
+
+    volume->drive = drive;
+    volume->sector_count = drive->sector_count;
+
+    // the cache has to be able to hold a whole read ahead, or the sector that was wanted could be pushed out of it
+    volume->cache_count = cache_size / ATAPI_SECTOR_SIZE;
+    if (volume->cache_count < ISO9660_READAHEAD)
+        volume->cache_count = ISO9660_READAHEAD;
+
+    volume->sectors = calloc(volume->cache_count, sizeof(struct iso9660_sector));
+    char *cache_data = malloc(volume->cache_count * ATAPI_SECTOR_SIZE);
+    volume->sector_buckets = calloc(volume->cache_count, sizeof(struct iso9660_sector *));
+    volume->bucket_count = 64;
+    volume->buckets = calloc(volume->bucket_count, sizeof(struct iso9660_entry *));
+    volume->readahead = malloc(ISO9660_READAHEAD * ATAPI_SECTOR_SIZE);
+    volume->scratch = malloc(ATAPI_SECTOR_SIZE);
+
+    if (volume->sectors == NULL || cache_data == NULL || volume->sector_buckets == NULL || volume->buckets == NULL
+            || volume->readahead == NULL || volume->scratch == NULL) {
+        if (volume->sectors == NULL)
+            free(cache_data);
+        else
+            volume->sectors[0].data = cache_data;
+
+        unmount(volume);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < volume->cache_count; i ++) {
+        volume->sectors[i].lba = NO_SECTOR;
+        volume->sectors[i].data = cache_data + i * ATAPI_SECTOR_SIZE;
+        lru_append(volume, &volume->sectors[i]);
+    }
+
+    // the volume descriptors start 32 KiB in, and go on until a terminator
+    const uint8_t *descriptor;
+
+    for (uint32_t lba = DESCRIPTOR_FIRST; ; lba ++) {
+        descriptor = (const uint8_t *) get_sector(volume, lba, lba + 1);
+
+        if (descriptor == NULL || memcmp(descriptor + 1, "CD001", 5) || descriptor[0] == DESCRIPTOR_TERMINATOR) {
+            unmount(volume);
+            return NULL;
+        }
+
+        if (descriptor[0] == DESCRIPTOR_PRIMARY)
+            break;
+    }
+
+    if (le16(descriptor + DESCRIPTOR_SECTOR_SIZE) != ATAPI_SECTOR_SIZE) {
+        unmount(volume);
+        return NULL;
+    }
+
+    // the label is padded with spaces
+    memcpy(volume->label, descriptor + DESCRIPTOR_LABEL, 32);
+    volume->label[32] = 0;
+
+    for (int i = 31; i >= 0 && volume->label[i] == ' '; i --)
+        volume->label[i] = 0;
+
+    const uint8_t *root = descriptor + DESCRIPTOR_ROOT;
+
+    volume->root.name = "";
+    volume->root.directory = true;
+    volume->root.mtime = record_mtime(root + RECORD_DATE);
+    volume->root.extent = le32(root + RECORD_EXTENT) + root[RECORD_ATTRIBUTES_LENGTH];
+    volume->root.size = le32(root + RECORD_SIZE);
+
+    // a disc with Rock Ridge has an SP entry at the start of the system use area of the root's record for itself,
+    // which also says how far into every other record's system use area their entries start
+    const uint8_t *self = (const uint8_t *) get_sector(volume, volume->root.extent, volume->root.extent + 1);
+
+    if (self == NULL) {
+        unmount(volume);
+        return NULL;
+    }
+
+    size_t start = system_use_start(volume, self);
+    const uint8_t *sp = self + start;
+
+    volume->rock_ridge = start + 7 <= self[RECORD_LENGTH] && sp[0] == 'S' && sp[1] == 'P' && sp[2] >= 7 && sp[4] == 0xbe && sp[5] == 0xef;
+
+    if (volume->rock_ridge)
+        volume->susp_skip = sp[6];
+
+    return volume;
+}
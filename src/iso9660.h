@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "atapi.h"
+
+/* how much of the disc is kept in memory once it's been read, if cdcache isn't set */
+#define ISO9660_CACHE_DEFAULT (1024 * 1024)
+
+/* how many sectors past the one that's wanted are read at once, while they're still in the same file */
+#define ISO9660_READAHEAD 16
+
+/* a file or directory on the disc, which is only read in once the directory it's in is first looked in */
+struct iso9660_entry {
+    char *name;
+    size_t name_length;
+    bool directory;
+    uint32_t mtime;
+
+    // where it is on the disc. a relocated directory's size isn't known until it's loaded
+    uint32_t extent;
+    uint32_t size;
+
+    struct iso9660_entry *parent;
+    struct iso9660_entry *first_child;
+    struct iso9660_entry *last_child;
+    struct iso9660_entry *next_sibling;
+    size_t child_count;
+
+    // directories only, whether what's in them has been read in yet
+    bool loaded;
+
+    // the next entry in the same hash bucket, and the hash that put it there
+    struct iso9660_entry *hash_next;
+    uint32_t hash;
+};
+
+/* a sector of the disc in the cache */
+struct iso9660_sector {
+    uint32_t lba;
+    char *data;
+
+    struct iso9660_sector *hash_next;
+    struct iso9660_sector *lru_prev;
+    struct iso9660_sector *lru_next;
+};
+
+struct iso9660_volume {
+    struct atapi_drive *drive;
+    char label[33];
+    uint32_t sector_count;
+
+    // whether names come from Rock Ridge entries, and how far into each record's system use area they start
+    bool rock_ridge;
+    uint8_t susp_skip;
+
+    struct iso9660_entry root;
+
+    // every entry that's been read in other than the root, hashed by its parent and name
+    struct iso9660_entry **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+
+    // cached sectors, hashed by where they are, and least recently used first. a sector that isn't in use has an
+    // lba of UINT32_MAX
+    struct iso9660_sector *sectors;
+    size_t cache_count;
+    struct iso9660_sector **sector_buckets;
+    struct iso9660_sector *lru_first;
+    struct iso9660_sector *lru_last;
+
+    // what sectors are read into before they go in the cache, and a copy of the directory sector being read
+    char *readahead;
+    char *scratch;
+};
+
+struct iso9660_volume *iso9660_mount(struct atapi_drive *drive, size_t cache_size);
+struct iso9660_entry *iso9660_lookup(struct iso9660_volume *volume, const char *path);
+bool iso9660_load_directory(struct iso9660_volume *volume, struct iso9660_entry *directory);
+bool iso9660_read(struct iso9660_volume *volume, struct iso9660_entry *entry, size_t position, char *out, size_t count);
+const char *iso9660_span(struct iso9660_volume *volume, struct iso9660_entry *entry, size_t position, size_t *length);
@@ -0,0 +1,259 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "luaheap.h"
+#include "tlsf.h"
+#include "stack.h"
+
+/*
+ * allocator for Lua states. Lua tells the allocator the size of every block it frees or resizes, so small blocks
+ * don't need a header: they're served from segregated free lists, one per size class, which are refilled by carving
+ * up slabs taken from the general heap. this keeps the general heap's free list short, since the churn of small
+ * strings, tables and closures never reaches it, and makes allocating or freeing a small block O(1).
+ *
+ * slabs stay with their size class once carved up and are only given back when the state is destroyed.
+ *
+ * a heap can also be given a region of memory of its own, in which case everything the state allocates (and the
+ * heap itself) lives in that region and nothing else, which is what lets snapshot.c save and restore it whole.
+ *
+ * if the heap has a limit, growing past it fails like running out of memory would. Lua reacts to a failed
+ * allocation by running an emergency full collection and retrying once, so the limit only raises a memory error
+ * when there really isn't enough garbage to free
+ */
+
+// 8 byte granularity for lookups, every class size is a multiple of this
+#define GRANULE 8
+
+static const uint16_t class_sizes[LUA_HEAP_CLASSES] = { 8, 16, 24, 32, 40, 48, 64, 80, 96, 128, 160, 192, 256 };
+
+// maps a size rounded up to a whole number of granules to the smallest class that fits it
+static uint8_t size_classes[LUA_HEAP_SMALL_MAX / GRANULE + 1];
+static bool size_classes_ready = false;
+
+static void init_size_classes(void) {
+    int class = 0;
+
+    for (int i = 0; i <= LUA_HEAP_SMALL_MAX / GRANULE; i++) {
+        while (class_sizes[class] < i * GRANULE)
+            class++;
+
+        size_classes[i] = class;
+    }
+
+    size_classes_ready = true;
+}
+
+static int size_class(size_t size) {
+    return size_classes[(size + GRANULE - 1) / GRANULE];
+}
+
+void lua_heap_init(struct lua_heap *heap) {
+    if (!size_classes_ready)
+        init_size_classes();
+
+    memset(heap, 0, sizeof(struct lua_heap));
+}
+
+// sets up a heap that keeps itself and everything allocated from it in the given memory. returns NULL on failure
+struct lua_heap *lua_heap_create_in(void *memory, size_t size) {
+    struct tlsf *arena = tlsf_create(memory, size);
+
+    if (arena == NULL)
+        return NULL;
+
+    struct lua_heap *heap = tlsf_malloc(arena, sizeof(struct lua_heap));
+
+    if (heap == NULL)
+        return NULL;
+
+    lua_heap_init(heap);
+    heap->arena = arena;
+
+    return heap;
+}
+
+static void *general_alloc(struct lua_heap *heap, size_t size) {
+    return heap->arena != NULL ? tlsf_malloc(heap->arena, size) : malloc(size);
+}
+
+static void general_free(struct lua_heap *heap, void *ptr) {
+    if (heap->arena != NULL)
+        tlsf_free(heap->arena, ptr);
+    else
+        free(ptr);
+}
+
+static void *general_realloc(struct lua_heap *heap, void *ptr, size_t size) {
+    return heap->arena != NULL ? tlsf_realloc(heap->arena, ptr, size) : realloc(ptr, size);
+}
+
+// gives every slab back to the general heap. only call this once the state using the heap has been closed
+void lua_heap_destroy(struct lua_heap *heap) {
+    // a heap with its own region just goes away with it
+    if (heap->arena != NULL)
+        return;
+
+    struct lua_heap_slab *slab = heap->slabs;
+
+    while (slab != NULL) {
+        struct lua_heap_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    memset(heap, 0, sizeof(struct lua_heap));
+}
+
+// carves up a new slab into blocks of the given class
+static bool refill(struct lua_heap *heap, int class) {
+    struct lua_heap_slab *slab = general_alloc(heap, LUA_HEAP_SLAB_SIZE);
+
+    if (slab == NULL)
+        return false;
+
+    slab->next = heap->slabs;
+    heap->slabs = slab;
+    heap->slab_bytes += LUA_HEAP_SLAB_SIZE;
+
+    size_t block_size = class_sizes[class];
+    uint8_t *block = (uint8_t *) (slab + 1);
+    uint8_t *end = (uint8_t *) slab + LUA_HEAP_SLAB_SIZE;
+
+    // link the blocks in address order so consecutive allocations are adjacent
+    struct lua_heap_block **tail = &heap->free_blocks[class];
+
+    for (; block + block_size <= end; block += block_size) {
+        *tail = (struct lua_heap_block *) block;
+        tail = &(*tail)->next;
+    }
+
+    *tail = NULL;
+    return true;
+}
+
+static void *alloc_small(struct lua_heap *heap, int class) {
+    if (heap->free_blocks[class] == NULL && !refill(heap, class))
+        return NULL;
+
+    struct lua_heap_block *block = heap->free_blocks[class];
+    heap->free_blocks[class] = block->next;
+
+    return block;
+}
+
+static void free_small(struct lua_heap *heap, int class, void *ptr) {
+    struct lua_heap_block *block = ptr;
+    block->next = heap->free_blocks[class];
+    heap->free_blocks[class] = block;
+}
+
+static void *alloc_block(struct lua_heap *heap, size_t size) {
+    if (size <= LUA_HEAP_SMALL_MAX)
+        return alloc_small(heap, size_class(size));
+    else
+        return general_alloc(heap, size);
+}
+
+static void free_block(struct lua_heap *heap, void *ptr, size_t size) {
+    if (size <= LUA_HEAP_SMALL_MAX)
+        free_small(heap, size_class(size), ptr);
+    else
+        general_free(heap, ptr);
+}
+
+static void account(struct lua_heap *heap, size_t osize, size_t nsize) {
+    heap->live_bytes += nsize - osize;
+
+    if (nsize > osize)
+        heap->allocated_bytes += nsize - osize;
+
+    if (heap->live_bytes > heap->peak_bytes)
+        heap->peak_bytes = heap->live_bytes;
+
+    if (osize <= LUA_HEAP_SMALL_MAX)
+        heap->small_bytes -= osize;
+    if (nsize <= LUA_HEAP_SMALL_MAX)
+        heap->small_bytes += nsize;
+}
+
+// when ptr is NULL, osize is a type tag rather than a size. on failure the old block must be left untouched
+static void *heap_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    struct lua_heap *heap = ud;
+
+    if (ptr == NULL)
+        osize = 0;
+
+    if (nsize == 0) {
+        if (ptr != NULL) {
+            free_block(heap, ptr, osize);
+            account(heap, osize, 0);
+        }
+
+        return NULL;
+    }
+
+    if (heap->limit != 0 && nsize > osize
+            && (heap->live_bytes >= heap->limit || nsize - osize > heap->limit - heap->live_bytes))
+        return NULL;
+
+    void *new_ptr;
+
+    if (ptr != NULL && osize <= LUA_HEAP_SMALL_MAX && nsize <= LUA_HEAP_SMALL_MAX
+            && size_class(osize) == size_class(nsize))
+        // still fits in the same block
+        new_ptr = ptr;
+    else if (ptr != NULL && osize > LUA_HEAP_SMALL_MAX && nsize > LUA_HEAP_SMALL_MAX)
+        new_ptr = general_realloc(heap, ptr, nsize);
+    else {
+        // moving between the pools and the general heap, or between size classes
+        new_ptr = alloc_block(heap, nsize);
+
+        if (new_ptr != NULL && ptr != NULL) {
+            memcpy(new_ptr, ptr, osize < nsize ? osize : nsize);
+            free_block(heap, ptr, osize);
+        }
+    }
+
+    if (new_ptr != NULL)
+        account(heap, osize, nsize);
+
+    return new_ptr;
+}
+
+// lua_Alloc implementation, see the Lua manual. it's counted in allocator_depth so a stack overflow part way through
+// doesn't leave the heap broken (see stack.c)
+void *lua_heap_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    allocator_depth ++;
+    void *new_ptr = heap_alloc(ud, ptr, osize, nsize);
+    allocator_depth --;
+
+    return new_ptr;
+}
+
+// returns how much memory the state could use in total, which is the whole kernel heap (or its region) unless it's
+// limited
+size_t lua_heap_total(const struct lua_heap *heap) {
+    size_t total = heap->arena != NULL ? tlsf_total_size(heap->arena) : malloc_total_size();
+
+    if (heap->limit != 0 && heap->limit < total)
+        return heap->limit;
+
+    return total;
+}
+
+// returns how much more memory the state could allocate, counting pooled blocks that aren't in use
+size_t lua_heap_free(const struct lua_heap *heap) {
+    size_t general = heap->arena != NULL ? tlsf_free_size(heap->arena) : malloc_free_size();
+    size_t available = general + (heap->slab_bytes - heap->small_bytes);
+
+    if (heap->limit != 0) {
+        size_t remaining = heap->limit > heap->live_bytes ? heap->limit - heap->live_bytes : 0;
+
+        if (remaining < available)
+            return remaining;
+    }
+
+    return available;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* blocks up to this size come from the size-class pools, anything larger goes to the general heap */
+#define LUA_HEAP_SMALL_MAX 256
+
+/* how much memory the pools grab from the general heap at a time */
+#define LUA_HEAP_SLAB_SIZE 4096
+
+#define LUA_HEAP_CLASSES 13
+
+/* header at the start of every slab, padded so the blocks after it are 8 byte aligned */
+struct lua_heap_slab {
+    struct lua_heap_slab *next;
+} __attribute__((aligned(8)));
+
+struct lua_heap_block {
+    struct lua_heap_block *next;
+};
+
+/* allocator state for one Lua state, passed to lua_newstate as the allocator's userdata */
+struct lua_heap {
+    struct lua_heap_block *free_blocks[LUA_HEAP_CLASSES];
+    struct lua_heap_slab *slabs;
+
+    // bytes Lua currently has allocated, and the most it's ever had allocated at once
+    size_t live_bytes;
+    size_t peak_bytes;
+
+    // running total of bytes ever allocated, which wraps around
+    size_t allocated_bytes;
+
+    // how much of live_bytes came from the pools, and how much memory the pools hold in total
+    size_t small_bytes;
+    size_t slab_bytes;
+
+    // allocations that would take live_bytes past this fail, unless it's 0
+    size_t limit;
+
+    // where slabs and large blocks come from if the heap has a region of its own, otherwise the kernel heap is used
+    struct tlsf *arena;
+};
+
+void lua_heap_init(struct lua_heap *heap);
+struct lua_heap *lua_heap_create_in(void *memory, size_t size);
+void lua_heap_destroy(struct lua_heap *heap);
+void *lua_heap_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+size_t lua_heap_total(const struct lua_heap *heap);
+size_t lua_heap_free(const struct lua_heap *heap);
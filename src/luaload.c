@@ -0,0 +1,121 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "luaload.h"
+#include "tar.h"
+
+/*
+ * loading Lua files out of an archive. "make luac-initrd" compiles every foo.lua in an unpacked initrd to stripped
+ * bytecode in foo.luac, which is used instead of the source when it's there, so nothing has to be parsed at boot.
+ *
+ * bytecode only works with a Lua built the same way, so before a .luac is used its header is compared with what
+ * this kernel's Lua would write itself: the format version, the sizes of instructions, integers and floats, and a
+ * sample integer and float to catch differences in byte order or representation. anything that doesn't match is
+ * ignored in favour of the source
+ */
+
+// signature, version, format, LUAC_DATA, three sizes, then LUAC_INT and LUAC_NUM
+#define HEADER_SIZE (4 + 1 + 1 + 6 + 3 + sizeof(lua_Integer) + sizeof(lua_Number))
+
+static char expected_header[HEADER_SIZE];
+static size_t expected_length = 0;
+
+static int collect_header(lua_State *L, const void *p, size_t size, void *ud) {
+    size_t count = HEADER_SIZE - expected_length;
+
+    if (count > size)
+        count = size;
+
+    memcpy(expected_header + expected_length, p, count);
+    expected_length += count;
+
+    return 0;
+}
+
+// whether a precompiled chunk was made by a Lua that's compatible with this one
+bool bytecode_compatible(lua_State *L, const char *data, size_t size) {
+    // the header this Lua writes is found by dumping an empty function, once
+    if (expected_length < HEADER_SIZE) {
+        expected_length = 0;
+
+        if (luaL_loadstring(L, "") != LUA_OK) {
+            lua_pop(L, 1);
+            return false;
+        }
+
+        lua_dump(L, collect_header, NULL, true);
+        lua_pop(L, 1);
+
+        if (expected_length < HEADER_SIZE)
+            return false;
+    }
+
+    return size >= HEADER_SIZE && !memcmp(data, expected_header, HEADER_SIZE);
+}
+
+// finds the precompiled version of a .lua file, if it has one that can be used
+static struct tar_entry *find_bytecode(lua_State *L, struct tar_index *index, const char *path) {
+    size_t length = strlen(path);
+    char luac_path[TAR_PATH_MAX];
+
+    if (length < 4 || strcmp(path + length - 4, ".lua") || length + 2 > sizeof(luac_path))
+        return NULL;
+
+    memcpy(luac_path, path, length);
+    luac_path[length] = 'c';
+    luac_path[length + 1] = 0;
+
+    struct tar_entry *entry = tar_find_file(index, luac_path);
+
+    if (entry == NULL)
+        return NULL;
+
+    const char *data = tar_open_data(index, entry);
+    bool compatible = data != NULL && bytecode_compatible(L, data, entry->size);
+
+    if (data != NULL)
+        tar_close_data(index, entry);
+
+    if (!compatible) {
+        printf("ignoring %s, it was compiled for a different Lua\n", luac_path);
+        return NULL;
+    }
+
+    return entry;
+}
+
+/*
+ * loads a file from an archive like luaL_loadfilex, using its precompiled version if there is one and the mode
+ * allows binary chunks. the chunk name is the path with an @ in front unless one is given. returns the status
+ * from loading it, LUA_ERRFILE if it doesn't exist, or LUA_ERRMEM if it couldn't be opened (out of memory, or
+ * a corrupt compressed file), with the function or an error message pushed either way
+ */
+int luaload_file(lua_State *L, struct tar_index *index, const char *path, const char *chunkname, const char *mode) {
+    if (chunkname == NULL)
+        chunkname = lua_pushfstring(L, "@%s", path);
+    else
+        lua_pushstring(L, chunkname);
+
+    struct tar_entry *entry = mode == NULL || strchr(mode, 'b') != NULL ? find_bytecode(L, index, path) : NULL;
+    bool binary = entry != NULL;
+
+    if (!binary)
+        entry = tar_find_file(index, path);
+
+    const char *data = entry != NULL ? tar_open_data(index, entry) : NULL;
+
+    if (data == NULL) {
+        lua_pushfstring(L, entry != NULL ? "cannot read %s (not enough memory, or it's corrupt)" : "cannot open %s", path);
+        lua_remove(L, -2);
+        return entry != NULL ? LUA_ERRMEM : LUA_ERRFILE;
+    }
+
+    int status = luaL_loadbufferx(L, data, entry->size, chunkname, binary ? "b" : mode);
+    tar_close_data(index, entry);
+    lua_remove(L, -2);
+
+    return status;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <lua.h>
+#include "tar.h"
+
+bool bytecode_compatible(lua_State *L, const char *data, size_t size);
+int luaload_file(lua_State *L, struct tar_index *index, const char *path, const char *chunkname, const char *mode);
@@ -0,0 +1,271 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include "luaprof.h"
+#include "luaheap.h"
+#include "clock.h"
+#include "stack.h"
+
+/*
+ * optional Lua heap profiler, turned on with luaprof=1 on the kernel command line. when it's on, the state's
+ * allocator is luaprof_alloc instead of lua_heap_alloc, which counts every allocation by the type of object being
+ * created and by the function running at the time before passing it on.
+ *
+ * the allocator isn't told which thread is allocating, so that's taken from the running thread tracked in stack.c.
+ * luaC_step and luaC_fullgc are wrapped at link time (see the Makefile) to time every garbage collection pause, and
+ * to count in allocator_depth (see stack.c). when the profiler is off, that's all they do, and the allocator isn't
+ * involved at all
+ */
+
+// the allocator is passed the type of a new object in osize, with its variant (long string, C closure and so on) in
+// the bits above the basic type. 0 is used for anything that isn't an object, and resizing something counts as well
+#define TYPE_BITS(tag) ((tag) & 0x0f)
+#define TYPE_OTHER 0
+#define TYPE_UPVALUE LUA_NUMTYPES
+#define TYPE_PROTO (LUA_NUMTYPES + 1)
+#define TYPES (LUA_NUMTYPES + 2)
+
+#define SITES 256
+#define SITE_NAME_SIZE (LUA_IDSIZE + 16)
+
+// bucket n counts pauses of less than 2^n microseconds, down to 2^(n - 1)
+#define PAUSE_BUCKETS 22
+
+struct counter {
+    uint32_t count;
+    uint64_t bytes;
+};
+
+struct site {
+    char name[SITE_NAME_SIZE];
+    struct counter counter;
+};
+
+static const char *type_names[TYPES] = {
+    "other", "boolean", "lightuserdata", "number", "string", "table", "function", "userdata", "thread", "upvalue",
+    "proto"
+};
+
+static bool enabled = false;
+
+static struct counter types[TYPES];
+
+// open addressing hash table of allocation sites. once it's full, new sites get lumped together
+static struct site *sites = NULL;
+static int site_count = 0;
+static struct site other_sites = { .name = "(other)" };
+
+static uint32_t pauses[PAUSE_BUCKETS];
+static uint32_t pause_count = 0;
+static uint64_t pause_total_ns = 0;
+static uint64_t pause_max_ns = 0;
+
+void __real_luaC_step(lua_State *L);
+void __real_luaC_fullgc(lua_State *L, int isemergency);
+
+// sets the profiler up, which must happen before luaprof_alloc is used. returns false if it couldn't be
+bool luaprof_init(void) {
+    sites = calloc(SITES, sizeof(struct site));
+
+    if (sites == NULL) {
+        printf("not enough memory for the Lua heap profiler\n");
+        return false;
+    }
+
+    enabled = true;
+    return true;
+}
+
+bool luaprof_enabled(void) {
+    return enabled;
+}
+
+// FNV-1a
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    for (; *name != 0; name ++)
+        hash = (hash ^ (uint8_t) *name) * 16777619u;
+
+    return hash;
+}
+
+static struct site *find_site(const char *name) {
+    uint32_t index = hash_name(name) % SITES;
+
+    for (int i = 0; i < SITES; i ++, index = (index + 1) % SITES) {
+        struct site *site = &sites[index];
+
+        if (site->name[0] == 0) {
+            // leave some space free so lookups of new sites don't have to go through the whole table
+            if (site_count >= SITES * 3 / 4)
+                return &other_sites;
+
+            strncpy(site->name, name, SITE_NAME_SIZE - 1);
+            site_count ++;
+            return site;
+        }
+
+        if (!strcmp(site->name, name))
+            return site;
+    }
+
+    return &other_sites;
+}
+
+/*
+ * works out which function is allocating. this is called from inside the allocator, so it mustn't do anything that
+ * could allocate or touch the stack: lua_getinfo with "Sn" only reads from the call info
+ */
+static struct site *current_site(void) {
+    lua_State *current_thread = current_lua_thread();
+    lua_Debug ar;
+    char name[SITE_NAME_SIZE];
+
+    if (current_thread == NULL || !lua_getstack(current_thread, 0, &ar) || !lua_getinfo(current_thread, "Sn", &ar))
+        return find_site("(none)");
+
+    if (ar.what != NULL && !strcmp(ar.what, "C"))
+        snprintf(name, sizeof(name), "[C] %s", ar.name != NULL ? ar.name : "?");
+    else
+        snprintf(name, sizeof(name), "%s:%d", ar.short_src, ar.linedefined);
+
+    return find_site(name);
+}
+
+static void count(struct counter *counter, size_t bytes) {
+    counter->count ++;
+    counter->bytes += bytes;
+}
+
+// lua_Alloc that profiles allocations before passing them on to lua_heap_alloc
+void *luaprof_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    size_t old_size = ptr == NULL ? 0 : osize;
+
+    // this has to happen before anything is reallocated, since that might be the stack lua_getinfo looks at
+    if (nsize > old_size) {
+        int type = ptr == NULL && TYPE_BITS(osize) < TYPES ? TYPE_BITS(osize) : TYPE_OTHER;
+
+        count(&types[type], nsize - old_size);
+        count(&current_site()->counter, nsize - old_size);
+    }
+
+    return lua_heap_alloc(ud, ptr, osize, nsize);
+}
+
+static void record_pause(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    while (bucket < PAUSE_BUCKETS - 1 && us >= 1ull << bucket)
+        bucket ++;
+
+    pauses[bucket] ++;
+    pause_count ++;
+    pause_total_ns += ns;
+
+    if (ns > pause_max_ns)
+        pause_max_ns = ns;
+}
+
+void __wrap_luaC_step(lua_State *L) {
+    bool timed = enabled;
+    uint64_t start = timed ? clock_ns() : 0;
+
+    allocator_depth ++;
+    __real_luaC_step(L);
+    allocator_depth --;
+
+    if (timed)
+        record_pause(clock_ns() - start);
+}
+
+void __wrap_luaC_fullgc(lua_State *L, int isemergency) {
+    bool timed = enabled;
+    uint64_t start = timed ? clock_ns() : 0;
+
+    allocator_depth ++;
+    __real_luaC_fullgc(L, isemergency);
+    allocator_depth --;
+
+    if (timed)
+        record_pause(clock_ns() - start);
+}
+
+static void push_counter(lua_State *L, const struct counter *counter) {
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, counter->count);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, counter->bytes);
+    lua_setfield(L, -2, "bytes");
+}
+
+/*
+ * pushes a table of everything profiled so far: { types = { [name] = { count, bytes } }, functions = { [site] =
+ * { count, bytes } }, pauses = { count, total, max, histogram } }. times are in seconds, and histogram[n] is the
+ * number of pauses shorter than 2^n microseconds (but not shorter than 2^(n - 1))
+ */
+void luaprof_push(lua_State *L) {
+    // take a copy first, since building the tables allocates and so changes the counts
+    struct counter type_copy[TYPES];
+    memcpy(type_copy, types, sizeof(types));
+
+    lua_createtable(L, 0, 3);
+
+    lua_createtable(L, 0, TYPES);
+    for (int i = 0; i < TYPES; i ++) {
+        push_counter(L, &type_copy[i]);
+        lua_setfield(L, -2, type_names[i]);
+    }
+    lua_setfield(L, -2, "types");
+
+    lua_createtable(L, 0, site_count + 1);
+    for (int i = 0; i < SITES; i ++)
+        if (sites[i].name[0] != 0) {
+            push_counter(L, &sites[i].counter);
+            lua_setfield(L, -2, sites[i].name);
+        }
+    if (other_sites.counter.count != 0) {
+        push_counter(L, &other_sites.counter);
+        lua_setfield(L, -2, other_sites.name);
+    }
+    lua_setfield(L, -2, "functions");
+
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, pause_count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, (lua_Number) pause_total_ns / NS_PER_SEC);
+    lua_setfield(L, -2, "total");
+    lua_pushnumber(L, (lua_Number) pause_max_ns / NS_PER_SEC);
+    lua_setfield(L, -2, "max");
+    lua_createtable(L, PAUSE_BUCKETS, 0);
+    for (int i = 0; i < PAUSE_BUCKETS; i ++) {
+        lua_pushinteger(L, pauses[i]);
+        lua_rawseti(L, -2, i);
+    }
+    lua_setfield(L, -2, "histogram");
+    lua_setfield(L, -2, "pauses");
+}
+
+// prints everything profiled so far to the serial port
+void luaprof_dump(void) {
+    printf("Lua heap profile\nallocations by type:\n");
+    for (int i = 0; i < TYPES; i ++)
+        printf("\t%-14s %10d %12lld bytes\n", type_names[i], types[i].count, types[i].bytes);
+
+    printf("allocations by function:\n");
+    for (int i = 0; i < SITES; i ++)
+        if (sites[i].name[0] != 0)
+            printf("\t%-40s %10d %12lld bytes\n", sites[i].name, sites[i].counter.count, sites[i].counter.bytes);
+    if (other_sites.counter.count != 0)
+        printf("\t%-40s %10d %12lld bytes\n", other_sites.name, other_sites.counter.count, other_sites.counter.bytes);
+
+    printf("%d GC pauses, %lld us in total, %lld us at most\n", pause_count, pause_total_ns / 1000, pause_max_ns / 1000);
+    for (int i = 0; i < PAUSE_BUCKETS; i ++)
+        if (pauses[i] != 0)
+            printf("\t< %8d us: %d\n", 1 << i, pauses[i]);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <lua.h>
+
+bool luaprof_init(void);
+bool luaprof_enabled(void);
+void *luaprof_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+void luaprof_push(lua_State *L);
+void luaprof_dump(void);
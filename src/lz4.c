@@ -0,0 +1,80 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+/*
+ * decompressor for the LZ4 block format (see lz4_Block_format.md in the LZ4 sources). a block is a series of
+ * sequences, each being a run of literal bytes followed by a copy of earlier output. everything is bounds checked,
+ * so a corrupt block fails rather than writing past the end of the output
+ */
+
+// reads the extra bytes of a length that didn't fit in its 4 bits of the token
+static bool read_length(const uint8_t **in, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+
+    do {
+        if (*in >= end)
+            return false;
+
+        byte = *(*in) ++;
+        *length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+// decompresses a whole block, returns false if it's corrupt or doesn't come out at exactly the expected size
+bool lz4_decompress(const void *source, size_t source_size, void *destination, size_t destination_size) {
+    const uint8_t *in = source;
+    const uint8_t *in_end = in + source_size;
+    uint8_t *out = destination;
+    uint8_t *out_end = out + destination_size;
+
+    while (in < in_end) {
+        uint8_t token = *in ++;
+        size_t length = token >> 4;
+
+        if (length == 15 && !read_length(&in, in_end, &length))
+            return false;
+
+        if (length > (size_t) (in_end - in) || length > (size_t) (out_end - out))
+            return false;
+
+        memcpy(out, in, length);
+        in += length;
+        out += length;
+
+        // the last sequence is only literals
+        if (in == in_end)
+            break;
+
+        if (in_end - in < 2)
+            return false;
+
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        if (offset == 0 || offset > (size_t) (out - (uint8_t *) destination))
+            return false;
+
+        length = token & 15;
+
+        if (length == 15 && !read_length(&in, in_end, &length))
+            return false;
+
+        length += 4;
+
+        if (length > (size_t) (out_end - out))
+            return false;
+
+        // the copy can overlap what it's writing, which is how runs are encoded, so it has to go a byte at a time
+        const uint8_t *match = out - offset;
+
+        while (length --)
+            *out ++ = *match ++;
+    }
+
+    return out == out_end;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+bool lz4_decompress(const void *source, size_t source_size, void *destination, size_t destination_size);
@@ -5,24 +5,37 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
-#include <malloc.h>
 #include <assert.h>
 #include <stdbool.h>
 #include "multiboot.h"
 #include "interrupts.h"
 #include "rtc.h"
+#include "clock.h"
+#include "clockevent.h"
+#include "cpustat.h"
 #include "tar.h"
 #include "uuid.h"
+#include "tlsf.h"
+#include "paging.h"
+#include "stack.h"
+#include "cmdline.h"
+#include "luaheap.h"
+#include "luaprof.h"
+#include "snapshot.h"
+#include "luaload.h"
 #include "ps2.h"
 #include "component/vgatext.h"
 #include "component/vgagraphics.h"
 #include "component/gpu.h"
 #include "component/initrd.h"
+#include "component/tmpfs.h"
+#include "component/cdrom.h"
 #include "component/eeprom.h"
 #include "api/component.h"
 #include "api/computer.h"
 #include "api/unicode.h"
 #include "api/os.h"
+#include "api/buffer.h"
 
 extern uint32_t mboot_sig;
 extern struct multiboot_header *mboot_ptr;
@@ -44,11 +57,81 @@ static const luaL_Reg loadedlibs[] = {
     {"component", luaopen_component},
     {"unicode", luaopen_unicode},
     {"os", luaopen_os},
+    {"buffer", luaopen_buffer},
     {NULL, NULL}
 };
 
+// total amount of memory given to the heap
 uintptr_t memory_size = 0;
 
+// memory above this can't be addressed without paging extensions
+#define MEMORY_LIMIT 0xfffff000ull
+
+// the NULL page, the kernel, the multiboot header, the memory map, the command line and the module list. on top of
+// these, every module and its string take one each, and so does every memory map region once it's been added
+#define FIXED_RESERVED 6
+
+struct reserved_range {
+    uintptr_t start;
+    uintptr_t end;
+};
+
+// ranges of memory that mustn't be given to the heap, in a table sized in kmain for everything the bootloader passed
+static struct reserved_range *reserved;
+static int reserved_max = 0;
+static int reserved_count = 0;
+
+static void reserve_memory(uintptr_t start, uintptr_t end) {
+    if (end <= start)
+        return;
+
+    // carrying on would let the heap have memory that's in use, so this is as far as booting goes
+    if (reserved_count == reserved_max) {
+        printf("too many reserved memory ranges, can't reserve %08x - %08x\n", start, end);
+
+        while (1)
+            __asm__ __volatile__ ("cli; hlt");
+    }
+
+    reserved[reserved_count].start = start;
+    reserved[reserved_count].end = end;
+    reserved_count ++;
+}
+
+static void reserve_string(const char *string) {
+    if (string != NULL)
+        reserve_memory((uintptr_t) string, (uintptr_t) string + strlen(string) + 1);
+}
+
+// gives whatever parts of a range aren't covered by reserved ranges (starting from the given one) to the heap
+static void add_memory(uintptr_t start, uintptr_t end, int first_reserved) {
+    for (int i = first_reserved; i < reserved_count && start < end; i ++) {
+        if (reserved[i].end <= start || reserved[i].start >= end)
+            continue;
+
+        // split around the reserved range, the part before it still has to be checked against the remaining ones
+        if (reserved[i].start > start)
+            add_memory(start, reserved[i].start, i + 1);
+
+        start = reserved[i].end;
+    }
+
+    // too small to be worth bothering with
+    if (end <= start || end - start < 4096)
+        return;
+
+    printf("using block at %08x + %08x (%d.%02d MiB) for alloc\n", start, end - start, (end - start) / 1048576, ((end - start) / 10485) % 100);
+    malloc_addblock((void *) start, end - start);
+    memory_size += end - start;
+}
+
+// the size field of a memory map entry doesn't include itself
+static uint32_t mmap_entry_size(uint32_t offset) {
+    return ((struct mmap_entry *) (mboot_ptr->mmap_addr + offset))->size + sizeof(uint32_t);
+}
+
+static struct lua_heap lua_heap;
+
 static char *message_traceback(lua_State *L) {
     luaL_traceback(L, L, lua_tostring(L, -1), 1);
     const char *message = lua_tostring(L, -1);
@@ -56,26 +139,35 @@ static char *message_traceback(lua_State *L) {
     return message;
 }
 
-static const char *run_string(lua_State *L, const char *name, const char *data, size_t size) {
-    if (size == 0)
-        return;
-
-    const char *message;
-
-    if (luaL_loadbuffer(L, data, size, name))
-        return message_traceback(L);
-
+// resumes the main thread until it finishes, saving a snapshot whenever it yields to ask for one
+static const char *run_thread(lua_State *L, int nargs) {
     while (1) {
         int nresults;
 
-        if (lua_resume(L, NULL, 0, &nresults) == LUA_YIELD) {
+        if (lua_resume(L, NULL, nargs, &nresults) == LUA_YIELD) {
             lua_pop(L, nresults);
+            nargs = snapshot_requested() ? snapshot_save(L) : 0;
             continue;
         } else
             return message_traceback(L);
     }
 }
 
+// runs a Lua file from the initrd, or its precompiled version if it has one
+static const char *run_file(lua_State *L, struct tar_index *index, const char *path, const char *name) {
+    if (luaload_file(L, index, path, name, NULL) != LUA_OK)
+        return message_traceback(L);
+
+    return run_thread(L, 0);
+}
+
+// called for errors outside of any protected call, after which there's nothing to do but give up
+static int panic(lua_State *L) {
+    const char *message = lua_tostring(L, -1);
+    printf("PANIC: unprotected error in call to Lua API (%s)\n", message != NULL ? message : "error object is not a string");
+    return 0;
+}
+
 static int check_arg(lua_State *L) {
     int n = luaL_checkinteger(L, 1);
     const char *have = lua_typename(L, lua_type(L, 2));
@@ -101,6 +193,25 @@ static int check_arg(lua_State *L) {
     return lua_error(L);
 }
 
+/*
+ * what a module's filesystem is labelled, which is whatever comes after its path on the line that loaded it (so
+ * "module /boot/app.tar app" is "app"), or the last part of its path if there's nothing else
+ */
+static const char *module_label(const char *string) {
+    const char *label = string;
+
+    for (const char *c = string; *c != 0 && *c != ' '; c ++)
+        if (*c == '/')
+            label = c + 1;
+
+    const char *arguments = strchr(string, ' ');
+
+    while (arguments != NULL && *arguments == ' ')
+        arguments ++;
+
+    return arguments != NULL && *arguments != 0 ? arguments : label;
+}
+
 void kmain(void) {
     printf("signature is %08x, flags are %08x\n", mboot_sig, mboot_ptr->flags);
 
@@ -109,8 +220,6 @@ void kmain(void) {
         return;
     }
 
-    memory_size = (mboot_ptr->mem_lower + mboot_ptr->mem_upper) * 1024;
-    printf("%d.%02d MiB of memory detected\n", memory_size / 1048576, (memory_size / 10485) % 100);
     printf("framebuffer type: %d\n", mboot_ptr->framebuffer_type);
     printf("framebuffer width: %d\n", mboot_ptr->framebuffer_width);
     printf("framebuffer height: %d\n", mboot_ptr->framebuffer_height);
@@ -122,71 +231,77 @@ void kmain(void) {
     } else {
         puts("text mode? no");
     }
-    uintptr_t largest_size = 0;
-    uintptr_t base_addr = 0;
-    struct mmap_entry *mmap = mboot_ptr->mmap_addr;
-
-    for (int i = 0; i < mboot_ptr->mmap_length && mmap->size > 0; i += mmap->size + 4) {
-        mmap = mboot_ptr->mmap_addr + i;
-        printf("%016llx + %016llx, type %d\n", mmap->base_addr, mmap->length, mmap->type);
+    int mmap_count = 0;
+
+    for (uint32_t i = 0; i + sizeof(uint32_t) <= mboot_ptr->mmap_length; i += mmap_entry_size(i))
+        mmap_count ++;
+
+    // there's no heap to put this in yet, and kmain never returns
+    struct reserved_range reserved_ranges[FIXED_RESERVED + 2 * mboot_ptr->mods_count + mmap_count];
+    reserved = reserved_ranges;
+    reserved_max = sizeof(reserved_ranges) / sizeof(reserved_ranges[0]);
+
+    // everything the kernel still needs from what the bootloader left in memory must be kept out of the heap
+    reserve_memory(0, 0x1000); // keep NULL invalid
+    reserve_memory((uintptr_t) &kernel_start, (uintptr_t) &kernel_end);
+    reserve_memory((uintptr_t) mboot_ptr, (uintptr_t) mboot_ptr + sizeof(struct multiboot_header));
+    reserve_memory((uintptr_t) mboot_ptr->mmap_addr, (uintptr_t) mboot_ptr->mmap_addr + mboot_ptr->mmap_length);
+
+    if (mboot_ptr->flags & (1 << 2)) {
+        printf("command line: \"%s\"\n", mboot_ptr->cmdline);
+        cmdline_init(mboot_ptr->cmdline);
+        reserve_string(mboot_ptr->cmdline);
+    }
 
-        if (mmap->type != AVAILABLE_RAM)
-            continue;
+    printf("%d module(s) at %08x\n", mboot_ptr->mods_count, mboot_ptr->mods_addr);
 
-        if ((uintptr_t) mmap->length <= largest_size || mmap->base_addr > UINTPTR_MAX || mmap->length > UINTPTR_MAX)
-            continue;
+    struct module_entry *module = mboot_ptr->mods_addr;
+    reserve_memory((uintptr_t) module, (uintptr_t) (module + mboot_ptr->mods_count));
 
-        uintptr_t tmp;
-        if (__builtin_add_overflow((uintptr_t) mmap->base_addr, (uintptr_t) mmap->length, &tmp))
-            continue;
+    for (int i = 0; i < mboot_ptr->mods_count; i ++, module ++) {
+        uintptr_t size = (uintptr_t) module->end - (uintptr_t) module->start;
+        printf("%08x - %08x (%d.%02d KiB): \"%s\"\n", module->start, module->end, size / 1024, (size / 10) % 100, module->string);
 
-        largest_size = mmap->length;
-        base_addr = mmap->base_addr;
+        reserve_memory((uintptr_t) module->start, (uintptr_t) module->end);
+        reserve_string(module->string);
     }
 
-    if ((uintptr_t) &kernel_start >= base_addr || base_addr < (uintptr_t) &kernel_end) {
-        uintptr_t reduction = (uintptr_t) &kernel_end - base_addr;
-        assert(reduction < largest_size);
-        largest_size -= reduction;
-        base_addr = (uintptr_t) &kernel_end;
-    }
+    for (uint32_t i = 0; i + sizeof(uint32_t) <= mboot_ptr->mmap_length; i += mmap_entry_size(i)) {
+        struct mmap_entry *mmap = mboot_ptr->mmap_addr + i;
+        printf("%016llx + %016llx, type %d\n", mmap->base_addr, mmap->length, mmap->type);
 
-    uintptr_t header_end = (uintptr_t) mboot_ptr + sizeof(struct multiboot_header);
-    if ((uintptr_t) mboot_ptr >= base_addr || base_addr < header_end) {
-        uintptr_t reduction = (uintptr_t) header_end - base_addr;
-        assert(reduction < largest_size);
-        largest_size -= reduction;
-        base_addr = header_end;
-    }
+        if (mmap->type != AVAILABLE_RAM || mmap->base_addr >= MEMORY_LIMIT)
+            continue;
 
-    printf("%d module(s) at %08x\n", mboot_ptr->mods_count, mboot_ptr->mods_addr);
+        uint64_t end = mmap->base_addr + mmap->length;
 
-    struct module_entry *module = mboot_ptr->mods_addr;
+        if (end > MEMORY_LIMIT)
+            end = MEMORY_LIMIT;
 
-    //for (int i = 0; i < mboot_ptr->mods_count; i ++, module ++) {
-    if (mboot_ptr->mods_count) {
-        uintptr_t size = (uintptr_t) module->end - (uintptr_t) module->start;
-        printf("%08x - %08x (%d.%02d KiB): \"%s\"\n", module->start, module->end, size / 1024, (size / 10) % 100, module->string);
+        add_memory(mmap->base_addr, end, 0);
 
-        if ((uintptr_t) module->start >= base_addr || base_addr < (uintptr_t) module->end) {
-            uintptr_t reduction = (uintptr_t) module->end - base_addr;
-            assert(reduction < largest_size);
-            largest_size -= reduction;
-            base_addr = (uintptr_t) module->end;
-        }
+        // some firmware reports overlapping regions, reserving each region once it's been added keeps any memory
+        // from being added twice
+        reserve_memory(mmap->base_addr, end);
     }
 
-    printf("using block at %08x + %08x (%d.%02d MiB) for alloc\n", base_addr, largest_size, largest_size / 1048576, (largest_size / 10485) % 100);
-    malloc_addblock(base_addr, largest_size);
+    printf("%d.%02d MiB of memory available for alloc\n", memory_size / 1048576, (memory_size / 10485) % 100);
 
     init_idt();
 
     printf("testing interrupts\n");
     __asm__ __volatile__ ("int3");
 
+    paging_init(mboot_ptr);
+    bool stack_guarded = stack_guard_init();
+
+    clock_init();
+    clockevent_init();
     rtc_init();
-    printf("time is %lld\n", epoch_time);
-    srand(epoch_time);
+    cpustat_init();
+    uint64_t time = get_time();
+    printf("time is %lld\n", time);
+    srand(time);
 
     printf("initializing components\n");
     struct eeprom_data *eeprom = eeprom_init();
@@ -206,55 +321,127 @@ void kmain(void) {
     printf("\tset: %p\n",gpu->set);
     printf("\tcopy: %p\n",gpu->copy);
 
-    if (mboot_ptr->mods_count != 0)
-        initrd_init(mboot_ptr->mods_addr->string, mboot_ptr->mods_addr->start, mboot_ptr->mods_addr->end);
+    // every module is a filesystem of its own, and the first one is what the machine boots from
+    struct tar_index *initrd = NULL;
+    module = mboot_ptr->mods_addr;
+
+    for (int i = 0; i < mboot_ptr->mods_count; i ++, module ++) {
+        struct tar_index *index = initrd_init(module_label(module->string), module->start, module->end);
+
+        if (i == 0)
+            initrd = index;
+    }
+
+    // whatever's on the CD the machine booted from is read off it as it's needed, rather than up front like modules
+    cdrom_init();
 
     ps2_init();
+    computer_init();
+    computer_set_tmp_address(tmpfs_init());
+
+    // luaprof=1 turns on the heap profiler, which otherwise doesn't get involved at all
+    bool profiling = cmdline_get_number("luaprof", 0) != 0 && luaprof_init();
+    if (profiling)
+        printf("Lua heap profiler enabled\n");
+
+    lua_Alloc alloc = profiling ? luaprof_alloc : lua_heap_alloc;
+    struct lua_heap *heap = &lua_heap;
+    lua_State *L = NULL;
+
+    struct tar_entry *entry;
+    const char *data;
+
+    // a snapshot in the initrd picks up where bios.lua was when it was made, unless booted with snapshot=off
+    if (initrd != NULL && snapshot_restoring() && (entry = tar_find_file(initrd, SNAPSHOT_PATH)) != NULL
+            && (data = tar_open_data(initrd, entry)) != NULL) {
+        L = snapshot_restore(data, entry->size);
+        tar_close_data(initrd, entry);
+    }
+
+    if (L != NULL) {
+        void *ud;
+        lua_getallocf(L, &ud);
+        heap = ud;
+        lua_setallocf(L, alloc, heap);
+    }
+
+    bool restored = L != NULL;
+
+    if (!restored) {
+        printf("starting Lua\n");
+
+        // snapshot=dump keeps the Lua heap somewhere it can be snapshotted from, which needs paging
+        if (snapshot_dumping() && (heap = snapshot_create_heap(cmdline_get_number("luamem", 0))) == NULL) {
+            printf("can't map the Lua heap for snapshots, computer.snapshot() won't work\n");
+            heap = &lua_heap;
+        }
+
+        if (heap == &lua_heap)
+            lua_heap_init(&lua_heap);
 
-    printf("starting Lua\n");
-    lua_State *L = luaL_newstate();
-    assert(L != NULL);
+        L = lua_newstate(alloc, heap);
+        assert(L != NULL);
+        lua_atpanic(L, panic);
 
-    const luaL_Reg *lib;
-    /* "require" functions from 'loadedlibs' and set results to global table */
-    for (lib = loadedlibs; lib->func; lib++) {
-        printf("loading library %s\n", lib->name);
-        luaL_requiref(L, lib->name, lib->func, 1);
-        lua_pop(L, 1);  /* remove lib */
+        const luaL_Reg *lib;
+        /* "require" functions from 'loadedlibs' and set results to global table */
+        for (lib = loadedlibs; lib->func; lib++) {
+            printf("loading library %s\n", lib->name);
+            luaL_requiref(L, lib->name, lib->func, 1);
+            lua_pop(L, 1);  /* remove lib */
+        }
+
+        lua_register(L, "checkArg", check_arg);
     }
 
-    lua_register(L, "checkArg", check_arg);
+    // with a guard page, overflowing the stack is an error rather than memory corruption, so deeper C recursion can
+    // be allowed than Lua would assume is safe. a restored state comes with the limit of the boot that made it, which
+    // might have had a guard page when this one doesn't, so it's set either way
+    lua_setcstacklimit(L, stack_guarded ? GUARDED_C_STACK_LIMIT : DEFAULT_C_STACK_LIMIT);
+
+    // luamem=<size> limits how much memory Lua can use, the K, M and G suffixes work
+    heap->limit = cmdline_get_number("luamem", 0);
+    if (heap->limit != 0)
+        printf("limiting Lua to %d KiB\n", heap->limit / 1024);
 
-    if (mboot_ptr->mods_count != 0) {
-        module = mboot_ptr->mods_addr;
+    set_main_lua_thread(L);
 
-        struct tar_iterator *iter;
-        const char *data;
-        size_t size;
+    if (initrd != NULL) {
         if (!text_mode) {
             printf("loading font\n");
-            iter = open_tar(module->start, module->end);
             
-            if (tar_find(iter,"/font.hex",TAR_NORMAL_FILE,&data, &size)) {
-                vgagraphics_load_font(data,size);
+            if ((entry = tar_find_file(initrd, "/font.hex")) != NULL && (data = tar_open_data(initrd, entry)) != NULL) {
+                vgagraphics_load_font(data, entry->size);
+                tar_close_data(initrd, entry);
             } else 
                 gpu_error_message(gpu, "could not find font.hex");
-            
-            size = 0;
-            data = NULL;
         }
-        iter = open_tar(module->start, module->end);
-        if (tar_find(iter, "/bios.lua", TAR_NORMAL_FILE, &data, &size)) {
+
+        // the EEPROM keeps its contents for good, so bios.lua is never let go of
+        if ((entry = tar_find_file(initrd, "/bios.lua")) != NULL && (eeprom->contents = tar_open_data(initrd, entry)) != NULL)
+            eeprom->contents_size = entry->size;
+
+        if (restored) {
+            // computer.snapshot() returns true in the restored machine
+            printf("resuming from snapshot\n");
+            lua_pushboolean(L, true);
+            gpu_error_message(gpu, run_thread(L, 1));
+        } else {
             printf("running bios.lua\n");
-            eeprom->contents = data;
-            gpu_error_message(gpu, run_string(L, "=bios.lua", data, size));
-        } else
-            gpu_error_message(gpu, "couldn't find bios.lua");
+            gpu_error_message(gpu, run_file(L, initrd, "/bios.lua", "=bios.lua"));
+        }
     } else
         gpu_error_message(gpu, "missing initrd");
 
     printf("finished execution, halting\n");
+
+    if (profiling)
+        luaprof_dump();
     lua_close(L);
+    lua_heap_destroy(heap);
+
+    // anything still allocated now has leaked (only reported in builds with allocation tracking)
+    malloc_report();
 
     while (1)
         __asm__ __volatile__ ("cli; hlt");
@@ -0,0 +1,446 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "paging.h"
+#include "tlsf.h"
+#include "cpu.h"
+#include "io.h"
+
+/*
+ * all of memory is identity mapped with 4 MiB pages, which makes paging itself free of any cost but lets the kernel
+ * pick the memory type of each page with the PAT. RAM is mapped write-back and everything else uncached, and
+ * framebuffers are made write-combining so pixel stores get merged into bursts instead of each being a separate bus
+ * transaction. a 4 MiB page is split into 4 KiB pages wherever finer control is needed.
+ *
+ * CPUs without 4 MiB pages (486s) get 4 KiB pages instead, but only where there's something to map: whatever's in
+ * the memory map, the first 4 MiB and the framebuffer. a page table for every 4 MiB of the address space would take
+ * up 4 MiB of what's likely not much memory to begin with. without the PAT, a variable range MTRR is used to make
+ * the framebuffer write-combining instead, if there's one free and nothing already makes it uncached
+ */
+
+#define PAGE_PRESENT (1 << 0)
+#define PAGE_WRITABLE (1 << 1)
+#define PAGE_WRITE_THROUGH (1 << 3)
+#define PAGE_CACHE_DISABLE (1 << 4)
+#define PAGE_LARGE (1 << 7)
+
+#define LARGE_PAGE_SIZE (4 * 1024 * 1024)
+#define ENTRIES 1024
+
+// with the PAT programmed below, these pick write-back, write-combining and uncached memory
+#define PAGE_WB 0
+#define PAGE_WC PAGE_WRITE_THROUGH
+#define PAGE_UC (PAGE_WRITE_THROUGH | PAGE_CACHE_DISABLE)
+#define PAGE_TYPE_MASK (PAGE_WRITE_THROUGH | PAGE_CACHE_DISABLE)
+
+#define CR0_NW (1 << 29)
+#define CR0_CD (1 << 30)
+#define CR0_PG (1 << 31)
+#define CR4_PSE (1 << 4)
+
+#define IA32_MTRRCAP 0xfe
+#define IA32_PAT 0x277
+#define IA32_MTRR_DEF_TYPE 0x2ff
+#define IA32_MTRR_PHYSBASE(n) (0x200 + 2 * (n))
+#define IA32_MTRR_PHYSMASK(n) (0x201 + 2 * (n))
+
+#define MTRRCAP_VCNT 0xff
+#define MTRRCAP_WC (1 << 10)
+#define MTRR_ENABLE (1 << 11)
+#define MTRR_VALID (1 << 11)
+#define MTRR_TYPE_MASK 0xff
+#define MTRR_TYPE_UC 0
+#define MTRR_TYPE_WC 1
+
+// the power-on PAT (WB, WT, UC-, UC, repeated) with entry 1 changed from write-through to write-combining
+#define PAT_VALUE 0x0007040600070106ull
+
+static uint32_t page_directory[ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+static bool enabled = false;
+static bool large_pages = false;
+static uint32_t features = 0;
+static const struct multiboot_header *boot_header = NULL;
+
+static uint32_t read_cr0(void) {
+    uint32_t value;
+    __asm__ __volatile__ ("mov %%cr0, %0" : "=r" (value));
+    return value;
+}
+
+static void write_cr0(uint32_t value) {
+    __asm__ __volatile__ ("mov %0, %%cr0" : : "r" (value) : "memory");
+}
+
+static void write_cr3(uint32_t value) {
+    __asm__ __volatile__ ("mov %0, %%cr3" : : "r" (value) : "memory");
+}
+
+static uint32_t read_cr4(void) {
+    uint32_t value;
+    __asm__ __volatile__ ("mov %%cr4, %0" : "=r" (value));
+    return value;
+}
+
+static void write_cr4(uint32_t value) {
+    __asm__ __volatile__ ("mov %0, %%cr4" : : "r" (value) : "memory");
+}
+
+static void flush_tlb(void) {
+    if (enabled)
+        write_cr3((uint32_t) page_directory);
+}
+
+bool paging_enabled(void) {
+    return enabled;
+}
+
+// whether any part of a range is in the memory map, either as RAM or (if any_type is set) as anything else
+static bool in_memory_map(const struct multiboot_header *header, uint64_t start, uint64_t end, bool any_type) {
+    for (uint32_t i = 0; i + sizeof(uint32_t) <= header->mmap_length;) {
+        struct mmap_entry *mmap = header->mmap_addr + i;
+
+        if ((any_type || mmap->type == AVAILABLE_RAM) && mmap->base_addr < end && mmap->base_addr + mmap->length > start)
+            return true;
+
+        i += mmap->size + sizeof(uint32_t);
+    }
+
+    return false;
+}
+
+// whether any part of a range is in the framebuffer the bootloader set up, if it did
+static bool in_framebuffer(const struct multiboot_header *header, uint64_t start, uint64_t end) {
+    if (!(header->flags & (1 << 12)))
+        return false;
+
+    uint64_t framebuffer = (uintptr_t) header->framebuffer_addr;
+    uint64_t size = (uint64_t) header->framebuffer_pitch * header->framebuffer_height;
+
+    return framebuffer < end && framebuffer + size > start;
+}
+
+// makes a page table that identity maps the 4 MiB starting at base. returns NULL if there isn't enough memory
+static uint32_t *new_page_table(uint32_t base, uint32_t flags) {
+    uint32_t *table = memalign(PAGE_SIZE, PAGE_SIZE);
+
+    if (table == NULL)
+        return NULL;
+
+    for (int i = 0; i < ENTRIES; i ++)
+        table[i] = (base + i * PAGE_SIZE) | flags;
+
+    return table;
+}
+
+static void free_page_tables(void) {
+    for (int i = 0; i < ENTRIES; i ++) {
+        if ((page_directory[i] & PAGE_PRESENT) && !(page_directory[i] & PAGE_LARGE))
+            free((void *) (page_directory[i] & ~(PAGE_SIZE - 1)));
+
+        page_directory[i] = 0;
+    }
+}
+
+void paging_init(const struct multiboot_header *header) {
+    features = cpu_features();
+    boot_header = header;
+    large_pages = features & CPUID_FEAT_EDX_PSE;
+
+    for (uint32_t i = 0; i < ENTRIES; i ++) {
+        uint64_t start = (uint64_t) i * LARGE_PAGE_SIZE;
+        uint64_t end = start + LARGE_PAGE_SIZE;
+
+        // the first 4 MiB has the kernel in it as well as the legacy VGA and BIOS areas, the MTRRs take care of
+        // making the latter uncached
+        bool ram = i == 0 || in_memory_map(header, start, end, false);
+        uint32_t flags = PAGE_PRESENT | PAGE_WRITABLE | (ram ? PAGE_WB : PAGE_UC);
+
+        if (large_pages) {
+            page_directory[i] = (uint32_t) start | flags | PAGE_LARGE;
+        } else if (i == 0 || in_memory_map(header, start, end, true) || in_framebuffer(header, start, end)) {
+            uint32_t *table = new_page_table(start, flags);
+
+            if (table == NULL) {
+                printf("not enough memory for page tables, leaving paging off\n");
+                free_page_tables();
+                return;
+            }
+
+            page_directory[i] = (uint32_t) table | PAGE_PRESENT | PAGE_WRITABLE;
+        } else
+            page_directory[i] = 0;
+    }
+
+    if (features & CPUID_FEAT_EDX_PAT) {
+        __asm__ __volatile__ ("wbinvd");
+        wrmsr(IA32_PAT, PAT_VALUE);
+    }
+
+    write_cr3((uint32_t) page_directory);
+
+    // CPUs without 4 MiB pages might not have CR4 at all
+    if (large_pages)
+        write_cr4(read_cr4() | CR4_PSE);
+
+    write_cr0(read_cr0() | CR0_PG);
+    enabled = true;
+
+    printf("paging enabled with %s pages%s\n", large_pages ? "4 MiB" : "4 KiB", features & CPUID_FEAT_EDX_PAT ? " and PAT" : "");
+}
+
+/*
+ * returns the page table for the given directory entry, splitting a 4 MiB page up if needed. returns NULL if there
+ * isn't enough memory, or if nothing is mapped there at all
+ */
+static uint32_t *get_page_table(int index) {
+    uint32_t entry = page_directory[index];
+
+    if (!(entry & PAGE_PRESENT))
+        return NULL;
+
+    if (!(entry & PAGE_LARGE))
+        return (uint32_t *) (entry & ~(PAGE_SIZE - 1));
+
+    uint32_t *table = new_page_table(entry & ~(LARGE_PAGE_SIZE - 1), entry & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_TYPE_MASK));
+
+    if (table == NULL)
+        return NULL;
+
+    page_directory[index] = (uint32_t) table | PAGE_PRESENT | PAGE_WRITABLE;
+    return table;
+}
+
+// sets the memory type of the pages covering a range, with whole 4 MiB pages kept whole
+static void set_page_type(uintptr_t start, uintptr_t end, uint32_t type) {
+    start &= ~(PAGE_SIZE - 1);
+
+    while (start < end) {
+        int index = start / LARGE_PAGE_SIZE;
+
+        if (start % LARGE_PAGE_SIZE == 0 && end - start >= LARGE_PAGE_SIZE && (page_directory[index] & PAGE_LARGE)) {
+            page_directory[index] = (page_directory[index] & ~PAGE_TYPE_MASK) | type;
+            start += LARGE_PAGE_SIZE;
+        } else {
+            uint32_t *table = get_page_table(index);
+
+            if (table == NULL)
+                return;
+
+            uint32_t *entry = &table[(start / PAGE_SIZE) % ENTRIES];
+            *entry = (*entry & ~PAGE_TYPE_MASK) | type;
+            start += PAGE_SIZE;
+        }
+
+        // stop rather than wrapping around at the top of memory
+        if (start == 0)
+            break;
+    }
+
+    flush_tlb();
+}
+
+static int physical_address_bits(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000008)
+        return 36;
+
+    cpuid(0x80000008, &eax, &ebx, &ecx, &edx);
+    return eax & 0xff;
+}
+
+/*
+ * whether a variable range MTRR already makes any of a range uncached. where two ranges overlap uncached wins, so a
+ * write-combining one on top of it would do nothing. firmware sets masks up to cover contiguous ranges, so that's all
+ * that's looked for
+ */
+static bool mtrr_uncached(uint64_t start, uint64_t end, int count, uint64_t address_mask) {
+    for (int i = 0; i < count; i ++) {
+        uint64_t mask = rdmsr(IA32_MTRR_PHYSMASK(i));
+        uint64_t base = rdmsr(IA32_MTRR_PHYSBASE(i));
+
+        if (!(mask & MTRR_VALID) || (base & MTRR_TYPE_MASK) != MTRR_TYPE_UC)
+            continue;
+
+        mask &= address_mask & ~(uint64_t) (PAGE_SIZE - 1);
+        base &= mask;
+
+        uint64_t size = (~mask & address_mask) + 1;
+
+        if (base < end && base + size > start)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * covers as much of the start of a range as possible with write-combining variable range MTRRs. returns where the
+ * part that was covered ends, which is start if none of it could be
+ */
+static uintptr_t mtrr_write_combining(uintptr_t start, uintptr_t end) {
+    if (!(features & CPUID_FEAT_EDX_MTRR) || !(features & CPUID_FEAT_EDX_MSR))
+        return start;
+
+    uint64_t capabilities = rdmsr(IA32_MTRRCAP);
+
+    if (!(capabilities & MTRRCAP_WC))
+        return start;
+
+    uint64_t address_mask = (1ull << physical_address_bits()) - 1;
+    int count = capabilities & MTRRCAP_VCNT;
+
+    if (mtrr_uncached(start, end, count, address_mask)) {
+        printf("an uncached MTRR covers %08x - %08x, leaving it alone\n", start, end);
+        return start;
+    }
+
+    // the procedure for changing MTRRs: caches off and flushed, MTRRs off, change them, then back the other way
+    uint32_t flags = irq_save();
+    uint32_t cr0 = read_cr0();
+    write_cr0((cr0 | CR0_CD) & ~CR0_NW);
+    __asm__ __volatile__ ("wbinvd");
+    flush_tlb();
+
+    uint64_t def_type = rdmsr(IA32_MTRR_DEF_TYPE);
+    wrmsr(IA32_MTRR_DEF_TYPE, def_type & ~MTRR_ENABLE);
+
+    for (int i = 0; i < count && start < end; i ++) {
+        if (rdmsr(IA32_MTRR_PHYSMASK(i)) & MTRR_VALID)
+            continue;
+
+        // a range has to be a power of two in size and aligned to it, so take the largest that fits
+        uint32_t size = start == 0 ? 0x80000000 : start & -start;
+        while (size > end - start)
+            size >>= 1;
+
+        if (size < PAGE_SIZE)
+            break;
+
+        wrmsr(IA32_MTRR_PHYSBASE(i), start | MTRR_TYPE_WC);
+        wrmsr(IA32_MTRR_PHYSMASK(i), (~((uint64_t) size - 1) & address_mask) | MTRR_VALID);
+
+        start += size;
+    }
+
+    __asm__ __volatile__ ("wbinvd");
+    flush_tlb();
+    wrmsr(IA32_MTRR_DEF_TYPE, def_type);
+    write_cr0(cr0);
+    irq_restore(flags);
+
+    return start;
+}
+
+// makes a range of memory (usually a framebuffer) write-combining, if the CPU has a way of doing that
+void map_write_combining(void *start, size_t size) {
+    uintptr_t begin = (uintptr_t) start;
+    uintptr_t end = begin + size;
+
+    if (end < begin)
+        end = UINTPTR_MAX;
+
+    if (enabled && (features & CPUID_FEAT_EDX_PAT)) {
+        set_page_type(begin, end, PAGE_WC);
+        printf("mapped %08x - %08x write-combining\n", begin, end);
+        return;
+    }
+
+    // the uncached page type would win over the MTRR, so the pages it covers have to be made write-back for it to
+    // have any effect. with paging off, there are no page types to get in the way
+    uintptr_t aligned = begin & ~(PAGE_SIZE - 1);
+    uintptr_t covered = mtrr_write_combining(aligned, (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+
+    if (covered == aligned) {
+        printf("can't make %08x - %08x write-combining\n", begin, end);
+        return;
+    }
+
+    if (enabled)
+        set_page_type(aligned, covered, PAGE_WB);
+
+    printf("made %08x - %08x write-combining with MTRRs\n", aligned, covered);
+}
+
+// makes a page inaccessible, so touching it causes a page fault. returns false if paging is off or it failed
+bool unmap_page(void *page) {
+    if (!enabled)
+        return false;
+
+    uint32_t *table = get_page_table((uintptr_t) page / LARGE_PAGE_SIZE);
+
+    if (table == NULL)
+        return false;
+
+    table[((uintptr_t) page / PAGE_SIZE) % ENTRIES] &= ~PAGE_PRESENT;
+    flush_tlb();
+
+    return true;
+}
+
+// whether nothing is mapped at a page directory entry yet, so map_memory_at can put something there
+static bool unused_entry(uint32_t entry) {
+    // split up pages have had their memory type changed, which means there's a device there
+    if (large_pages)
+        return (entry & PAGE_LARGE) && (entry & PAGE_TYPE_MASK) == PAGE_UC;
+
+    // and without 4 MiB pages, only what's in use was mapped in the first place
+    return !(entry & PAGE_PRESENT);
+}
+
+/*
+ * backs a range of addresses that nothing physical lives at with newly allocated memory, so something can always
+ * be found at the same address no matter where in RAM it actually is. the range must be 4 MiB aligned and mustn't
+ * be anything in the memory map or have been touched since paging was set up. returns NULL if it can't be mapped
+ */
+void *map_memory_at(uintptr_t address, size_t size) {
+    if (!enabled || address % LARGE_PAGE_SIZE != 0 || size == 0 || size % LARGE_PAGE_SIZE != 0
+            || address + size - 1 < address)
+        return NULL;
+
+    if (in_memory_map(boot_header, address, (uint64_t) address + size, true))
+        return NULL;
+
+    int first = address / LARGE_PAGE_SIZE;
+    int count = size / LARGE_PAGE_SIZE;
+
+    for (int i = first; i < first + count; i ++)
+        if (!unused_entry(page_directory[i]))
+            return NULL;
+
+    uint8_t *memory = memalign(large_pages ? LARGE_PAGE_SIZE : PAGE_SIZE, size);
+
+    if (memory == NULL)
+        return NULL;
+
+    for (int i = 0; i < count; i ++) {
+        uint32_t base = (uint32_t) memory + i * LARGE_PAGE_SIZE;
+
+        if (large_pages) {
+            page_directory[first + i] = base | PAGE_PRESENT | PAGE_WRITABLE | PAGE_LARGE | PAGE_WB;
+            continue;
+        }
+
+        uint32_t *table = new_page_table(base, PAGE_PRESENT | PAGE_WRITABLE | PAGE_WB);
+
+        if (table == NULL) {
+            while (i -- > 0) {
+                free((void *) (page_directory[first + i] & ~(PAGE_SIZE - 1)));
+                page_directory[first + i] = 0;
+            }
+
+            flush_tlb();
+            free(memory);
+            return NULL;
+        }
+
+        page_directory[first + i] = (uint32_t) table | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+
+    flush_tlb();
+
+    return (void *) address;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "multiboot.h"
+
+#define PAGE_SIZE 4096
+
+void paging_init(const struct multiboot_header *header);
+bool paging_enabled(void);
+void map_write_combining(void *start, size_t size);
+bool unmap_page(void *page);
+void *map_memory_at(uintptr_t address, size_t size);
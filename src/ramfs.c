@@ -0,0 +1,542 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ramfs.h"
+#include "rtc.h"
+
+/*
+ * a filesystem kept entirely in memory, for the tmpfs component.
+ *
+ * every node other than the root is in a hash table keyed by its parent and its name, so finding a path is one
+ * lookup per component however big the directories get, and each directory also keeps its children in a list for
+ * listing them. a file's data is a chain of extents that each hold twice as much as all the ones before them, up to
+ * RAMFS_EXTENT_MAX, so appending never has to move what's already been written. every extent is full apart from the
+ * ones at the end, which is what lets a position be found by adding up capacities
+ *
+ * the space a filesystem has is what its nodes and extents take up, and anything that would go over it fails
+ * without changing anything
+ */
+
+#define INITIAL_BUCKETS 64
+
+static uint32_t hash_name(const struct ramfs_node *parent, const char *name, size_t length) {
+    uint32_t hash = (2166136261u ^ (uint32_t) (uintptr_t) parent) * 16777619u;
+
+    for (size_t i = 0; i < length; i ++)
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+
+    return hash;
+}
+
+static size_t node_cost(size_t name_length) {
+    return sizeof(struct ramfs_node) + name_length + 1;
+}
+
+static bool charge(struct ramfs *fs, size_t size) {
+    if (size > fs->capacity - fs->used)
+        return false;
+
+    fs->used += size;
+    return true;
+}
+
+struct ramfs *ramfs_create(size_t capacity) {
+    struct ramfs *fs = malloc(sizeof(struct ramfs));
+
+    if (fs == NULL)
+        return NULL;
+
+    fs->buckets = calloc(INITIAL_BUCKETS, sizeof(struct ramfs_node *));
+
+    if (fs->buckets == NULL) {
+        free(fs);
+        return NULL;
+    }
+
+    fs->root = (struct ramfs_node) {
+        .name = (char *) "",
+        .name_length = 0,
+        .directory = true,
+        .mtime = get_time()
+    };
+
+    fs->bucket_count = INITIAL_BUCKETS;
+    fs->node_count = 0;
+    fs->capacity = capacity;
+    fs->used = 0;
+
+    return fs;
+}
+
+// doubles the number of buckets. if there isn't the memory for that, the chains just get longer
+static void grow_buckets(struct ramfs *fs) {
+    size_t new_count = fs->bucket_count * 2;
+    struct ramfs_node **buckets = calloc(new_count, sizeof(struct ramfs_node *));
+
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < fs->bucket_count; i ++) {
+        struct ramfs_node *node = fs->buckets[i];
+
+        while (node != NULL) {
+            struct ramfs_node *next = node->hash_next;
+            size_t bucket = node->hash & (new_count - 1);
+
+            node->hash_next = buckets[bucket];
+            buckets[bucket] = node;
+            node = next;
+        }
+    }
+
+    free(fs->buckets);
+    fs->buckets = buckets;
+    fs->bucket_count = new_count;
+}
+
+struct ramfs_node *ramfs_find_child(struct ramfs *fs, struct ramfs_node *parent, const char *name, size_t length) {
+    uint32_t hash = hash_name(parent, name, length);
+
+    for (struct ramfs_node *node = fs->buckets[hash & (fs->bucket_count - 1)]; node != NULL; node = node->hash_next)
+        if (node->hash == hash && node->parent == parent && node->name_length == length && !memcmp(node->name, name, length))
+            return node;
+
+    return NULL;
+}
+
+// puts a node at the end of a directory and in the hash table, under the name it already has
+static void link_node(struct ramfs *fs, struct ramfs_node *parent, struct ramfs_node *node) {
+    node->parent = parent;
+    node->next_sibling = NULL;
+    node->prev_sibling = parent->last_child;
+
+    if (parent->last_child != NULL)
+        parent->last_child->next_sibling = node;
+    else
+        parent->first_child = node;
+
+    parent->last_child = node;
+    parent->child_count ++;
+    parent->mtime = get_time();
+
+    node->hash = hash_name(parent, node->name, node->name_length);
+    size_t bucket = node->hash & (fs->bucket_count - 1);
+    node->hash_next = fs->buckets[bucket];
+    fs->buckets[bucket] = node;
+
+    if (++ fs->node_count > fs->bucket_count)
+        grow_buckets(fs);
+}
+
+static void unlink_node(struct ramfs *fs, struct ramfs_node *node) {
+    struct ramfs_node *parent = node->parent;
+
+    if (node->prev_sibling != NULL)
+        node->prev_sibling->next_sibling = node->next_sibling;
+    else
+        parent->first_child = node->next_sibling;
+
+    if (node->next_sibling != NULL)
+        node->next_sibling->prev_sibling = node->prev_sibling;
+    else
+        parent->last_child = node->prev_sibling;
+
+    parent->child_count --;
+    parent->mtime = get_time();
+
+    struct ramfs_node **link = &fs->buckets[node->hash & (fs->bucket_count - 1)];
+
+    while (*link != node)
+        link = &(*link)->hash_next;
+
+    *link = node->hash_next;
+    fs->node_count --;
+}
+
+// frees extents from the given one on
+static void free_extents(struct ramfs *fs, struct ramfs_node *node, struct ramfs_extent *extent) {
+    while (extent != NULL) {
+        struct ramfs_extent *next = extent->next;
+
+        fs->used -= sizeof(struct ramfs_extent) + extent->capacity;
+        node->allocated -= extent->capacity;
+        free(extent);
+
+        extent = next;
+    }
+}
+
+static void free_node(struct ramfs *fs, struct ramfs_node *node) {
+    free_extents(fs, node, node->first_extent);
+    fs->used -= node_cost(node->name_length);
+
+    free(node->name);
+    free(node);
+}
+
+// splits the next component off a path, skipping slashes and "." components. returns NULL once there are none left
+const char *ramfs_next_component(const char **path, size_t *length) {
+    const char *p = *path;
+
+    for (;;) {
+        while (*p == '/')
+            p ++;
+
+        if (*p == 0) {
+            *path = p;
+            return NULL;
+        }
+
+        const char *start = p;
+
+        while (*p != 0 && *p != '/')
+            p ++;
+
+        if (p - start == 1 && *start == '.')
+            continue;
+
+        *path = p;
+        *length = p - start;
+        return start;
+    }
+}
+
+static bool is_dot_dot(const char *name, size_t length) {
+    return length == 2 && name[0] == '.' && name[1] == '.';
+}
+
+static struct ramfs_node *step(struct ramfs *fs, struct ramfs_node *node, const char *name, size_t length) {
+    if (!node->directory)
+        return NULL;
+
+    if (is_dot_dot(name, length))
+        return node->parent != NULL ? node->parent : node;
+
+    return ramfs_find_child(fs, node, name, length);
+}
+
+struct ramfs_node *ramfs_lookup(struct ramfs *fs, const char *path) {
+    struct ramfs_node *node = &fs->root;
+    const char *name;
+    size_t length;
+
+    while (node != NULL && (name = ramfs_next_component(&path, &length)) != NULL)
+        node = step(fs, node, name, length);
+
+    return node;
+}
+
+/*
+ * finds the directory the last component of a path would be in, and where that component is. returns NULL if there
+ * isn't one, or if the path is the root or ends in ".."
+ */
+struct ramfs_node *ramfs_lookup_parent(struct ramfs *fs, const char *path, const char **name, size_t *name_length) {
+    struct ramfs_node *node = &fs->root;
+    const char *component = ramfs_next_component(&path, name_length);
+
+    if (component == NULL)
+        return NULL;
+
+    const char *next;
+    size_t next_length;
+
+    while ((next = ramfs_next_component(&path, &next_length)) != NULL) {
+        node = step(fs, node, component, *name_length);
+
+        if (node == NULL)
+            return NULL;
+
+        component = next;
+        *name_length = next_length;
+    }
+
+    if (!node->directory || is_dot_dot(component, *name_length))
+        return NULL;
+
+    *name = component;
+    return node;
+}
+
+// adds an empty file or directory that isn't there already, returns NULL if there's no space or memory for it
+struct ramfs_node *ramfs_add(struct ramfs *fs, struct ramfs_node *parent, const char *name, size_t length, bool directory) {
+    if (!charge(fs, node_cost(length)))
+        return NULL;
+
+    struct ramfs_node *node = malloc(sizeof(struct ramfs_node));
+    char *node_name = malloc(length + 1);
+
+    if (node == NULL || node_name == NULL) {
+        free(node);
+        free(node_name);
+        fs->used -= node_cost(length);
+        return NULL;
+    }
+
+    memcpy(node_name, name, length);
+    node_name[length] = 0;
+
+    *node = (struct ramfs_node) {
+        .name = node_name,
+        .name_length = length,
+        .directory = directory,
+        .mtime = get_time()
+    };
+
+    link_node(fs, parent, node);
+    return node;
+}
+
+// makes a directory and any of its parents that are missing, returns whether it's there now
+bool ramfs_make_directory(struct ramfs *fs, const char *path) {
+    struct ramfs_node *node = &fs->root;
+    const char *name;
+    size_t length;
+
+    while ((name = ramfs_next_component(&path, &length)) != NULL) {
+        struct ramfs_node *next = step(fs, node, name, length);
+
+        if (next == NULL && node->directory)
+            next = ramfs_add(fs, node, name, length, true);
+
+        if (next == NULL)
+            return false;
+
+        node = next;
+    }
+
+    return node->directory;
+}
+
+/*
+ * removes a file, or a directory and everything in it. files that are still open are only taken out of the tree,
+ * and freed when they're closed
+ */
+void ramfs_remove(struct ramfs *fs, struct ramfs_node *node) {
+    struct ramfs_node *current = node;
+
+    for (;;) {
+        while (current->first_child != NULL)
+            current = current->first_child;
+
+        struct ramfs_node *parent = current->parent;
+        bool last = current == node;
+
+        unlink_node(fs, current);
+
+        if (current->open_count > 0)
+            current->unlinked = true;
+        else
+            free_node(fs, current);
+
+        if (last)
+            return;
+
+        current = parent;
+    }
+}
+
+// moves a node to a new name, which mustn't exist yet, in a directory that mustn't be inside it
+bool ramfs_move(struct ramfs *fs, struct ramfs_node *node, struct ramfs_node *parent, const char *name, size_t length) {
+    if (node == &fs->root || !parent->directory || ramfs_find_child(fs, parent, name, length) != NULL)
+        return false;
+
+    for (struct ramfs_node *ancestor = parent; ancestor != NULL; ancestor = ancestor->parent)
+        if (ancestor == node)
+            return false;
+
+    size_t old_cost = node_cost(node->name_length);
+    size_t new_cost = node_cost(length);
+
+    if (new_cost > old_cost && !charge(fs, new_cost - old_cost))
+        return false;
+
+    char *new_name = malloc(length + 1);
+
+    if (new_name == NULL) {
+        if (new_cost > old_cost)
+            fs->used -= new_cost - old_cost;
+
+        return false;
+    }
+
+    if (new_cost < old_cost)
+        fs->used -= old_cost - new_cost;
+
+    memcpy(new_name, name, length);
+    new_name[length] = 0;
+
+    unlink_node(fs, node);
+    free(node->name);
+    node->name = new_name;
+    node->name_length = length;
+    link_node(fs, parent, node);
+
+    return true;
+}
+
+void ramfs_open(struct ramfs_node *node) {
+    node->open_count ++;
+}
+
+void ramfs_close(struct ramfs *fs, struct ramfs_node *node) {
+    if (-- node->open_count == 0 && node->unlinked)
+        free_node(fs, node);
+}
+
+void ramfs_truncate(struct ramfs *fs, struct ramfs_node *node) {
+    free_extents(fs, node, node->first_extent);
+
+    node->first_extent = NULL;
+    node->last_extent = NULL;
+    node->size = 0;
+    node->truncations ++;
+    node->mtime = get_time();
+}
+
+// adds extents to a file until they can hold the given size, returns false and leaves it as it was if they can't
+static bool reserve(struct ramfs *fs, struct ramfs_node *node, size_t size) {
+    struct ramfs_extent *last = node->last_extent;
+
+    while (node->allocated < size) {
+        size_t needed = size - node->allocated;
+        size_t capacity = node->allocated < RAMFS_EXTENT_MIN ? RAMFS_EXTENT_MIN : node->allocated;
+
+        if (capacity > RAMFS_EXTENT_MAX)
+            capacity = RAMFS_EXTENT_MAX;
+
+        // close to the limit, halve the extent until it fits, but no further than what's going to be used. each one
+        // still takes at least half of what's left, so a file growing a little at a time there doesn't end up in
+        // lots of tiny extents
+        while (capacity > needed && sizeof(struct ramfs_extent) + capacity > fs->capacity - fs->used)
+            capacity = capacity / 2 > needed ? capacity / 2 : needed;
+
+        struct ramfs_extent *extent = NULL;
+
+        if (charge(fs, sizeof(struct ramfs_extent) + capacity)) {
+            extent = malloc(sizeof(struct ramfs_extent) + capacity);
+
+            if (extent == NULL)
+                fs->used -= sizeof(struct ramfs_extent) + capacity;
+        }
+
+        if (extent == NULL) {
+            free_extents(fs, node, last != NULL ? last->next : node->first_extent);
+
+            if (last != NULL)
+                last->next = NULL;
+            else
+                node->first_extent = NULL;
+
+            node->last_extent = last;
+            return false;
+        }
+
+        extent->next = NULL;
+        extent->capacity = capacity;
+        extent->used = 0;
+
+        if (node->last_extent != NULL)
+            node->last_extent->next = extent;
+        else
+            node->first_extent = extent;
+
+        node->last_extent = extent;
+        node->allocated += capacity;
+    }
+
+    return true;
+}
+
+// moves a cursor to the extent a position is in, returns NULL if that's past the end of what's allocated
+static struct ramfs_extent *seek_extent(struct ramfs_node *node, struct ramfs_cursor *cursor, size_t position) {
+    if (cursor->extent == NULL || cursor->truncations != node->truncations || position < cursor->offset) {
+        cursor->extent = node->first_extent;
+        cursor->offset = 0;
+        cursor->truncations = node->truncations;
+
+        if (cursor->extent == NULL)
+            return NULL;
+    }
+
+    // the cursor stays on the last extent rather than running off the end, so it's still useful once more are added
+    while (position >= cursor->offset + cursor->extent->capacity && cursor->extent->next != NULL) {
+        cursor->offset += cursor->extent->capacity;
+        cursor->extent = cursor->extent->next;
+    }
+
+    return position < cursor->offset + cursor->extent->capacity ? cursor->extent : NULL;
+}
+
+// returns the data at a position in a file, and how much of it there is before the next extent. NULL at the end
+const char *ramfs_span(struct ramfs_node *node, struct ramfs_cursor *cursor, size_t position, size_t *length) {
+    if (position >= node->size)
+        return NULL;
+
+    struct ramfs_extent *extent = seek_extent(node, cursor, position);
+    size_t offset = position - cursor->offset;
+
+    *length = extent->used - offset;
+    return extent->data + offset;
+}
+
+// copies data out of a file, which must have at least that much from the position on
+void ramfs_read(struct ramfs_node *node, struct ramfs_cursor *cursor, size_t position, char *out, size_t count) {
+    size_t length;
+
+    for (size_t copied = 0; copied < count; copied += length) {
+        const char *span = ramfs_span(node, cursor, position + copied, &length);
+
+        if (length > count - copied)
+            length = count - copied;
+
+        memcpy(out + copied, span, length);
+    }
+}
+
+// copies data (or zeros, if it's NULL) into space that's already been reserved, no further on than the end of the file
+static void fill(struct ramfs_node *node, struct ramfs_cursor *cursor, size_t position, const char *data, size_t length) {
+    while (length > 0) {
+        struct ramfs_extent *extent = seek_extent(node, cursor, position);
+        size_t offset = position - cursor->offset;
+        size_t count = extent->capacity - offset < length ? extent->capacity - offset : length;
+
+        if (data != NULL) {
+            memcpy(extent->data + offset, data, count);
+            data += count;
+        } else {
+            memset(extent->data + offset, 0, count);
+        }
+
+        if (offset + count > extent->used) {
+            node->size += offset + count - extent->used;
+            extent->used = offset + count;
+        }
+
+        position += count;
+        length -= count;
+    }
+}
+
+/*
+ * writes data to a file at a position, which can be past its end, in which case the gap is filled with zeros.
+ * returns false without changing anything if there isn't the space for it
+ */
+bool ramfs_write(struct ramfs *fs, struct ramfs_node *node, struct ramfs_cursor *cursor, size_t position, const char *data, size_t length) {
+    if (position > SIZE_MAX - length)
+        return false;
+
+    size_t end = position + length;
+
+    if (end > node->size && !reserve(fs, node, end))
+        return false;
+
+    if (position > node->size)
+        fill(node, cursor, node->size, NULL, position - node->size);
+
+    fill(node, cursor, position, data, length);
+    node->mtime = get_time();
+
+    return true;
+}
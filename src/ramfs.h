@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* file data is kept in extents that start at RAMFS_EXTENT_MIN bytes and double up to RAMFS_EXTENT_MAX */
+#define RAMFS_EXTENT_MIN 256
+#define RAMFS_EXTENT_MAX (64 * 1024)
+
+struct ramfs_extent {
+    struct ramfs_extent *next;
+    size_t capacity;
+    size_t used;
+    char data[];
+};
+
+struct ramfs_node {
+    char *name;
+    size_t name_length;
+    bool directory;
+    uint64_t mtime;
+
+    struct ramfs_node *parent;
+    struct ramfs_node *first_child;
+    struct ramfs_node *last_child;
+    struct ramfs_node *next_sibling;
+    struct ramfs_node *prev_sibling;
+    size_t child_count;
+
+    // the next node in the same hash bucket, and the hash that put it there
+    struct ramfs_node *hash_next;
+    uint32_t hash;
+
+    // files only
+    struct ramfs_extent *first_extent;
+    struct ramfs_extent *last_extent;
+    size_t size;
+    size_t allocated;
+
+    // goes up whenever the file is truncated, so cursors into it know to start again
+    uint32_t truncations;
+
+    // only used by overlays: a whiteout is a file standing in for something removed from the layer underneath, and
+    // an opaque directory hides whatever's in the directory of the same name underneath
+    bool whiteout;
+    bool opaque;
+
+    // a node that's removed while it's open hangs around, unlinked, until it's closed for the last time
+    int open_count;
+    bool unlinked;
+};
+
+/* where a handle last was in a file, so reading or writing through it doesn't walk every extent before that */
+struct ramfs_cursor {
+    struct ramfs_extent *extent;
+    size_t offset;
+    uint32_t truncations;
+};
+
+#define RAMFS_CURSOR_INIT ((struct ramfs_cursor) {.extent = NULL, .offset = 0, .truncations = 0})
+
+struct ramfs {
+    struct ramfs_node root;
+
+    // every node other than the root, hashed by its parent and name
+    struct ramfs_node **buckets;
+    size_t bucket_count;
+    size_t node_count;
+
+    // in bytes, counting what the nodes and extents take up
+    size_t capacity;
+    size_t used;
+};
+
+struct ramfs *ramfs_create(size_t capacity);
+const char *ramfs_next_component(const char **path, size_t *length);
+struct ramfs_node *ramfs_find_child(struct ramfs *fs, struct ramfs_node *parent, const char *name, size_t length);
+struct ramfs_node *ramfs_lookup(struct ramfs *fs, const char *path);
+struct ramfs_node *ramfs_lookup_parent(struct ramfs *fs, const char *path, const char **name, size_t *name_length);
+struct ramfs_node *ramfs_add(struct ramfs *fs, struct ramfs_node *parent, const char *name, size_t length, bool directory);
+bool ramfs_make_directory(struct ramfs *fs, const char *path);
+void ramfs_remove(struct ramfs *fs, struct ramfs_node *node);
+bool ramfs_move(struct ramfs *fs, struct ramfs_node *node, struct ramfs_node *parent, const char *name, size_t length);
+void ramfs_open(struct ramfs_node *node);
+void ramfs_close(struct ramfs *fs, struct ramfs_node *node);
+void ramfs_truncate(struct ramfs *fs, struct ramfs_node *node);
+const char *ramfs_span(struct ramfs_node *node, struct ramfs_cursor *cursor, size_t position, size_t *length);
+void ramfs_read(struct ramfs_node *node, struct ramfs_cursor *cursor, size_t position, char *out, size_t count);
+bool ramfs_write(struct ramfs *fs, struct ramfs_node *node, struct ramfs_cursor *cursor, size_t position, const char *data, size_t length);
@@ -1,48 +1,52 @@
 #include <stdbool.h>
+#include <string.h>
 #include <time.h>
 #include "rtc.h"
 #include "io.h"
+#include "clock.h"
+
+#define RTC_STATUS_A 0x0a
+#define RTC_STATUS_B 0x0b
+#define RTC_STATUS_C 0x0c
+
+// set in status register A while the RTC is updating its time registers
+#define RTC_UPDATE_IN_PROGRESS (1 << 7)
 
 static bool is_24h = false;
 static bool is_bcd = false;
-volatile uint16_t jiffies_frac = 0;
-volatile uint64_t epoch_time = 0;
-volatile uint64_t uptime = 0;
+
+// the wall clock time read from the RTC at boot, and the value of the monotonic clock when it was read
+static uint64_t boot_epoch = 0;
+static uint64_t boot_epoch_ns = 0;
 
 void rtc_init(void) {
-    outb(0x70, 0x0c);
+    outb(0x70, RTC_STATUS_C);
     inb(0x71);
 
-    uint8_t status_b = rtc_read(0x0b);
-    is_24h = !(status_b >> 1);
-    is_bcd = !(status_b >> 2);
+    uint8_t status_b = rtc_read(RTC_STATUS_B);
+    is_24h = status_b & (1 << 1);
+    is_bcd = !(status_b & (1 << 2));
 
-    get_time();
+    // the wall clock is only read once, after this it's kept by the monotonic clock
+    boot_epoch = read_time();
+    boot_epoch_ns = clock_ns();
 
-    /* https://wiki.osdev.org/RTC */
-    __asm__ __volatile__ ("cli");
-    outb(0x70, 0x8b);           // select register B, and disable NMI
-    char prev = inb(0x71);      // read the current value of register B
-    outb(0x70, 0x8b);           // set the index again (a read will reset the index to register D)
-    outb(0x71, prev | 0x40);    // write the previous value ORed with 0x40. This turns on bit 6 of register B
-    __asm__ __volatile__ ("sti");
+    // the periodic interrupt isn't enabled, timers are driven by the clock event device instead
 }
 
 uint8_t rtc_read(uint8_t index) {
-    __asm__ __volatile__ ("cli");
+    uint32_t flags = irq_save();
     outb(0x70, index);
-    for (int i = 0; i < 1048576; i++);
     uint8_t value = inb(0x71);
-    __asm__ __volatile__ ("sti");
+    irq_restore(flags);
     return value;
 }
 
 void rtc_write(uint8_t index, uint8_t value) {
-    __asm__ __volatile__ ("cli");
+    uint32_t flags = irq_save();
     outb(0x70, index);
-    for (int i = 0; i < 1048576; i++);
     outb(0x71, value);
-    __asm__ __volatile__ ("sti");
+    irq_restore(flags);
 }
 
 uint8_t convert_bcd(uint8_t value) {
@@ -90,19 +94,45 @@ time_t mktime(struct tm *date) {
     return time;
 }
 
-static uint64_t get_time_unchecked(void) {
+// the registers that make up the current date and time
+static const uint8_t time_registers[] = { 0x00, 0x02, 0x04, 0x07, 0x08, 0x09 };
+#define TIME_REGISTERS (sizeof(time_registers) / sizeof(time_registers[0]))
+
+static void read_time_registers(uint8_t *values) {
+    // the registers are only consistent while no update is in progress. an update takes under 2 ms and is
+    // flagged 244 us in advance, so as long as the flag is clear the registers can be read right away
+    while (rtc_read(RTC_STATUS_A) & RTC_UPDATE_IN_PROGRESS);
+
+    for (int i = 0; i < TIME_REGISTERS; i++)
+        values[i] = rtc_read(time_registers[i]);
+}
+
+uint64_t read_time(void) {
+    uint8_t values[TIME_REGISTERS], check[TIME_REGISTERS];
+
+    // read until the same values come back twice in a row, in case an update started partway through
+    read_time_registers(values);
+    while (1) {
+        read_time_registers(check);
+
+        if (!memcmp(values, check, TIME_REGISTERS))
+            break;
+
+        memcpy(values, check, TIME_REGISTERS);
+    }
+
     struct tm date = {
-        .tm_sec = convert_bcd(rtc_read(0x00)),
-        .tm_min = convert_bcd(rtc_read(0x02)),
-        .tm_mday = convert_bcd(rtc_read(0x07)),
-        .tm_mon = convert_bcd(rtc_read(0x08)) - 1,
-        .tm_year = convert_bcd(rtc_read(0x09)) + 100,
+        .tm_sec = convert_bcd(values[0]),
+        .tm_min = convert_bcd(values[1]),
+        .tm_mday = convert_bcd(values[3]),
+        .tm_mon = convert_bcd(values[4]) - 1,
+        .tm_year = convert_bcd(values[5]) + 100,
     };
 
     if (is_24h)
-        date.tm_hour = convert_bcd(rtc_read(0x04));
+        date.tm_hour = convert_bcd(values[2]);
     else {
-        uint8_t hours = rtc_read(0x04);
+        uint8_t hours = values[2];
 
         if (hours & 0x80) // PM
             date.tm_hour = (convert_bcd(hours & ~0x80) % 12) + 12;
@@ -110,30 +140,15 @@ static uint64_t get_time_unchecked(void) {
             date.tm_hour = convert_bcd(hours) % 12;
     }
 
-    return epoch_time = mktime(&date);
+    return mktime(&date);
 }
 
+// returns the current wall clock time as seconds since the unix epoch
 uint64_t get_time(void) {
-    while (1) {
-        while (rtc_read(0x0b) & (1 << 7));
-        uint64_t time_a = get_time_unchecked();
-        while (rtc_read(0x0b) & (1 << 7));
-        uint64_t time_b = get_time_unchecked();
-
-        if (time_a == time_b)
-            return epoch_time = time_a;
-    }
+    return boot_epoch + (clock_ns() - boot_epoch_ns) / NS_PER_SEC;
 }
 
 void timer_tick(void) {
-    jiffies_frac++;
-
-    if (jiffies_frac > 1024) {
-        jiffies_frac = 0;
-        epoch_time++;
-        uptime++;
-    }
-
-    outb(0x70, 0x0c);
+    outb(0x70, RTC_STATUS_C);
     inb(0x71);
 }
@@ -0,0 +1,279 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <lua.h>
+#include "snapshot.h"
+#include "luaheap.h"
+#include "tlsf.h"
+#include "paging.h"
+#include "cmdline.h"
+#include "api/component.h"
+
+/*
+ * snapshots of the whole Lua heap, so a machine can skip straight to the point where bios.lua asked for one with
+ * computer.snapshot() instead of running everything up to it again.
+ *
+ * booting with snapshot=dump puts the Lua heap in a region of its own (see lua_heap_create_in) that's always mapped
+ * at SNAPSHOT_ARENA_BASE, whatever physical memory ends up behind it. when a snapshot is asked for, the main thread
+ * yields back to kmain, so no C frames are left holding on to anything, and the used part of the region is written
+ * to the serial port as hex between "snapshot begin" and "snapshot end" lines. to turn a log of that into a file:
+ *
+ *     sed -n '/^snapshot begin/,/^snapshot end/{//!p}' serial.log | xxd -r -p > lua.snapshot
+ *
+ * then put it in the initrd as lua.snapshot. on the next boot the image is copied back to the same virtual address,
+ * so every pointer inside it is still right and nothing has to be relocated. pointers out of it are the problem:
+ * C functions are fine as long as it's the exact same kernel, which the header checks. components and their methods
+ * are referred to by number rather than by pointer (see component.c), and the addresses they had when the snapshot
+ * was taken are given back to them, since Lua has them stashed all over the place.
+ *
+ * what isn't saved: open file handles, pending timers and signals (computer.snapshot refuses or drops them), what's
+ * in the tmpfs or written over the initrd, and anything on the screen. booting with snapshot=off ignores a snapshot
+ * in the initrd
+ */
+
+#define SNAPSHOT_MAGIC 0x50534e4c // "LNSP"
+#define SNAPSHOT_VERSION 1
+
+#define LARGE_PAGE_SIZE (4 * 1024 * 1024)
+#define BYTES_PER_LINE 32
+
+#define COMPONENT_NAME_SIZE 16
+#define COMPONENT_ADDRESS_SIZE 40
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t kernel_hash;
+
+    // the region the heap lives in, and how much of it the image covers
+    uint32_t arena_base;
+    uint32_t arena_size;
+    uint32_t image_size;
+    uint32_t image_hash;
+
+    lua_State *state;
+    struct lua_heap *heap;
+
+    // followed by this many struct snapshot_component, then the image
+    uint32_t component_count;
+};
+
+struct snapshot_component {
+    char name[COMPONENT_NAME_SIZE];
+    char address[COMPONENT_ADDRESS_SIZE];
+};
+
+// the kernel's code and read-only data, see kernel.ld
+extern uint8_t kernel_code_start;
+extern uint8_t kernel_code_end;
+
+static bool requested = false;
+
+// how much of the window at SNAPSHOT_ARENA_BASE is mapped
+static size_t arena_size = 0;
+
+// FNV-1a
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < size; i ++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    return hash;
+}
+
+static uint32_t kernel_hash(void) {
+    return hash_bytes(2166136261u, &kernel_code_start, &kernel_code_end - &kernel_code_start);
+}
+
+static bool snapshot_option(const char *value) {
+    size_t length;
+    const char *option = cmdline_get("snapshot", &length);
+
+    return option != NULL && length == strlen(value) && !strncmp(option, value, length);
+}
+
+// whether the machine was booted with snapshot=dump, meaning the Lua heap should be made so it can be snapshotted
+bool snapshot_dumping(void) {
+    return snapshot_option("dump");
+}
+
+// whether a snapshot in the initrd should be used, which it is unless the machine is making one or was told not to
+bool snapshot_restoring(void) {
+    return !snapshot_dumping() && !snapshot_option("off");
+}
+
+// makes a Lua heap that lives in the snapshot region, returns NULL if the region can't be mapped
+struct lua_heap *snapshot_create_heap(size_t size) {
+    size = (size + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+
+    if (size == 0 || size > SNAPSHOT_ARENA_MAX)
+        size = SNAPSHOT_ARENA_DEFAULT;
+
+    void *arena = map_memory_at(SNAPSHOT_ARENA_BASE, size);
+
+    if (arena == NULL)
+        return NULL;
+
+    arena_size = size;
+    return lua_heap_create_in(arena, size);
+}
+
+// whether a state using this heap can be snapshotted
+bool snapshot_available(const struct lua_heap *heap) {
+    return snapshot_dumping() && heap->arena != NULL && (uintptr_t) heap->arena == SNAPSHOT_ARENA_BASE;
+}
+
+// has the next yield of the main thread save a snapshot, call this right before yielding
+void snapshot_request(void) {
+    requested = true;
+}
+
+// returns whether a snapshot was asked for since this was last called
+bool snapshot_requested(void) {
+    bool was_requested = requested;
+    requested = false;
+
+    return was_requested;
+}
+
+static void dump_hex(const void *data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    const uint8_t *bytes = data;
+    char line[BYTES_PER_LINE * 2 + 1];
+
+    while (size > 0) {
+        size_t count = size < BYTES_PER_LINE ? size : BYTES_PER_LINE;
+
+        for (size_t i = 0; i < count; i ++) {
+            line[i * 2] = digits[bytes[i] >> 4];
+            line[i * 2 + 1] = digits[bytes[i] & 15];
+        }
+
+        line[count * 2] = 0;
+        printf("%s\n", line);
+
+        bytes += count;
+        size -= count;
+    }
+}
+
+/*
+ * writes a snapshot of a suspended main thread's heap to the serial port. pushes what computer.snapshot() returns
+ * in the machine carrying on after it, which is false, and returns how many values that was
+ */
+int snapshot_save(lua_State *L) {
+    void *ud;
+    lua_getallocf(L, &ud);
+    struct lua_heap *heap = ud;
+
+    struct snapshot_header header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .kernel_hash = kernel_hash(),
+        .arena_base = SNAPSHOT_ARENA_BASE,
+        .arena_size = arena_size,
+        .image_size = tlsf_image_size(heap->arena),
+        .state = L,
+        .heap = heap,
+        .component_count = 0
+    };
+
+    header.image_hash = hash_bytes(2166136261u, (void *) SNAPSHOT_ARENA_BASE, header.image_size);
+
+    for (struct component *component = get_components(); component != NULL; component = component->next)
+        header.component_count ++;
+
+    size_t total = sizeof(header) + header.component_count * sizeof(struct snapshot_component) + header.image_size;
+    printf("snapshot begin %d\n", total);
+
+    dump_hex(&header, sizeof(header));
+
+    for (struct component *component = get_components(); component != NULL; component = component->next) {
+        struct snapshot_component saved;
+        memset(&saved, 0, sizeof(saved));
+        strncpy(saved.name, component->name, COMPONENT_NAME_SIZE - 1);
+        strncpy(saved.address, component->address, COMPONENT_ADDRESS_SIZE - 1);
+        dump_hex(&saved, sizeof(saved));
+    }
+
+    dump_hex((void *) SNAPSHOT_ARENA_BASE, header.image_size);
+    printf("snapshot end\n");
+
+    lua_pushboolean(L, false);
+    return 1;
+}
+
+static lua_State *restore_failed(const char *reason) {
+    printf("not using Lua snapshot: %s\n", reason);
+    return NULL;
+}
+
+/*
+ * loads a snapshot made by snapshot_save, returns the main thread of the state in it, which carries on from the
+ * yield in computer.snapshot() once it's resumed. components must all have been added already. returns NULL if the
+ * snapshot can't be used, in which case nothing has changed
+ */
+lua_State *snapshot_restore(const char *data, size_t size) {
+    struct snapshot_header header;
+
+    if (size < sizeof(header))
+        return restore_failed("truncated");
+
+    memcpy(&header, data, sizeof(header));
+
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION)
+        return restore_failed("not a snapshot, or from a different version");
+
+    if (header.kernel_hash != kernel_hash())
+        return restore_failed("made with a different kernel");
+
+    size_t components_size = header.component_count * sizeof(struct snapshot_component);
+
+    if (header.arena_base != SNAPSHOT_ARENA_BASE || header.arena_size > SNAPSHOT_ARENA_MAX
+            || header.image_size > header.arena_size || header.component_count > size / sizeof(struct snapshot_component)
+            || size - sizeof(header) < components_size + header.image_size)
+        return restore_failed("truncated or corrupt");
+
+    const struct snapshot_component *saved = (const struct snapshot_component *) (data + sizeof(header));
+    const uint8_t *image = (const uint8_t *) (saved + header.component_count);
+
+    if (hash_bytes(2166136261u, image, header.image_size) != header.image_hash)
+        return restore_failed("corrupt");
+
+    // proxies refer to components and their methods by the order they were added in, which has to match
+    uint32_t count = 0;
+
+    for (struct component *component = get_components(); component != NULL; component = component->next, count ++)
+        if (count >= header.component_count || strncmp(saved[count].name, component->name, COMPONENT_NAME_SIZE - 1))
+            return restore_failed("components have changed");
+
+    if (count != header.component_count)
+        return restore_failed("components have changed");
+
+    void *arena = map_memory_at(header.arena_base, header.arena_size);
+
+    if (arena == NULL)
+        return restore_failed("couldn't map the Lua heap");
+
+    memcpy(arena, image, header.image_size);
+    tlsf_image_loaded(header.heap->arena);
+    arena_size = header.arena_size;
+
+    // addresses are the same length every boot, so they can be overwritten where they are, which also covers the
+    // copies of their pointers that components keep for themselves
+    count = 0;
+
+    for (struct component *component = get_components(); component != NULL; component = component->next, count ++) {
+        char *address = (char *) component->address;
+        size_t length = strlen(address);
+
+        if (length < COMPONENT_ADDRESS_SIZE && memchr(saved[count].address, 0, COMPONENT_ADDRESS_SIZE) == saved[count].address + length)
+            memcpy(address, saved[count].address, length);
+    }
+
+    printf("restored %d KiB Lua snapshot\n", header.image_size / 1024);
+    return header.state;
+}
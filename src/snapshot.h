@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <lua.h>
+#include "luaheap.h"
+
+/* where the Lua heap lives when it can be snapshotted. nothing should ever be at this address on a PC */
+#define SNAPSHOT_ARENA_BASE 0xa0000000
+
+/* the most the window there can hold, and how much of it is used if luamem isn't set */
+#define SNAPSHOT_ARENA_MAX (512 * 1024 * 1024)
+#define SNAPSHOT_ARENA_DEFAULT (64 * 1024 * 1024)
+
+/* what the snapshot is called in the initrd */
+#define SNAPSHOT_PATH "/lua.snapshot"
+
+bool snapshot_dumping(void);
+bool snapshot_restoring(void);
+struct lua_heap *snapshot_create_heap(size_t size);
+bool snapshot_available(const struct lua_heap *heap);
+void snapshot_request(void);
+bool snapshot_requested(void);
+int snapshot_save(lua_State *L);
+lua_State *snapshot_restore(const char *data, size_t size);
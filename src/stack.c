@@ -0,0 +1,188 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "stack.h"
+#include "paging.h"
+#include "interrupts.h"
+
+/*
+ * overflow protection for the kernel stack, which every Lua thread runs its C code on. the page below the stack is
+ * left unmapped, so running off the end causes a page fault, and since the fault can't be handled on the stack that
+ * overflowed, page faults and double faults are task gates to a task with its own stack.
+ *
+ * if Lua was running, that task points the overflowed task at a function that raises a Lua error on a separate
+ * overflow stack (see init.S), so nothing that was on the kernel stack gets overwritten. the error unwinds to the
+ * innermost protected call, which is far up the kernel stack and still intact. that's only safe where Lua could have
+ * raised an error itself, so overflowing with interrupts off, inside an interrupt handler, or in the middle of the
+ * allocator or garbage collector (see allocator_depth) can't be recovered from
+ */
+
+#define FAULT_STACK_SIZE 4096
+
+// GDT selectors for the TSSes, see init.S
+#define KERNEL_TSS_SELECTOR 0x28
+#define FAULT_TSS_SELECTOR 0x30
+
+#define EFLAGS_IF (1 << 9)
+
+struct tss {
+    uint16_t link, reserved0;
+    uint32_t esp0;
+    uint16_t ss0, reserved1;
+    uint32_t esp1;
+    uint16_t ss1, reserved2;
+    uint32_t esp2;
+    uint16_t ss2, reserved3;
+    uint32_t cr3, eip, eflags, eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint16_t es, reserved4;
+    uint16_t cs, reserved5;
+    uint16_t ss, reserved6;
+    uint16_t ds, reserved7;
+    uint16_t fs, reserved8;
+    uint16_t gs, reserved9;
+    uint16_t ldt, reserved10;
+    uint16_t trap, iomap_base;
+} __attribute__((packed));
+
+extern uint64_t gdt[];
+extern uint8_t stack_guard;
+extern uint8_t stack_base;
+extern uint8_t stack_end;
+extern uint8_t overflow_stack_guard;
+extern uint8_t overflow_stack_end;
+
+extern void fault_task();
+
+int __real_lua_resume(lua_State *L, lua_State *from, int narg, int *nres);
+
+static struct tss kernel_tss;
+static struct tss fault_tss;
+static uint8_t fault_stack[FAULT_STACK_SIZE] __attribute__((aligned(16)));
+
+static lua_State *main_thread = NULL;
+static lua_State *running_thread = NULL;
+static lua_State *overflowed_thread = NULL;
+
+volatile int allocator_depth = 0;
+
+// the main thread is what's running whenever no coroutine has been resumed
+void set_main_lua_thread(lua_State *L) {
+    main_thread = L;
+    running_thread = L;
+}
+
+// returns the Lua thread that's currently running, or NULL before Lua has been started
+lua_State *current_lua_thread(void) {
+    return running_thread;
+}
+
+// lua_resume is wrapped at link time (see the Makefile) so the running thread is always known, since coroutines
+// all share the one C stack
+int __wrap_lua_resume(lua_State *L, lua_State *from, int narg, int *nres) {
+    lua_State *previous = running_thread;
+    running_thread = L;
+
+    int status = __real_lua_resume(L, from, narg, nres);
+
+    running_thread = previous;
+    return status;
+}
+
+static void make_tss_descriptor(int selector, struct tss *tss) {
+    uint64_t base = (uint32_t) tss;
+    uint64_t limit = sizeof(struct tss) - 1;
+
+    // 32 bit available TSS, present, byte granularity
+    gdt[selector / 8] = (limit & 0xffff) | ((base & 0xffffff) << 16) | (0x89ull << 40) | (((limit >> 16) & 0xf) << 48)
+        | ((base >> 24) << 56);
+}
+
+static uint32_t read_cr2(void) {
+    uint32_t value;
+    __asm__ __volatile__ ("mov %%cr2, %0" : "=r" (value));
+    return value;
+}
+
+static uint32_t read_cr3(void) {
+    uint32_t value;
+    __asm__ __volatile__ ("mov %%cr3, %0" : "=r" (value));
+    return value;
+}
+
+// returns whether the guard pages are there, which is what makes it safe to let C calls nest deeper
+bool stack_guard_init(void) {
+    if (!paging_enabled() || !unmap_page(&overflow_stack_guard) || !unmap_page(&stack_guard)) {
+        printf("kernel stack isn't protected by a guard page\n");
+        return false;
+    }
+
+    // the CPU saves the state of the kernel into this when switching to the fault task, but never saves cr3
+    kernel_tss.cr3 = read_cr3();
+    kernel_tss.iomap_base = sizeof(struct tss);
+
+    fault_tss.cr3 = read_cr3();
+    fault_tss.eip = (uint32_t) fault_task;
+    fault_tss.esp = (uint32_t) &fault_stack[FAULT_STACK_SIZE];
+    fault_tss.eflags = 0x2;
+    fault_tss.cs = 0x08;
+    fault_tss.ds = fault_tss.es = fault_tss.fs = fault_tss.gs = fault_tss.ss = 0x10;
+    fault_tss.iomap_base = sizeof(struct tss);
+
+    make_tss_descriptor(KERNEL_TSS_SELECTOR, &kernel_tss);
+    make_tss_descriptor(FAULT_TSS_SELECTOR, &fault_tss);
+
+    __asm__ __volatile__ ("ltr %w0" : : "r" (KERNEL_TSS_SELECTOR));
+
+    set_task_gate(8, FAULT_TSS_SELECTOR);
+    set_task_gate(14, FAULT_TSS_SELECTOR);
+
+    printf("guard page at %08x, %d KiB of stack\n", (uint32_t) &stack_guard, (&stack_end - &stack_base) / 1024);
+    return true;
+}
+
+static void __attribute__((noreturn)) raise_stack_overflow(void) {
+    luaL_error(overflowed_thread, "stack overflow");
+
+    while (1)
+        __asm__ __volatile__ ("cli; hlt");
+}
+
+static bool in_guard_page(const uint8_t *guard, uint32_t address) {
+    return address >= (uint32_t) guard && address < (uint32_t) guard + PAGE_SIZE;
+}
+
+// called from fault_task (see isr.S) on every page fault and double fault. only returns if the kernel can carry on
+void handle_fault(uint32_t error_code) {
+    uint32_t address = read_cr2();
+    bool overflow = in_guard_page(&stack_guard, address) || in_guard_page(&stack_guard, kernel_tss.esp);
+
+    // raising the error overflowed as well
+    bool recursive = in_guard_page(&overflow_stack_guard, address) || in_guard_page(&overflow_stack_guard, kernel_tss.esp);
+
+    if (overflow && running_thread != NULL && (kernel_tss.eflags & EFLAGS_IF) && interrupt_depth == 0
+            && allocator_depth == 0) {
+        overflowed_thread = running_thread;
+
+        // as if raise_stack_overflow had been called, with a return address at the top of the overflow stack
+        kernel_tss.eip = (uint32_t) raise_stack_overflow;
+        kernel_tss.esp = (uint32_t) &overflow_stack_end - 4;
+        return;
+    }
+
+    if (recursive)
+        printf("fatal stack overflow while raising a stack overflow error at %08x\n", kernel_tss.eip);
+    else if (overflow)
+        printf("fatal kernel stack overflow at %08x (address %08x)\n", kernel_tss.eip, address);
+    else
+        printf("fatal page or double fault at %08x (address %08x, error code %08x)\n", kernel_tss.eip, address, error_code);
+
+    printf("eax = %08x, ebx = %08x, ecx = %08x, edx = %08x\n", kernel_tss.eax, kernel_tss.ebx, kernel_tss.ecx, kernel_tss.edx);
+    printf("esi = %08x, edi = %08x, ebp = %08x, esp = %08x\n", kernel_tss.esi, kernel_tss.edi, kernel_tss.ebp, kernel_tss.esp);
+
+    while (1)
+        __asm__ __volatile__ ("cli; hlt");
+}
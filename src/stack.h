@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+#include <lua.h>
+
+/* how deeply C calls can nest in Lua once the kernel stack has a guard page. without one, Lua's default (from
+   luaconf.h) is kept */
+#define GUARDED_C_STACK_LIMIT 1000
+#define DEFAULT_C_STACK_LIMIT LUAI_MAXCSTACK
+
+/* how many allocator or garbage collector calls are running. a stack overflow in one of them is fatal, since the heap
+   could be left half updated */
+extern volatile int allocator_depth;
+
+bool stack_guard_init(void);
+void set_main_lua_thread(lua_State *L);
+lua_State *current_lua_thread(void);
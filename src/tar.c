@@ -2,7 +2,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include "tar.h"
+#include "lz4.h"
 
 struct tar_iterator *open_tar(const char *start, const char *end) {
     struct tar_iterator *iter = malloc(sizeof(struct tar_iterator));
@@ -45,34 +48,429 @@ bool next_file(struct tar_iterator *iter, struct tar_header **header, char **dat
     return true;
 }
 
-bool tar_find(struct tar_iterator *iter, char *to_find, char kind, char **data, size_t *size) {
-    struct tar_header *header;
-    const char name[256];
+/*
+ * index of everything in an archive, built once so that lookups don't have to walk the whole thing. paths are
+ * normalized (no leading, trailing or doubled slashes, no "./" in front) and kept in an open addressing hash table,
+ * and entries are also linked into a tree of directories so listing one only touches what's in it. directories
+ * that only exist because there are files in them get entries too. the file data itself stays in the archive.
+ *
+ * besides tar, an index can be built from a packed archive (made by tools/pack-initrd.py) where every file is
+ * compressed on its own as an LZ4 block. those are decompressed when they're first opened, into a cache that's
+ * kept under cache_limit bytes by throwing away whatever was least recently used. files that are open are pinned
+ * and never thrown away, so the cache only goes over its limit if that much is open at once
+ */
+
+// FNV-1a
+static uint32_t hash_path(const char *path, size_t length) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i ++)
+        hash = (hash ^ (uint8_t) path[i]) * 16777619u;
+
+    return hash;
+}
+
+/*
+ * copies a path into the buffer in normalized form, returns its length or -1 if it doesn't fit. "." components are
+ * dropped as well, but ".." is left alone since nothing in an archive can be above its root anyway
+ */
+static int normalize_path(const char *path, size_t length, char *buffer, size_t buffer_size) {
+    size_t out = 0;
+    size_t i = 0;
+
+    while (i < length && path[i] != 0) {
+        while (i < length && path[i] == '/')
+            i ++;
+
+        size_t start = i;
+
+        while (i < length && path[i] != 0 && path[i] != '/')
+            i ++;
+
+        size_t component_length = i - start;
+
+        if (component_length == 0 || (component_length == 1 && path[start] == '.'))
+            continue;
+
+        if (out + (out != 0) + component_length >= buffer_size)
+            return -1;
+
+        if (out != 0)
+            buffer[out ++] = '/';
+
+        memcpy(buffer + out, path + start, component_length);
+        out += component_length;
+    }
 
-    if (*to_find == '/')
-        to_find++;
+    buffer[out] = 0;
+    return out;
+}
+
+static struct tar_entry **find_slot(struct tar_index *index, const char *path, size_t length) {
+    uint32_t slot = hash_path(path, length) & (index->table_size - 1);
 
-    while (1) {
-        const char *name_ptr = &name;
-        if (!next_file(iter, &header, data, size))
+    while (index->table[slot] != NULL) {
+        struct tar_entry *entry = index->table[slot];
+
+        if (entry->path_length == length && !memcmp(entry->path, path, length))
             break;
 
-        if (kind != 0 && header->kind != kind)
+        slot = (slot + 1) & (index->table_size - 1);
+    }
+
+    return &index->table[slot];
+}
+
+static bool grow_table(struct tar_index *index) {
+    struct tar_entry **old_table = index->table;
+    size_t old_size = index->table_size;
+
+    index->table_size = old_size == 0 ? 64 : old_size * 2;
+    index->table = calloc(index->table_size, sizeof(struct tar_entry *));
+
+    if (index->table == NULL) {
+        index->table = old_table;
+        index->table_size = old_size;
+        return false;
+    }
+
+    for (size_t i = 0; i < old_size; i ++)
+        if (old_table[i] != NULL)
+            *find_slot(index, old_table[i]->path, old_table[i]->path_length) = old_table[i];
+
+    free(old_table);
+    return true;
+}
+
+// finds the entry for a normalized path, adding it (and any directories above it) if it isn't there yet
+static struct tar_entry *add_entry(struct tar_index *index, const char *path, size_t length, char kind) {
+    if (length == 0)
+        return &index->root;
+
+    // keep the table at most half full
+    if ((index->count + 1) * 2 > index->table_size && !grow_table(index))
+        return NULL;
+
+    struct tar_entry **slot = find_slot(index, path, length);
+
+    if (*slot != NULL)
+        return *slot;
+
+    const char *slash = NULL;
+    for (size_t i = 0; i < length; i ++)
+        if (path[i] == '/')
+            slash = path + i;
+
+    struct tar_entry *parent = add_entry(index, path, slash == NULL ? 0 : slash - path, TAR_DIRECTORY);
+
+    if (parent == NULL)
+        return NULL;
+
+    struct tar_entry *entry = calloc(1, sizeof(struct tar_entry) + length + 1);
+
+    if (entry == NULL)
+        return NULL;
+
+    char *entry_path = (char *) (entry + 1);
+    memcpy(entry_path, path, length);
+    entry_path[length] = 0;
+
+    entry->path = entry_path;
+    entry->path_length = length;
+    entry->name = slash == NULL ? entry_path : entry_path + (slash - path) + 1;
+    entry->kind = kind;
+    entry->parent = parent;
+
+    if (parent->last_child == NULL)
+        parent->first_child = entry;
+    else
+        parent->last_child->next_sibling = entry;
+
+    parent->last_child = entry;
+    parent->child_count ++;
+
+    // adding the parent may have grown the table, so the slot has to be found again
+    *find_slot(index, path, length) = entry;
+    index->count ++;
+
+    return entry;
+}
+
+static void add_tar_entries(struct tar_index *index, const char *start, const char *end) {
+    struct tar_iterator iter = { start, end };
+    struct tar_header *header;
+    char *data;
+    size_t size;
+
+    while (next_file(&iter, &header, &data, &size)) {
+        char kind;
+
+        if (header->kind == TAR_NORMAL_FILE || header->kind == 0)
+            kind = TAR_NORMAL_FILE;
+        else if (header->kind == TAR_DIRECTORY)
+            kind = TAR_DIRECTORY;
+        else
+            continue;
+
+        // ustar splits long paths into a prefix and a name, neither of which has to be NUL terminated
+        char raw[sizeof(header->filename_prefix) + 1 + sizeof(header->name)];
+        size_t prefix_length = strnlen(header->filename_prefix, sizeof(header->filename_prefix));
+        size_t name_length = strnlen(header->name, sizeof(header->name));
+        size_t raw_length = 0;
+
+        if (prefix_length != 0) {
+            memcpy(raw, header->filename_prefix, prefix_length);
+            raw[prefix_length] = '/';
+            raw_length = prefix_length + 1;
+        }
+
+        memcpy(raw + raw_length, header->name, name_length);
+        raw_length += name_length;
+
+        char path[TAR_PATH_MAX];
+        int length = normalize_path(raw, raw_length, path, sizeof(path));
+
+        if (length < 0)
+            continue;
+
+        struct tar_entry *entry = add_entry(index, path, length, kind);
+
+        if (entry == NULL)
+            return;
+
+        entry->kind = kind;
+        entry->mtime = oct2bin(header->mod_time, 11);
+
+        if (kind == TAR_NORMAL_FILE) {
+            entry->data = data;
+            entry->size = size;
+        }
+    }
+}
+
+/*
+ * packed archives start with a struct packed_header, then a struct packed_entry for every file and directory, then
+ * their NUL terminated paths, then the file data. everything is little endian, and offsets are from the start
+ */
+#define PACKED_MAGIC 0x44524b50 // "PKRD"
+#define PACKED_VERSION 1
+
+struct packed_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t paths_size;
+};
+
+struct packed_entry {
+    uint32_t path_offset; // from the start of the paths
+    uint32_t kind;
+    uint32_t mtime;
+    uint32_t size;
+    uint32_t data_offset;
+    // how big the data is in the archive, if it's the same as size then it isn't compressed
+    uint32_t stored_size;
+};
+
+static bool is_packed(const char *start, const char *end) {
+    const struct packed_header *header = (const struct packed_header *) start;
+    return (size_t) (end - start) >= sizeof(struct packed_header) && header->magic == PACKED_MAGIC;
+}
+
+static void add_packed_entries(struct tar_index *index, const char *start, const char *end) {
+    const struct packed_header *header = (const struct packed_header *) start;
+    size_t archive_size = end - start;
+
+    if (header->version != PACKED_VERSION
+            || header->entry_count > (archive_size - sizeof(*header)) / sizeof(struct packed_entry)) {
+        printf("unsupported or corrupt packed archive\n");
+        return;
+    }
+
+    const struct packed_entry *entries = (const struct packed_entry *) (header + 1);
+    const char *paths = (const char *) (entries + header->entry_count);
+
+    if (header->paths_size > (size_t) (end - paths)) {
+        printf("corrupt packed archive\n");
+        return;
+    }
+
+    for (uint32_t i = 0; i < header->entry_count; i ++) {
+        const struct packed_entry *packed = &entries[i];
+        char kind = packed->kind;
+
+        if ((kind != TAR_NORMAL_FILE && kind != TAR_DIRECTORY) || packed->path_offset >= header->paths_size
+                || packed->data_offset > archive_size || packed->stored_size > archive_size - packed->data_offset
+                || packed->stored_size > packed->size)
+            continue;
+
+        char path[TAR_PATH_MAX];
+        const char *raw = paths + packed->path_offset;
+        int length = normalize_path(raw, header->paths_size - packed->path_offset, path, sizeof(path));
+
+        if (length < 0)
             continue;
 
-        header->name[99] = 0;
-        header->filename_prefix[154] = 0;
-        sprintf(name, "%s%s", header->name, header->filename_prefix);
+        struct tar_entry *entry = add_entry(index, path, length, kind);
+
+        if (entry == NULL)
+            return;
+
+        entry->kind = kind;
+        entry->mtime = packed->mtime;
+
+        if (kind == TAR_NORMAL_FILE) {
+            entry->size = packed->size;
+
+            if (packed->stored_size == packed->size)
+                entry->data = start + packed->data_offset;
+            else {
+                entry->compressed = start + packed->data_offset;
+                entry->compressed_size = packed->stored_size;
+            }
+        }
+    }
+}
+
+// builds an index of a tar or packed archive. returns NULL if there isn't enough memory
+struct tar_index *tar_index_build(const char *start, const char *end) {
+    struct tar_index *index = calloc(1, sizeof(struct tar_index));
+
+    if (index == NULL)
+        return NULL;
+
+    index->root.path = index->root.name = "";
+    index->root.kind = TAR_DIRECTORY;
+    index->cache_limit = TAR_CACHE_DEFAULT;
+
+    if (is_packed(start, end))
+        add_packed_entries(index, start, end);
+    else
+        add_tar_entries(index, start, end);
+
+    return index;
+}
+
+// finds the entry for a path, which is normalized first. returns NULL if it isn't there
+struct tar_entry *tar_lookup(struct tar_index *index, const char *path) {
+    char normalized[TAR_PATH_MAX];
+    int length = normalize_path(path, SIZE_MAX, normalized, sizeof(normalized));
+
+    if (length < 0)
+        return NULL;
+
+    if (length == 0)
+        return &index->root;
+
+    if (index->table_size == 0)
+        return NULL;
 
-        if (*name_ptr == '/')
-            name_ptr++;
+    return *find_slot(index, normalized, length);
+}
+
+// finds a regular file, returns NULL if there's no file at that path
+struct tar_entry *tar_find_file(struct tar_index *index, const char *path) {
+    struct tar_entry *entry = tar_lookup(index, path);
+
+    if (entry == NULL || entry->kind != TAR_NORMAL_FILE)
+        return NULL;
+
+    return entry;
+}
+
+static void lru_remove(struct tar_index *index, struct tar_entry *entry) {
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        index->lru_first = entry->lru_next;
+
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        index->lru_last = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_append(struct tar_index *index, struct tar_entry *entry) {
+    entry->lru_prev = index->lru_last;
+    entry->lru_next = NULL;
+
+    if (index->lru_last != NULL)
+        index->lru_last->lru_next = entry;
+    else
+        index->lru_first = entry;
+
+    index->lru_last = entry;
+}
+
+// throws away unpinned files until there's room in the cache for the given number of bytes, or there's nothing left
+static void evict(struct tar_index *index, size_t needed) {
+    while (index->lru_first != NULL && index->cache_size + needed > index->cache_limit) {
+        struct tar_entry *entry = index->lru_first;
+        lru_remove(index, entry);
+
+        index->cache_size -= entry->size + 1;
+        free(entry->cached);
+        entry->cached = NULL;
+    }
+}
+
+/*
+ * returns a file's contents, which stay valid until tar_close_data is called for it. files from a tar archive are
+ * right there, compressed ones are decompressed if they aren't in the cache. only decompressed contents are followed
+ * by a NUL, anything straight out of the archive runs right into whatever comes after it, so callers go by the size.
+ * returns NULL if it's not a file, if it's corrupt or if there isn't enough memory
+ */
+const char *tar_open_data(struct tar_index *index, struct tar_entry *entry) {
+    if (entry->kind != TAR_NORMAL_FILE)
+        return NULL;
+
+    if (entry->compressed == NULL)
+        return entry->data;
+
+    if (entry->cached != NULL) {
+        if (entry->pins ++ == 0)
+            lru_remove(index, entry);
+
+        return entry->cached;
+    }
+
+    evict(index, entry->size + 1);
+
+    char *buffer = malloc(entry->size + 1);
 
-        if (strstr(name_ptr, "./") == name_ptr)
-            name_ptr += 2;
+    // try again with the cache emptied out
+    if (buffer == NULL) {
+        evict(index, SIZE_MAX - index->cache_size);
+        buffer = malloc(entry->size + 1);
+    }
+
+    if (buffer == NULL)
+        return NULL;
 
-        if (!strcmp(name, to_find))
-            return true;
+    if (!lz4_decompress(entry->compressed, entry->compressed_size, buffer, entry->size)) {
+        printf("%s is corrupt\n", entry->path);
+        free(buffer);
+        return NULL;
     }
 
-    return false;
+    buffer[entry->size] = 0;
+
+    entry->cached = buffer;
+    entry->pins = 1;
+    index->cache_size += entry->size + 1;
+
+    return buffer;
+}
+
+// lets go of what tar_open_data returned, after which it may be thrown out of the cache
+void tar_close_data(struct tar_index *index, struct tar_entry *entry) {
+    if (entry->compressed == NULL || entry->cached == NULL || entry->pins == 0)
+        return;
+
+    if (-- entry->pins == 0) {
+        lru_append(index, entry);
+        evict(index, 0);
+    }
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct tar_header {
     char name[100];
@@ -29,12 +31,69 @@ struct tar_header {
 #define TAR_DIRECTORY '5'
 #define TAR_NAMED_PIPE '6'
 
+/* prefix, slash and name */
+#define TAR_PATH_MAX 256
+
+/* how much decompressed file data a packed archive's index keeps cached by default */
+#define TAR_CACHE_DEFAULT (4 * 1024 * 1024)
+
 struct tar_iterator {
     const char *start;
     const char *end;
 };
 
+/* a file or directory in a struct tar_index */
+struct tar_entry {
+    // normalized path from the root of the archive, and the last part of it
+    const char *path;
+    size_t path_length;
+    const char *name;
+
+    // TAR_NORMAL_FILE or TAR_DIRECTORY
+    char kind;
+    uint32_t mtime;
+
+    // a file's contents, in the archive, unless it's compressed
+    const char *data;
+    size_t size;
+
+    // for files in packed archives that are compressed, and their decompressed contents if they're in the cache
+    const char *compressed;
+    size_t compressed_size;
+    char *cached;
+
+    // how many times the cached contents are open. they're only in the LRU list while this is 0
+    uint32_t pins;
+    struct tar_entry *lru_prev;
+    struct tar_entry *lru_next;
+
+    struct tar_entry *parent;
+    struct tar_entry *first_child;
+    struct tar_entry *last_child;
+    struct tar_entry *next_sibling;
+    size_t child_count;
+};
+
+struct tar_index {
+    struct tar_entry root;
+
+    // open addressing hash table of every entry but the root, size is a power of two
+    struct tar_entry **table;
+    size_t table_size;
+    size_t count;
+
+    // decompressed file data, least recently used first
+    size_t cache_size;
+    size_t cache_limit;
+    struct tar_entry *lru_first;
+    struct tar_entry *lru_last;
+};
+
 int oct2bin(unsigned char *str, int size);
 struct tar_iterator *open_tar(const char *start, const char *end);
 bool next_file(struct tar_iterator *iter, struct tar_header **header, char **data, size_t *size);
-bool tar_find(struct tar_iterator *iter, char *to_find, char kind, char **data, size_t *size);
+struct tar_index *tar_index_build(const char *start, const char *end);
+struct tar_entry *tar_lookup(struct tar_index *index, const char *path);
+struct tar_entry *tar_find_file(struct tar_index *index, const char *path);
+const char *tar_open_data(struct tar_index *index, struct tar_entry *entry);
+void tar_close_data(struct tar_index *index, struct tar_entry *entry);
@@ -0,0 +1,251 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "timer.h"
+#include "clock.h"
+#include "clockevent.h"
+#include "io.h"
+
+/*
+ * hierarchical timer wheel, see "Hashed and Hierarchical Timing Wheels" (Varghese & Lauck).
+ * the first level has one slot per jiffy for the next 256 jiffies, and each level after that has 64 slots
+ * that each cover a whole rotation of the level below it. adding and cancelling a timer is O(1), and a tick
+ * only has to look at a single slot, plus a cascade of one slot from a higher level every 256 ticks.
+ *
+ * there's no periodic tick. jiffies are derived from the monotonic clock, and the clock event device is programmed
+ * for whenever the wheel next has work to do, so an idle machine only wakes up when a timer is due
+ */
+
+#define ROOT_BITS 8
+#define LEVEL_BITS 6
+#define ROOT_SIZE (1 << ROOT_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define ROOT_MASK (ROOT_SIZE - 1)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define LEVELS 4
+
+#define LEVEL_SHIFT(n) (ROOT_BITS + (n) * LEVEL_BITS)
+#define LEVEL_INDEX(time, n) (((time) >> LEVEL_SHIFT(n)) & LEVEL_MASK)
+
+// two jiffies are an exact number of nanoseconds, unlike one
+#define NS_PER_TWO_JIFFIES (2 * NS_PER_SEC / TIMER_HZ)
+
+// the jiffy that the wheel will process next
+static uint32_t wheel_jiffies = 0;
+
+static uint32_t pending_timers = 0;
+
+// the jiffy the clock event device is currently programmed for, if it's programmed at all
+static bool event_armed = false;
+static uint32_t event_jiffies = 0;
+
+static struct timer *root[ROOT_SIZE];
+static struct timer *levels[LEVELS][LEVEL_SIZE];
+
+static void link_timer(struct timer **slot, struct timer *timer) {
+    timer->next = *slot;
+    if (timer->next != NULL)
+        timer->next->prev = &timer->next;
+
+    timer->prev = slot;
+    *slot = timer;
+}
+
+static void unlink_timer(struct timer *timer) {
+    *timer->prev = timer->next;
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// puts a timer in the slot it belongs in relative to the current position of the wheel
+static void insert_timer(struct timer *timer) {
+    uint32_t expires = timer->expires;
+    uint32_t delta = expires - wheel_jiffies;
+
+    if ((int32_t) delta < 0) {
+        // already expired, run it on the next tick
+        link_timer(&root[wheel_jiffies & ROOT_MASK], timer);
+        return;
+    }
+
+    if (delta < ROOT_SIZE) {
+        link_timer(&root[expires & ROOT_MASK], timer);
+        return;
+    }
+
+    for (int i = 0; i < LEVELS - 1; i++)
+        if (delta < 1u << LEVEL_SHIFT(i + 1)) {
+            link_timer(&levels[i][LEVEL_INDEX(expires, i)], timer);
+            return;
+        }
+
+    link_timer(&levels[LEVELS - 1][LEVEL_INDEX(expires, LEVELS - 1)], timer);
+}
+
+// moves all timers in a slot of a higher level down into the levels below it, returns the index of that slot
+static int cascade(int level, int index) {
+    struct timer *timer = levels[level][index];
+    levels[level][index] = NULL;
+
+    while (timer != NULL) {
+        struct timer *next = timer->next;
+        insert_timer(timer);
+        timer = next;
+    }
+
+    return index;
+}
+
+static uint32_t ns_to_jiffies(uint64_t ns) {
+    return (ns << 1) / NS_PER_TWO_JIFFIES;
+}
+
+// returns the current time in jiffies
+uint32_t get_jiffies(void) {
+    return ns_to_jiffies(clock_ns());
+}
+
+// programs the clock event device to go off once the given jiffy has been reached
+static void arm_event(uint32_t at) {
+    uint64_t now = clock_ns();
+    int32_t delta = at - ns_to_jiffies(now);
+
+    event_armed = true;
+    event_jiffies = at;
+
+    clockevent_program(delta <= 0 ? now : now + (uint64_t) delta * NS_PER_TWO_JIFFIES / 2);
+}
+
+// schedules a timer to run once the current time in jiffies reaches timer->expires
+void timer_add(struct timer *timer) {
+    assert(timer != NULL);
+    assert(timer->callback != NULL);
+
+    uint32_t flags = irq_save();
+
+    if (timer->prev != NULL)
+        unlink_timer(timer);
+    else
+        pending_timers++;
+
+    insert_timer(timer);
+
+    if (!event_armed || (int32_t) (timer->expires - event_jiffies) < 0)
+        arm_event(timer->expires);
+
+    irq_restore(flags);
+}
+
+// removes a pending timer from the wheel. returns false if the timer has already run or was never added
+bool timer_cancel(struct timer *timer) {
+    assert(timer != NULL);
+
+    uint32_t flags = irq_save();
+    bool was_pending = timer->prev != NULL;
+
+    if (was_pending) {
+        unlink_timer(timer);
+        pending_timers--;
+    }
+
+    irq_restore(flags);
+    return was_pending;
+}
+
+/*
+ * finds the earliest point at which the wheel could next have to run a timer. for timers in the first level this
+ * is exact, for higher levels it's when their slot gets cascaded down. returns false if nothing is pending
+ */
+bool timer_next_expiry(uint32_t *expiry) {
+    uint32_t flags = irq_save();
+    bool found = false;
+    uint32_t earliest = 0;
+
+    for (int i = 0; i < ROOT_SIZE; i++)
+        if (root[(wheel_jiffies + i) & ROOT_MASK] != NULL) {
+            earliest = wheel_jiffies + i;
+            found = true;
+            break;
+        }
+
+    for (int level = 0; level < LEVELS; level++) {
+        uint32_t base = wheel_jiffies >> LEVEL_SHIFT(level);
+
+        // the current slot of a level only gets cascaded again once the level has gone all the way around, unless
+        // the wheel is sitting right on the boundary where it's about to be cascaded
+        int first = (wheel_jiffies & ((1u << LEVEL_SHIFT(level)) - 1)) == 0 ? 0 : 1;
+
+        for (int i = first; i < first + LEVEL_SIZE; i++)
+            if (levels[level][(base + i) & LEVEL_MASK] != NULL) {
+                uint32_t time = (base + i) << LEVEL_SHIFT(level);
+
+                if (!found || (int32_t) (time - earliest) < 0)
+                    earliest = time;
+
+                found = true;
+                break;
+            }
+    }
+
+    irq_restore(flags);
+
+    if (found)
+        *expiry = earliest;
+
+    return found;
+}
+
+// runs the wheel up to and including the given jiffy
+static void advance_timers(uint32_t now) {
+    while ((int32_t) (now - wheel_jiffies) >= 0) {
+        uint32_t next;
+
+        // skip straight over stretches where nothing could possibly happen, which after a long sleep can be a lot
+        if (pending_timers == 0) {
+            wheel_jiffies = now + 1;
+            break;
+        } else if (root[wheel_jiffies & ROOT_MASK] == NULL && timer_next_expiry(&next)
+                && (int32_t) (next - wheel_jiffies) > 0)
+            wheel_jiffies = (int32_t) (next - now) > 0 ? now + 1 : next;
+
+        if ((int32_t) (now - wheel_jiffies) < 0)
+            break;
+
+        int index = wheel_jiffies & ROOT_MASK;
+
+        if (index == 0)
+            for (int level = 0; level < LEVELS && cascade(level, LEVEL_INDEX(wheel_jiffies, level)) == 0; level++);
+
+        // move the slot into a local list so callbacks can safely add or cancel timers while it's being run
+        struct timer *list = root[index];
+        root[index] = NULL;
+        if (list != NULL)
+            list->prev = &list;
+
+        wheel_jiffies++;
+
+        while (list != NULL) {
+            struct timer *timer = list;
+            unlink_timer(timer);
+            pending_timers--;
+            timer->callback(timer);
+        }
+    }
+}
+
+// called from the clock event device's interrupt. runs any timers that have expired and programs the next event
+void timer_interrupt(void) {
+    uint32_t next;
+
+    event_armed = false;
+    advance_timers(get_jiffies());
+
+    if (timer_next_expiry(&next))
+        arm_event(next);
+    else
+        clockevent_program(CLOCKEVENT_NEVER);
+}
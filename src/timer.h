@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* the frequency of the tick that drives the timer wheel */
+#define TIMER_HZ 1024
+
+struct timer {
+    // the value of jiffies at which this timer expires
+    uint32_t expires;
+    // called with interrupts disabled once the timer has expired
+    void (*callback)(struct timer *timer);
+    // arbitrary data associated with this timer
+    void *data;
+
+    struct timer *next;
+    // points to whatever points to this timer, or NULL if the timer isn't pending
+    struct timer **prev;
+};
+
+void timer_add(struct timer *timer);
+bool timer_cancel(struct timer *timer);
+bool timer_next_expiry(uint32_t *expiry);
+uint32_t get_jiffies(void);
+void timer_interrupt(void);
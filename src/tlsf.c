@@ -0,0 +1,674 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "tlsf.h"
+#include "io.h"
+
+/*
+ * two-level segregated fit allocator, see "TLSF: a New Dynamic Memory Allocator for Real-Time Systems"
+ * (Masmano et al.). free blocks are kept in lists segregated first by power of two and then linearly into 32
+ * subdivisions of that, with a bitmap for each level saying which lists are non-empty. finding a big enough block
+ * is then a couple of bit scans rather than a walk of the free list, so malloc and free take bounded time no matter
+ * how fragmented the heap is. free blocks are coalesced with their physical neighbours immediately.
+ *
+ * every block starts with a header holding its size and the block physically before it. a region added to the heap
+ * ends with a zero sized block that's always in use, so coalescing never walks off the end
+ */
+
+#define ALIGN_SIZE 8
+
+#define SL_INDEX_COUNT_LOG2 5
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+
+// sizes below SMALL_BLOCK_SIZE all go in the first level, one list per ALIGN_SIZE bytes
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + 3)
+#define FL_INDEX_MAX 30
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE (1 << FL_INDEX_SHIFT)
+
+#define BLOCK_SIZE_MAX (1u << FL_INDEX_MAX)
+
+// the flag lives in the low bits of the size, which are always clear since sizes are multiples of ALIGN_SIZE
+#define BLOCK_FREE 1
+#define BLOCK_FLAGS (ALIGN_SIZE - 1)
+
+struct block {
+    size_t size;
+    struct block *prev_phys;
+
+    // only valid while the block is free, otherwise this is where its data starts
+    struct block *next_free;
+    struct block *prev_free;
+};
+
+#define BLOCK_HEADER_SIZE offsetof(struct block, next_free)
+#define BLOCK_SIZE_MIN (sizeof(struct block) - BLOCK_HEADER_SIZE)
+
+struct tlsf {
+    // bytes available for blocks in every region added, and in the blocks that are currently free
+    size_t total_size;
+    size_t free_size;
+
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[FL_INDEX_COUNT];
+    struct block *free_lists[FL_INDEX_COUNT][SL_INDEX_COUNT];
+
+    // for heaps made by tlsf_create, the block marking the end of their only region, and the block before it as of
+    // the last call to tlsf_image_size
+    struct block *sentinel;
+    struct block *sentinel_prev;
+};
+
+// the kernel heap that malloc and friends use
+static struct tlsf kernel_heap;
+
+// index of the highest and lowest set bit. x must not be 0
+static int fls(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+static int ffs_(uint32_t x) {
+    return __builtin_ctz(x);
+}
+
+static size_t block_size(const struct block *block) {
+    return block->size & ~BLOCK_FLAGS;
+}
+
+static bool block_is_free(const struct block *block) {
+    return block->size & BLOCK_FREE;
+}
+
+static void *block_to_ptr(struct block *block) {
+    return (uint8_t *) block + BLOCK_HEADER_SIZE;
+}
+
+static struct block *ptr_to_block(void *ptr) {
+    return (struct block *) ((uint8_t *) ptr - BLOCK_HEADER_SIZE);
+}
+
+static struct block *block_next(struct block *block) {
+    return (struct block *) ((uint8_t *) block_to_ptr(block) + block_size(block));
+}
+
+static void set_size(struct block *block, size_t size) {
+    block->size = size | (block->size & BLOCK_FLAGS);
+}
+
+static void set_free(struct block *block, bool free) {
+    if (free)
+        block->size |= BLOCK_FREE;
+    else
+        block->size &= ~BLOCK_FREE;
+}
+
+// finds the list a block of the given size belongs in
+static void mapping_insert(size_t size, int *fl, int *sl) {
+    if (size < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+    } else {
+        int bit = fls(size);
+        *sl = (size >> (bit - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+        *fl = bit - (FL_INDEX_SHIFT - 1);
+    }
+}
+
+// finds the first list where every block is at least the given size, by rounding up to the next list
+static void mapping_search(size_t size, int *fl, int *sl) {
+    if (size >= SMALL_BLOCK_SIZE)
+        size += (1 << (fls(size) - SL_INDEX_COUNT_LOG2)) - 1;
+
+    mapping_insert(size, fl, sl);
+}
+
+static struct block *search_suitable_block(struct tlsf *heap, int *fl, int *sl) {
+    uint32_t sl_map = heap->sl_bitmap[*fl] & (~0u << *sl);
+
+    if (sl_map == 0) {
+        // nothing in this first level list, move on to the next non-empty one
+        uint32_t fl_map = *fl + 1 < FL_INDEX_COUNT ? heap->fl_bitmap & (~0u << (*fl + 1)) : 0;
+
+        if (fl_map == 0)
+            return NULL;
+
+        *fl = ffs_(fl_map);
+        sl_map = heap->sl_bitmap[*fl];
+    }
+
+    *sl = ffs_(sl_map);
+    return heap->free_lists[*fl][*sl];
+}
+
+static void remove_free_block(struct tlsf *heap, struct block *block, int fl, int sl) {
+    heap->free_size -= block_size(block);
+
+    if (block->next_free != NULL)
+        block->next_free->prev_free = block->prev_free;
+    if (block->prev_free != NULL)
+        block->prev_free->next_free = block->next_free;
+
+    if (heap->free_lists[fl][sl] == block) {
+        heap->free_lists[fl][sl] = block->next_free;
+
+        if (block->next_free == NULL) {
+            heap->sl_bitmap[fl] &= ~(1u << sl);
+
+            if (heap->sl_bitmap[fl] == 0)
+                heap->fl_bitmap &= ~(1u << fl);
+        }
+    }
+}
+
+static void insert_free_block(struct tlsf *heap, struct block *block, int fl, int sl) {
+    heap->free_size += block_size(block);
+
+    block->next_free = heap->free_lists[fl][sl];
+    block->prev_free = NULL;
+
+    if (block->next_free != NULL)
+        block->next_free->prev_free = block;
+
+    heap->free_lists[fl][sl] = block;
+    heap->fl_bitmap |= 1u << fl;
+    heap->sl_bitmap[fl] |= 1u << sl;
+}
+
+static void remove_block(struct tlsf *heap, struct block *block) {
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+    remove_free_block(heap, block, fl, sl);
+}
+
+static void insert_block(struct tlsf *heap, struct block *block) {
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+    insert_free_block(heap, block, fl, sl);
+}
+
+// splits the end off a block if there's enough left over to make another block, and frees it
+static void trim(struct tlsf *heap, struct block *block, size_t size) {
+    if (block_size(block) < size + BLOCK_HEADER_SIZE + BLOCK_SIZE_MIN)
+        return;
+
+    struct block *remaining = (struct block *) ((uint8_t *) block_to_ptr(block) + size);
+    remaining->size = block_size(block) - size - BLOCK_HEADER_SIZE;
+    remaining->prev_phys = block;
+    set_size(block, size);
+
+    struct block *next = block_next(remaining);
+    next->prev_phys = remaining;
+
+    // the block after may already be free, in which case the two are merged
+    if (block_is_free(next)) {
+        remove_block(heap, next);
+        remaining->size += BLOCK_HEADER_SIZE + block_size(next);
+        block_next(remaining)->prev_phys = remaining;
+    }
+
+    set_free(remaining, true);
+    insert_block(heap, remaining);
+}
+
+// merges a block with the free block physically after it
+static void absorb_next(struct tlsf *heap, struct block *block) {
+    struct block *next = block_next(block);
+    remove_block(heap, next);
+
+    set_size(block, block_size(block) + BLOCK_HEADER_SIZE + block_size(next));
+    block_next(block)->prev_phys = block;
+}
+
+static size_t adjust_request_size(size_t size) {
+    if (size > BLOCK_SIZE_MAX / 2)
+        return 0;
+
+    size = (size + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+    return size < BLOCK_SIZE_MIN ? BLOCK_SIZE_MIN : size;
+}
+
+// must be called with interrupts disabled
+static void *alloc_locked(struct tlsf *heap, size_t size) {
+    size = adjust_request_size(size);
+
+    if (size == 0)
+        return NULL;
+
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+
+    if (fl >= FL_INDEX_COUNT)
+        return NULL;
+
+    struct block *block = search_suitable_block(heap, &fl, &sl);
+
+    if (block == NULL)
+        return NULL;
+
+    remove_free_block(heap, block, fl, sl);
+    set_free(block, false);
+    trim(heap, block, size);
+
+    return block_to_ptr(block);
+}
+
+// must be called with interrupts disabled
+static void free_locked(struct tlsf *heap, void *ptr) {
+    struct block *block = ptr_to_block(ptr);
+    struct block *prev = block->prev_phys;
+
+    if (prev != NULL && block_is_free(prev)) {
+        remove_block(heap, prev);
+        set_size(prev, block_size(prev) + BLOCK_HEADER_SIZE + block_size(block));
+        block_next(prev)->prev_phys = prev;
+        block = prev;
+    }
+
+    if (block_is_free(block_next(block)))
+        absorb_next(heap, block);
+
+    set_free(block, true);
+    insert_block(heap, block);
+}
+
+// must be called with interrupts disabled
+static void *realloc_locked(struct tlsf *heap, void *ptr, size_t size) {
+    size_t adjusted = adjust_request_size(size);
+
+    if (adjusted == 0)
+        return NULL;
+
+    struct block *block = ptr_to_block(ptr);
+    size_t current = block_size(block);
+    struct block *next = block_next(block);
+
+    // grow or shrink in place where possible
+    if (adjusted > current && block_is_free(next)
+            && current + BLOCK_HEADER_SIZE + block_size(next) >= adjusted)
+        absorb_next(heap, block);
+
+    if (block_size(block) >= adjusted) {
+        trim(heap, block, adjusted);
+        return ptr;
+    }
+
+    void *new_ptr = alloc_locked(heap, adjusted);
+
+    if (new_ptr != NULL) {
+        memcpy(new_ptr, ptr, current);
+        free_locked(heap, ptr);
+    }
+
+    return new_ptr;
+}
+
+// must be called with interrupts disabled. alignment must be a power of two greater than ALIGN_SIZE
+static void *memalign_locked(struct tlsf *heap, size_t alignment, size_t size) {
+    size_t adjusted = adjust_request_size(size);
+
+    // leave enough slack to be able to split a free block off the front whatever the alignment works out to be
+    size_t gap_min = BLOCK_HEADER_SIZE + BLOCK_SIZE_MIN;
+
+    if (adjusted == 0 || adjusted + alignment + gap_min > BLOCK_SIZE_MAX / 2)
+        return NULL;
+
+    void *ptr = alloc_locked(heap, adjusted + alignment + gap_min);
+
+    if (ptr == NULL)
+        return NULL;
+
+    struct block *block = ptr_to_block(ptr);
+    uintptr_t aligned = ((uintptr_t) ptr + alignment - 1) & ~(alignment - 1);
+
+    while (aligned != (uintptr_t) ptr && aligned - (uintptr_t) ptr < gap_min)
+        aligned += alignment;
+
+    size_t gap = aligned - (uintptr_t) ptr;
+
+    if (gap != 0) {
+        // the front becomes a free block of its own. the block before it can't be free, or it'd have been merged
+        struct block *aligned_block = ptr_to_block((void *) aligned);
+        aligned_block->size = block_size(block) - gap;
+        aligned_block->prev_phys = block;
+        block_next(aligned_block)->prev_phys = aligned_block;
+
+        set_size(block, gap - BLOCK_HEADER_SIZE);
+        set_free(block, true);
+        insert_block(heap, block);
+
+        block = aligned_block;
+    }
+
+    trim(heap, block, adjusted);
+
+    return block_to_ptr(block);
+}
+
+#ifdef ALLOC_TRACKING
+
+/*
+ * allocation tracking for debug builds (make ALLOC_TRACKING=1). every allocation gets a tag in front of it
+ * recording who made it, and live and total counts are kept for each call site so leaks and needless heap traffic
+ * show up in malloc_report. call sites are return addresses, which addr2line can turn into a file and line
+ */
+
+#define TAG_MAGIC 0xa110c8ed
+#define ALLOC_SITES 256
+
+struct alloc_tag {
+    void *site;
+    size_t size;
+
+    // distance from the start of the underlying allocation to the end of the tag, where the caller's memory starts
+    size_t offset;
+    uint32_t magic;
+};
+
+#define TAG_SIZE sizeof(struct alloc_tag)
+
+struct alloc_site {
+    void *site;
+    uint32_t live_count;
+    size_t live_bytes;
+    uint32_t total_count;
+};
+
+static struct alloc_site alloc_sites[ALLOC_SITES];
+static struct alloc_site unknown_site;
+
+static struct alloc_site *find_alloc_site(void *site) {
+    uint32_t index = ((uintptr_t) site >> 2) % ALLOC_SITES;
+
+    for (int i = 0; i < ALLOC_SITES; i ++, index = (index + 1) % ALLOC_SITES) {
+        if (alloc_sites[index].site == site)
+            return &alloc_sites[index];
+
+        if (alloc_sites[index].site == NULL) {
+            alloc_sites[index].site = site;
+            return &alloc_sites[index];
+        }
+    }
+
+    return &unknown_site;
+}
+
+// must be called with interrupts disabled. returns the pointer to give to the caller
+static void *tag_allocation(void *raw, size_t offset, void *site, size_t size) {
+    if (raw == NULL)
+        return NULL;
+
+    struct alloc_tag *tag = (struct alloc_tag *) ((uint8_t *) raw + offset) - 1;
+    tag->site = site;
+    tag->size = size;
+    tag->offset = offset;
+    tag->magic = TAG_MAGIC;
+
+    struct alloc_site *alloc_site = find_alloc_site(site);
+    alloc_site->live_count ++;
+    alloc_site->live_bytes += size;
+    alloc_site->total_count ++;
+
+    return tag + 1;
+}
+
+static struct alloc_tag *get_tag(void *ptr) {
+    struct alloc_tag *tag = (struct alloc_tag *) ptr - 1;
+
+    if (tag->magic != TAG_MAGIC) {
+        printf("heap: bad free or realloc of %p\n", ptr);
+        while (1)
+            __asm__ __volatile__ ("cli; hlt");
+    }
+
+    return tag;
+}
+
+// must be called with interrupts disabled. returns the start of the underlying allocation
+static void *untag_allocation(void *ptr) {
+    struct alloc_tag *tag = get_tag(ptr);
+
+    struct alloc_site *alloc_site = find_alloc_site(tag->site);
+    alloc_site->live_count --;
+    alloc_site->live_bytes -= tag->size;
+
+    tag->magic = 0;
+    return (uint8_t *) (tag + 1) - tag->offset;
+}
+
+// prints every call site that has memory allocated, along with how many allocations it's made in total
+void malloc_report(void) {
+    uint32_t flags = irq_save();
+    uint32_t live_count = 0;
+    size_t live_bytes = 0;
+
+    printf("live heap allocations by call site (return addresses, see addr2line -e kernel):\n");
+
+    for (int i = 0; i < ALLOC_SITES; i ++) {
+        struct alloc_site *site = &alloc_sites[i];
+
+        if (site->site == NULL || site->live_count == 0)
+            continue;
+
+        printf("\t%08x: %d live (%d bytes), %d allocated in total\n", site->site, site->live_count, site->live_bytes,
+            site->total_count);
+        live_count += site->live_count;
+        live_bytes += site->live_bytes;
+    }
+
+    if (unknown_site.total_count != 0)
+        printf("\tother sites: %d live (%d bytes), %d allocated in total\n", unknown_site.live_count,
+            unknown_site.live_bytes, unknown_site.total_count);
+
+    printf("%d allocations (%d bytes) live\n", live_count, live_bytes);
+    irq_restore(flags);
+}
+
+#else
+
+#define TAG_SIZE 0
+#define tag_allocation(raw, offset, site, size) (raw)
+#define untag_allocation(ptr) (ptr)
+
+void malloc_report(void) {
+    printf("allocation tracking isn't enabled in this build\n");
+}
+
+#endif
+
+static void *allocate(size_t size, void *site) {
+    uint32_t flags = irq_save();
+    void *ptr = tag_allocation(alloc_locked(&kernel_heap, size + TAG_SIZE), TAG_SIZE, site, size);
+    irq_restore(flags);
+
+    return ptr;
+}
+
+void *malloc(size_t size) {
+    return allocate(size, __builtin_return_address(0));
+}
+
+void free(void *ptr) {
+    if (ptr == NULL)
+        return;
+
+    uint32_t flags = irq_save();
+    free_locked(&kernel_heap, untag_allocation(ptr));
+    irq_restore(flags);
+}
+
+void *calloc(size_t count, size_t size) {
+    size_t total;
+
+    if (__builtin_mul_overflow(count, size, &total))
+        return NULL;
+
+    void *ptr = allocate(total, __builtin_return_address(0));
+
+    if (ptr != NULL)
+        memset(ptr, 0, total);
+
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL)
+        return allocate(size, __builtin_return_address(0));
+
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+#ifdef ALLOC_TRACKING
+    // the tag moves with the memory, so it's simplest to always make a new allocation
+    void *new_ptr = allocate(size, __builtin_return_address(0));
+
+    if (new_ptr != NULL) {
+        size_t old_size = get_tag(ptr)->size;
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        free(ptr);
+    }
+#else
+    uint32_t flags = irq_save();
+    void *new_ptr = realloc_locked(&kernel_heap, ptr, size);
+    irq_restore(flags);
+#endif
+
+    return new_ptr;
+}
+
+// alignment must be a power of two
+void *memalign(size_t alignment, size_t size) {
+    if (alignment <= ALIGN_SIZE)
+        return allocate(size, __builtin_return_address(0));
+
+    // the tag goes right before the aligned memory, so a whole alignment's worth of space is left in front for it
+    size_t offset = TAG_SIZE == 0 ? 0 : alignment;
+
+    uint32_t flags = irq_save();
+    void *ptr = tag_allocation(memalign_locked(&kernel_heap, alignment, size + offset), offset, __builtin_return_address(0), size);
+    irq_restore(flags);
+
+    return ptr;
+}
+
+// turns a region into one free block followed by the block marking its end, returns that end block
+static struct block *add_region(struct tlsf *heap, uintptr_t start, size_t length) {
+    struct block *block = (struct block *) start;
+    block->size = length - 2 * BLOCK_HEADER_SIZE;
+    block->prev_phys = NULL;
+
+    struct block *sentinel = block_next(block);
+    sentinel->size = 0;
+    sentinel->prev_phys = block;
+
+    set_free(block, true);
+    insert_block(heap, block);
+    heap->total_size += block_size(block);
+
+    return sentinel;
+}
+
+// adds a region of memory to the heap
+void malloc_addblock(void *addr, size_t size) {
+    uintptr_t start = ((uintptr_t) addr + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+    uintptr_t end = ((uintptr_t) addr + size) & ~(ALIGN_SIZE - 1);
+
+    // each region needs room for at least one block plus the block marking its end, and can't hold a block bigger
+    // than the largest size class
+    while (end > start && end - start >= 2 * BLOCK_HEADER_SIZE + BLOCK_SIZE_MIN) {
+        size_t length = end - start;
+
+        if (length > BLOCK_SIZE_MAX)
+            length = BLOCK_SIZE_MAX;
+
+        uint32_t flags = irq_save();
+        add_region(&kernel_heap, start, length);
+        irq_restore(flags);
+
+        start += length;
+    }
+}
+
+// returns how much memory the heap manages in total, not counting the headers that split it up
+size_t malloc_total_size(void) {
+    return kernel_heap.total_size;
+}
+
+// returns how much memory is in free blocks. fragmentation may mean it can't all be allocated in one go
+size_t malloc_free_size(void) {
+    return kernel_heap.free_size;
+}
+
+/*
+ * separate heaps, each managing a single region that starts with the heap's own state. nothing outside the region
+ * points into it, so a heap and everything allocated from it can be copied somewhere and carried on with as long
+ * as it ends up at the same address (see snapshot.c). these don't disable interrupts, so they must only be used
+ * from one context
+ */
+
+// sets up a heap in the given memory, returns NULL if it's too small or too big
+struct tlsf *tlsf_create(void *memory, size_t size) {
+    uintptr_t start = ((uintptr_t) memory + sizeof(struct tlsf) + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+    uintptr_t end = ((uintptr_t) memory + size) & ~(ALIGN_SIZE - 1);
+
+    if (end <= start || end - start < 2 * BLOCK_HEADER_SIZE + BLOCK_SIZE_MIN || end - start > BLOCK_SIZE_MAX)
+        return NULL;
+
+    struct tlsf *heap = memory;
+    memset(heap, 0, sizeof(struct tlsf));
+    heap->sentinel = add_region(heap, start, end - start);
+
+    return heap;
+}
+
+void *tlsf_malloc(struct tlsf *heap, size_t size) {
+    return alloc_locked(heap, size);
+}
+
+void tlsf_free(struct tlsf *heap, void *ptr) {
+    if (ptr != NULL)
+        free_locked(heap, ptr);
+}
+
+void *tlsf_realloc(struct tlsf *heap, void *ptr, size_t size) {
+    if (ptr == NULL)
+        return alloc_locked(heap, size);
+
+    if (size == 0) {
+        free_locked(heap, ptr);
+        return NULL;
+    }
+
+    return realloc_locked(heap, ptr, size);
+}
+
+size_t tlsf_total_size(const struct tlsf *heap) {
+    return heap->total_size;
+}
+
+size_t tlsf_free_size(const struct tlsf *heap) {
+    return heap->free_size;
+}
+
+/*
+ * returns how many bytes from the start of a heap made by tlsf_create hold anything, which is everything up to the
+ * last block in use. if the heap ends with a free block only that block's header is needed, and the block marking
+ * the end of the region is rebuilt by tlsf_image_loaded
+ */
+size_t tlsf_image_size(struct tlsf *heap) {
+    struct block *last = heap->sentinel->prev_phys;
+    heap->sentinel_prev = last;
+
+    uint8_t *end = block_is_free(last) ? (uint8_t *) (last + 1) : (uint8_t *) heap->sentinel;
+    return end - (uint8_t *) heap;
+}
+
+// call once an image of tlsf_image_size bytes has been copied back to where the heap was
+void tlsf_image_loaded(struct tlsf *heap) {
+    heap->sentinel->size = 0;
+    heap->sentinel->prev_phys = heap->sentinel_prev;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+/* kernel heap, see tlsf.c. malloc, free, realloc and calloc are declared in stdlib.h as usual */
+
+void malloc_addblock(void *addr, size_t size);
+void *memalign(size_t alignment, size_t size);
+size_t malloc_total_size(void);
+size_t malloc_free_size(void);
+void malloc_report(void);
+
+/* heaps in a region of their own, used for the Lua heap when it needs to be snapshotted */
+struct tlsf;
+
+struct tlsf *tlsf_create(void *memory, size_t size);
+void *tlsf_malloc(struct tlsf *heap, size_t size);
+void tlsf_free(struct tlsf *heap, void *ptr);
+void *tlsf_realloc(struct tlsf *heap, void *ptr, size_t size);
+size_t tlsf_total_size(const struct tlsf *heap);
+size_t tlsf_free_size(const struct tlsf *heap);
+size_t tlsf_image_size(struct tlsf *heap);
+void tlsf_image_loaded(struct tlsf *heap);
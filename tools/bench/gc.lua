@@ -0,0 +1,131 @@
+-- a GC-heavy benchmark for the Lua allocator (see src/luaheap.c). it churns through small strings, tables and
+-- closures while keeping some of them alive, then reports how long each phase took and how fragmented the heap was
+-- left. it runs as bios.lua, so it needs nothing else in the initrd:
+--
+--     mkdir -p bench && cp tools/bench/gc.lua bench/bios.lua && tar -cf bench.tar -C bench bios.lua
+--     KERNEL_ARGS="luaprof=1" ./run.sh bench.tar
+--
+-- everything is printed to the serial port. to compare allocators, run it on kernels built before and after the
+-- change being measured, with the same -m and luamem. luaprof=1 adds GC pause times, but slows allocation down, so
+-- leave it off when comparing throughput
+
+local uptime = computer.uptime
+
+local ROUNDS = 200
+local PER_ROUND = 2000
+local KEEP_EVERY = 16
+
+local function memory(label)
+    collectgarbage("collect")
+
+    local total = computer.totalMemory()
+    local free = computer.freeMemory()
+    local live = math.floor(collectgarbage("count") * 1024)
+
+    -- the longest string that can still be made, which fragmentation gets in the way of. making one takes two blocks
+    -- that size at once, but that's the same on both sides of a comparison
+    local low, high = 0, free
+    while low < high do
+        local size = (low + high + 1) // 2
+        if pcall(string.rep, "x", size) then
+            low = size
+        else
+            high = size - 1
+        end
+        collectgarbage("collect")
+    end
+
+    print(string.format("%-8s live %9d, used %9d of %9d, free %9d, longest string %9d", label, live, total - free,
+        total, free, low))
+end
+
+local function phase(name, fn)
+    local start = uptime()
+    local count = fn()
+    local elapsed = uptime() - start
+
+    print(string.format("%-16s %8.3f s, %10.0f allocations/s", name, elapsed, count / elapsed))
+end
+
+print("gc.lua: " .. _VERSION .. ", " .. ROUNDS .. " rounds of " .. PER_ROUND)
+memory("before")
+
+-- whatever's kept from each phase, so the heap isn't empty again between them
+local kept = {}
+
+phase("strings", function()
+    for round = 1, ROUNDS do
+        for i = 1, PER_ROUND do
+            local s = "string " .. round .. ":" .. i
+            if i % KEEP_EVERY == 0 then
+                kept[#kept + 1] = s
+            end
+        end
+    end
+
+    return ROUNDS * PER_ROUND
+end)
+
+phase("tables", function()
+    for round = 1, ROUNDS do
+        for i = 1, PER_ROUND do
+            -- an array part and a hash part, so each one is a few allocations of different sizes
+            local t = {round, i, name = "t", [i] = true}
+            if i % KEEP_EVERY == 0 then
+                kept[#kept + 1] = t
+            end
+        end
+    end
+
+    return ROUNDS * PER_ROUND * 3
+end)
+
+phase("closures", function()
+    for round = 1, ROUNDS do
+        for i = 1, PER_ROUND do
+            local f = function() return round + i end
+            if i % KEEP_EVERY == 0 then
+                kept[#kept + 1] = f
+            end
+        end
+    end
+
+    return ROUNDS * PER_ROUND * 3
+end)
+
+phase("mixed", function()
+    -- growing and shrinking buffers mixed in with small objects, which is what breaks up a first-fit heap
+    for round = 1, ROUNDS do
+        local parts = {}
+        for i = 1, PER_ROUND // 4 do
+            parts[i] = string.rep("y", (i * 37) % 1024)
+            kept[(round * PER_ROUND + i) % (#kept + 1) + 1] = {i}
+        end
+        table.concat(parts)
+    end
+
+    return ROUNDS * PER_ROUND // 4 * 3
+end)
+
+memory("kept")
+
+local dropped = #kept
+kept = nil
+memory("after")
+
+if computer.getHeapProfile then
+    local profile = computer.getHeapProfile()
+
+    if profile then
+        print(string.format("%d GC pauses, %.3f s in total, %.3f ms at most", profile.pauses.count,
+            profile.pauses.total, profile.pauses.max * 1000))
+    else
+        print("boot with luaprof=1 for GC pause times")
+    end
+end
+
+print("done, " .. dropped .. " objects were kept")
+
+while true do
+    computer.pullSignal()
+end
@@ -0,0 +1,148 @@
+-- a throughput benchmark for the tmpfs component (see src/component/tmpfs.c and src/ramfs.c), going through the
+-- component API the same way OpenOS does. it writes, reads and removes lots of small files, then one large file,
+-- then fills the filesystem right up with small appends to see how files behave close to the space limit. it runs as
+-- bios.lua, so it needs nothing else in the initrd:
+--
+--     mkdir -p bench && cp tools/bench/tmpfs.lua bench/bios.lua && tar -cf bench.tar -C bench bios.lua
+--     KERNEL_ARGS="tmpsize=16M" ./run.sh bench.tar
+--
+-- everything is printed to the serial port
+
+local uptime = computer.uptime
+local fs = component.proxy(assert(computer.tmpAddress(), "no tmpfs"))
+
+local SMALL_FILES = 2000
+local SMALL_SIZE = 512
+local LARGE_CHUNK = 4096
+local APPEND_SIZE = 100
+
+-- how much is left free for the appends at the end, after the rest has been filled
+local NEAR_LIMIT = 1024 * 1024
+
+local function report(name, elapsed, count, what, bytes)
+    local line = string.format("%-20s %8.3f s, %10.0f %s/s", name, elapsed, count / elapsed, what)
+
+    if bytes then
+        line = line .. string.format(", %8.2f MiB/s", bytes / elapsed / 1048576)
+    end
+
+    print(line)
+end
+
+local function write_file(path, data, chunk)
+    local handle = fs.open(path, "w")
+
+    for i = 1, #data, chunk do
+        fs.write(handle, data:sub(i, i + chunk - 1))
+    end
+
+    fs.close(handle)
+end
+
+local function read_file(path, chunk)
+    local handle = fs.open(path, "r")
+    local size = 0
+
+    while true do
+        local data = fs.read(handle, chunk)
+        if data == nil then
+            break
+        end
+        size = size + #data
+    end
+
+    fs.close(handle)
+    return size
+end
+
+print(string.format("tmpfs.lua: %d of %d bytes used", fs.spaceUsed(), fs.spaceTotal()))
+
+-- lots of small files in one directory
+fs.makeDirectory("/small")
+local small = string.rep("s", SMALL_SIZE)
+
+local start = uptime()
+for i = 1, SMALL_FILES do
+    write_file("/small/" .. i, small, SMALL_SIZE)
+end
+report("small files written", uptime() - start, SMALL_FILES, "files", SMALL_FILES * SMALL_SIZE)
+
+start = uptime()
+for i = 1, SMALL_FILES do
+    assert(read_file("/small/" .. i, math.huge) == SMALL_SIZE)
+end
+report("small files read", uptime() - start, SMALL_FILES, "files", SMALL_FILES * SMALL_SIZE)
+
+start = uptime()
+assert(#fs.list("/small") == SMALL_FILES)
+report("small files listed", uptime() - start, SMALL_FILES, "files")
+
+start = uptime()
+for i = 1, SMALL_FILES do
+    fs.remove("/small/" .. i)
+end
+report("small files removed", uptime() - start, SMALL_FILES, "files")
+fs.remove("/small")
+
+-- one file half the size of the filesystem, written and read a chunk at a time
+local large_size = fs.spaceTotal() // 2 // LARGE_CHUNK * LARGE_CHUNK
+local large = string.rep("l", large_size)
+
+start = uptime()
+write_file("/large", large, LARGE_CHUNK)
+report("large file written", uptime() - start, large_size / LARGE_CHUNK, "writes", large_size)
+large = nil
+
+start = uptime()
+assert(read_file("/large", LARGE_CHUNK) == large_size)
+report("large file read", uptime() - start, large_size / LARGE_CHUNK, "reads", large_size)
+
+start = uptime()
+assert(read_file("/large", math.huge) == large_size)
+report("large file read whole", uptime() - start, 1, "reads", large_size)
+
+-- pad the filesystem out until it's nearly full, then grow a file a little at a time until there's no room left.
+-- this is where extents can't double any more, and if each append got one of its own they'd be tiny
+local padding = fs.open("/padding", "w")
+local chunk = string.rep("p", 64 * 1024)
+while fs.spaceTotal() - fs.spaceUsed() > NEAR_LIMIT + #chunk do
+    fs.write(padding, chunk)
+end
+fs.close(padding)
+
+local append = string.rep("a", APPEND_SIZE)
+local handle = fs.open("/appended", "a")
+local before = fs.spaceUsed()
+local appends = 0
+
+start = uptime()
+while pcall(fs.write, handle, append) do
+    appends = appends + 1
+end
+local elapsed = uptime() - start
+fs.close(handle)
+
+report("appends near limit", elapsed, appends, "writes", appends * APPEND_SIZE)
+
+-- whatever space went on anything other than the data itself is mostly extent headers
+local stored = appends * APPEND_SIZE
+print(string.format("%d bytes appended in %d bytes of space, %d bytes of overhead", stored, fs.spaceUsed() - before,
+    fs.spaceUsed() - before - stored))
+
+start = uptime()
+assert(read_file("/appended", APPEND_SIZE) == stored)
+report("appended file read", uptime() - start, appends, "reads", stored)
+
+start = uptime()
+assert(read_file("/appended", math.huge) == stored)
+report("appended read whole", uptime() - start, 1, "reads", stored)
+
+fs.remove("/appended")
+fs.remove("/padding")
+fs.remove("/large")
+
+print(string.format("done, %d bytes used", fs.spaceUsed()))
+
+while true do
+    computer.pullSignal()
+end
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+# converts a tar initrd into a packed one, where every file is compressed on its own as an LZ4 block so the kernel
+# only has to decompress the ones that actually get opened. see the packed archive format in src/tar.c
+#
+#     tools/pack-initrd.py initrd.tar initrd.pkrd
+#
+# the result can be passed to run.sh in place of the tar
+
+import struct
+import sys
+import tarfile
+
+MAGIC = 0x44524b50
+VERSION = 1
+
+# the LZ4 block format wants the last 5 bytes to be literals, and no match to start in the last 12
+LAST_LITERALS = 5
+MATCH_LIMIT = 12
+MIN_MATCH = 4
+MAX_OFFSET = 0xffff
+
+
+def write_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def write_sequence(out, literals, offset=0, match_length=0):
+    literal_length = len(literals)
+    match_code = match_length - MIN_MATCH if offset else 0
+
+    out.append((min(literal_length, 15) << 4) | min(match_code, 15))
+    if literal_length >= 15:
+        write_length(out, literal_length - 15)
+    out += literals
+
+    if offset:
+        out += struct.pack("<H", offset)
+        if match_code >= 15:
+            write_length(out, match_code - 15)
+
+
+# greedy LZ4 compression with a hash table of the last place every 4 byte sequence was seen
+def lz4_compress(data):
+    out = bytearray()
+    last_seen = {}
+    anchor = 0
+    i = 0
+    limit = len(data) - MATCH_LIMIT
+
+    while i < limit:
+        key = data[i:i + MIN_MATCH]
+        candidate = last_seen.get(key)
+        last_seen[key] = i
+
+        if candidate is None or i - candidate > MAX_OFFSET:
+            i += 1
+            continue
+
+        length = MIN_MATCH
+        while i + length < len(data) - LAST_LITERALS and data[candidate + length] == data[i + length]:
+            length += 1
+
+        write_sequence(out, data[anchor:i], i - candidate, length)
+        i += length
+        anchor = i
+
+    write_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: pack-initrd.py <input.tar> <output>")
+
+    entries = []
+
+    with tarfile.open(sys.argv[1]) as tar:
+        for member in tar:
+            if member.isdir():
+                entries.append((member.name, "5", member.mtime, b""))
+            elif member.isfile():
+                entries.append((member.name, "0", member.mtime, tar.extractfile(member).read()))
+
+    paths = bytearray()
+    path_offsets = []
+    for name, _, _, _ in entries:
+        path_offsets.append(len(paths))
+        paths += name.encode() + b"\0"
+
+    header_size = 16 + 24 * len(entries) + len(paths)
+    table = bytearray()
+    blobs = bytearray()
+    original_size = 0
+
+    for (name, kind, mtime, contents), path_offset in zip(entries, path_offsets):
+        stored = contents
+        if contents:
+            compressed = lz4_compress(contents)
+            if len(compressed) < len(contents):
+                stored = compressed
+
+        table += struct.pack("<6I", path_offset, ord(kind), int(mtime) & 0xffffffff, len(contents),
+                             header_size + len(blobs), len(stored))
+        blobs += stored
+        original_size += len(contents)
+
+    with open(sys.argv[2], "wb") as out:
+        out.write(struct.pack("<4I", MAGIC, VERSION, len(entries), len(paths)))
+        out.write(table)
+        out.write(paths)
+        out.write(blobs)
+
+    print("packed %d entries, %d bytes of files into %d bytes" % (len(entries), original_size, header_size + len(blobs)))
+
+
+if __name__ == "__main__":
+    main()